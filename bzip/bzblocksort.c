@@ -1015,6 +1015,240 @@ void mainSort ( UInt32* ptr,
 #undef CLEARMASK
 
 
+/*---------------------------------------------*/
+/*--- Linear time suffix sorting (SA-IS),   ---*/
+/*--- for blocks too repetitive for mainSort---*/
+/*---------------------------------------------*/
+
+/* Nong, Zhang and Chan's induced sorting, with a
+   virtual sentinel (smaller than every symbol) after
+   the end of the text, so that any byte value may
+   occur.  The text is bytes at the top level and
+   Int32 names in the recursion (cs is the symbol size);
+   the reduced text and its suffix array both live in
+   SA.  The type of each position (S = 1, L = 0) is kept
+   as a bitmap in t, and each level of the recursion
+   puts its own bitmap just after its caller's.
+*/
+#define sChr(i) ((cs == 1) ? (Int32)((UChar*)s)[i] : ((Int32*)s)[i])
+#define tGet(i) ((t[(i) >> 3] >> ((i) & 7)) & 1)
+#define tSet(i) (t[(i) >> 3] |= (UChar)(1 << ((i) & 7)))
+#define isLMS(i) ((i) > 0 && tGet(i) && !tGet((i)-1))
+
+static
+void saisBuckets ( void* s, Int32* bkt, Int32 n, Int32 K, 
+                   Int32 cs, Bool end )
+{
+   Int32 i, sum = 0;
+   for (i = 0; i <= K; i++) bkt[i] = 0;
+   for (i = 0; i < n; i++) bkt[sChr(i)]++;
+   for (i = 0; i <= K; i++) {
+      sum += bkt[i];
+      bkt[i] = end ? sum : sum - bkt[i];
+   }
+}
+
+static
+void saisInduce ( UChar* t, Int32* SA, void* s, Int32* bkt, 
+                  Int32 n, Int32 K, Int32 cs )
+{
+   Int32 i, j;
+
+   /* L-type suffixes, left to right, starting from the
+      one before the sentinel (the last position is
+      always L-type) */
+   saisBuckets ( s, bkt, n, K, cs, False );
+   SA[bkt[sChr(n-1)]++] = n-1;
+   for (i = 0; i < n; i++) {
+      j = SA[i] - 1;
+      if (j >= 0 && !tGet(j)) SA[bkt[sChr(j)]++] = j;
+   }
+
+   /* S-type suffixes, right to left */
+   saisBuckets ( s, bkt, n, K, cs, True );
+   for (i = n-1; i >= 0; i--) {
+      j = SA[i] - 1;
+      if (j >= 0 && tGet(j)) SA[--bkt[sChr(j)]] = j;
+   }
+}
+
+static
+void sais ( void* s, Int32* SA, UChar* t, Int32* bkt, 
+            Int32 n, Int32 K, Int32 cs )
+{
+   Int32 i, j, d, n1, name, prev, pos;
+   Bool  diff;
+
+   if (n == 1) { SA[0] = 0; return; }
+
+   /* classify the positions */
+   for (i = 0; i < (n+7) / 8; i++) t[i] = 0;
+   for (i = n-2; i >= 0; i--)
+      if (sChr(i) < sChr(i+1) || 
+          (sChr(i) == sChr(i+1) && tGet(i+1))) tSet(i);
+
+   /* stage 1: sort the LMS substrings */
+   saisBuckets ( s, bkt, n, K, cs, True );
+   for (i = 0; i < n; i++) SA[i] = -1;
+   for (i = 1; i < n; i++)
+      if (isLMS(i)) SA[--bkt[sChr(i)]] = i;
+   saisInduce ( t, SA, s, bkt, n, K, cs );
+
+   /* compact them into the first n1 items of SA */
+   n1 = 0;
+   for (i = 0; i < n; i++)
+      if (isLMS(SA[i])) SA[n1++] = SA[i];
+
+   /* name them; two LMS substrings are equal only if
+      neither reaches the sentinel.  LMS positions are
+      at least 2 apart, so pos/2 keys the names without
+      collisions in the free second half of SA */
+   for (i = n1; i < n; i++) SA[i] = -1;
+   name = 0;
+   prev = -1;
+   for (i = 0; i < n1; i++) {
+      pos = SA[i];
+      diff = False;
+      for (d = 0; d < n; d++) {
+         if (prev == -1 || pos+d == n || prev+d == n ||
+             sChr(pos+d) != sChr(prev+d) || 
+             tGet(pos+d) != tGet(prev+d)) {
+            diff = True; break;
+         }
+         if (d > 0 && (isLMS(pos+d) || isLMS(prev+d))) break;
+      }
+      if (diff) { name++; prev = pos; }
+      SA[n1 + pos/2] = name-1;
+   }
+   for (i = n-1, j = n-1; i >= n1; i--)
+      if (SA[i] >= 0) SA[j--] = SA[i];
+
+   /* stage 2: sort the reduced text, recursing unless
+      the names are already unique */
+   {
+      Int32* s1  = SA + n - n1;
+      if (name < n1) {
+         sais ( (void*)s1, SA, t + (n+7) / 8, bkt, n1, name-1, 4 );
+      } else {
+         for (i = 0; i < n1; i++) SA[s1[i]] = i;
+      }
+
+      /* stage 3: induce the full order from the sorted 
+         LMS suffixes, put back at the ends of their
+         buckets in reverse */
+      for (i = 1, j = 0; i < n; i++)
+         if (isLMS(i)) s1[j++] = i;
+      for (i = 0; i < n1; i++) SA[i] = s1[SA[i]];
+   }
+   for (i = n1; i < n; i++) SA[i] = -1;
+   saisBuckets ( s, bkt, n, K, cs, True );
+   for (i = n1-1; i >= 0; i--) {
+      j = SA[i];
+      SA[i] = -1;
+      SA[--bkt[sChr(j)]] = j;
+   }
+   saisInduce ( t, SA, s, bkt, n, K, cs );
+}
+
+#undef sChr
+#undef tGet
+#undef tSet
+#undef isLMS
+
+
+/*---------------------------------------------*/
+static
+void reverseBytes ( UChar* block, Int32 lo, Int32 hi )
+{
+   UChar tmp;
+   for (; lo < hi; lo++, hi--) {
+      tmp = block[lo]; block[lo] = block[hi]; block[hi] = tmp;
+   }
+}
+
+/* Rotates the block left by r, in place */
+static
+void rotateBlock ( UChar* block, Int32 nblock, Int32 r )
+{
+   if (r == 0) return;
+   reverseBytes ( block, 0, r-1 );
+   reverseBytes ( block, r, nblock-1 );
+   reverseBytes ( block, 0, nblock-1 );
+}
+
+/* The start of the lexicographically least rotation */
+static
+Int32 leastRotation ( UChar* block, Int32 nblock )
+{
+   Int32 i = 0, j = 1, k = 0, a, b;
+   while (i < nblock && j < nblock && k < nblock) {
+      a = block[(i+k) % nblock];
+      b = block[(j+k) % nblock];
+      if (a == b) { k++; continue; }
+      if (a > b) i += k+1; else j += k+1;
+      if (i == j) j++;
+      k = 0;
+   }
+   return (i < j) ? i : j;
+}
+
+/* The smallest period of the block that divides its
+   length, or nblock if it has none.  ptr holds the
+   KMP failure function meanwhile. */
+static
+Int32 blockPeriod ( UInt32* ptr, UChar* block, Int32 nblock )
+{
+   Int32 i, k = 0, p;
+   ptr[0] = 0;
+   for (i = 1; i < nblock; i++) {
+      while (k > 0 && block[i] != block[k]) k = ptr[k-1];
+      if (block[i] == block[k]) k++;
+      ptr[i] = k;
+   }
+   p = nblock - ptr[nblock-1];
+   return (nblock % p == 0) ? p : nblock;
+}
+
+/* Sorts the rotations of the block into ptr in linear
+   time, in the same order as fallbackSort.  Once the
+   block is rotated to start at its least rotation, the
+   order of its suffixes (with a sentinel) is the order
+   of its rotations.  That order is unique unless the
+   block is a whole number of repeats of a shorter
+   period; the order fallbackSort leaves identical
+   rotations in is not worth reproducing, so False is
+   returned for such a block and it is left unsorted.
+   The work space after the block in arr2 holds the
+   type bitmaps (n/4 bytes over all levels) and the
+   buckets (n/2 names at most).
+*/
+static
+Bool suffixSort ( UInt32* ptr, UChar* block, UChar* work, 
+                  Int32 nblock, Int32 verb )
+{
+   Int32  r;
+   Int32* bkt = (Int32*)work;
+   UChar* t = work + ((nblock/2 > 256 ? nblock/2 : 256) + 1) * sizeof(Int32);
+   Int32  i;
+
+   if (blockPeriod ( ptr, block, nblock ) < nblock) return False;
+   r = leastRotation ( block, nblock );
+
+   if (verb >= 4)
+      VPrintf1 ( "        suffix sorting from rotation %d\n", r );
+
+   rotateBlock ( block, nblock, r );
+   sais ( (void*)block, (Int32*)ptr, t, bkt, nblock, 255, 1 );
+   rotateBlock ( block, nblock, nblock - r );
+
+   for (i = 0; i < nblock; i++) {
+      ptr[i] += r;
+      if (ptr[i] >= (UInt32)nblock) ptr[i] -= nblock;
+   }
+   return True;
+}
+
+
 /*---------------------------------------------*/
 /* Pre:
       nblock > 0
@@ -1074,9 +1308,15 @@ void BZ2_blockSort ( EState* s )
                     (float)(nblock==0 ? 1 : nblock) ); 
       if (budget < 0) {
          if (verb >= 2) 
-            VPrintf0 ( "    too repetitive; using fallback"
-                       " sorting algorithm\n" );
-         fallbackSort ( s->arr1, s->arr2, ftab, nblock, verb );
+            VPrintf0 ( "    too repetitive; using linear time"
+                       " suffix sorting\n" );
+         /* rather than fallbackSort, whose O(N log(N)^2)
+            is many times slower than mainSort at its
+            best.  The work space is the quadrant area,
+            aligned for Int32. */
+         if (!suffixSort ( ptr, block, (UChar*)quadrant + (i & 2), 
+                           nblock, verb ))
+            fallbackSort ( s->arr1, s->arr2, ftab, nblock, verb );
       }
    }
 
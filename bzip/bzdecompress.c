@@ -71,8 +71,33 @@ void makeMaps_d ( DState* s )
    GET_BITS(lll,uuu,1)
 
 /*---------------------------------------------------*/
+/* Tops the bit buffer up to at least 25 bits, as far 
+   as the input allows, so that a code can be looked 
+   up without returning for more input.
+*/
+#define FILL_BITS                                 \
+   while (s->bsLive <= 24 && s->strm->avail_in > 0) { \
+      s->bsBuff                                   \
+         = (s->bsBuff << 8) |                     \
+           ((UInt32)                              \
+              (*((UChar*)(s->strm->next_in))));   \
+      s->bsLive += 8;                             \
+      s->strm->next_in++;                         \
+      s->strm->avail_in--;                        \
+      s->strm->total_in_lo32++;                   \
+      if (s->strm->total_in_lo32 == 0)            \
+         s->strm->total_in_hi32++;                \
+   }
+
+/*---------------------------------------------------*/
+/* Codes of up to BZ_LOOKUP_BITS bits take one lookup;
+   longer ones, and those near the end of the input, 
+   walk the limit table a bit at a time.  A resumed 
+   call re-enters the walk through its case labels.
+*/
 #define GET_MTF_VAL(label1,label2,lval)           \
 {                                                 \
+   UInt32 zl = 0;                                 \
    if (groupPos == 0) {                           \
       groupNo++;                                  \
       if (groupNo >= nSelectors)                  \
@@ -83,22 +108,33 @@ void makeMaps_d ( DState* s )
       gLimit = &(s->limit[gSel][0]);              \
       gPerm = &(s->perm[gSel][0]);                \
       gBase = &(s->base[gSel][0]);                \
+      gLookup = &(s->lookup[gSel][0]);            \
    }                                              \
    groupPos--;                                    \
-   zn = gMinlen;                                  \
-   GET_BITS(label1, zvec, zn);                    \
-   while (1) {                                    \
-      if (zn > 20 /* the longest code */)         \
+   FILL_BITS;                                     \
+   if (s->bsLive >= BZ_LOOKUP_BITS)               \
+      zl = gLookup[(s->bsBuff >>                  \
+              (s->bsLive - BZ_LOOKUP_BITS)) &     \
+              ((1 << BZ_LOOKUP_BITS) - 1)];       \
+   if (zl != 0) {                                 \
+      s->bsLive -= zl >> BZ_LOOKUP_SYM_BITS;      \
+      lval = zl & ((1 << BZ_LOOKUP_SYM_BITS) - 1);\
+   } else {                                       \
+      zn = gMinlen;                               \
+      GET_BITS(label1, zvec, zn);                 \
+      while (1) {                                 \
+         if (zn > 20 /* the longest code */)      \
+            RETURN(BZ_DATA_ERROR);                \
+         if (zvec <= gLimit[zn]) break;           \
+         zn++;                                    \
+         GET_BIT(label2, zj);                     \
+         zvec = (zvec << 1) | zj;                 \
+      };                                          \
+      if (zvec - gBase[zn] < 0                    \
+          || zvec - gBase[zn] >= BZ_MAX_ALPHA_SIZE) \
          RETURN(BZ_DATA_ERROR);                   \
-      if (zvec <= gLimit[zn]) break;              \
-      zn++;                                       \
-      GET_BIT(label2, zj);                        \
-      zvec = (zvec << 1) | zj;                    \
-   };                                             \
-   if (zvec - gBase[zn] < 0                       \
-       || zvec - gBase[zn] >= BZ_MAX_ALPHA_SIZE)  \
-      RETURN(BZ_DATA_ERROR);                      \
-   lval = gPerm[zvec - gBase[zn]];                \
+      lval = gPerm[zvec - gBase[zn]];             \
+   }                                              \
 }
 
 
@@ -135,6 +171,7 @@ Int32 BZ2_decompress ( DState* s )
    Int32* gLimit;
    Int32* gBase;
    Int32* gPerm;
+   UInt16* gLookup;
 
    if (s->state == BZ_X_MAGIC_1) {
       /*initialise the save area*/
@@ -162,6 +199,7 @@ Int32 BZ2_decompress ( DState* s )
       s->save_gLimit      = NULL;
       s->save_gBase       = NULL;
       s->save_gPerm       = NULL;
+      s->save_gLookup     = NULL;
    }
 
    /*restore from the save area*/
@@ -189,6 +227,7 @@ Int32 BZ2_decompress ( DState* s )
    gLimit      = s->save_gLimit;
    gBase       = s->save_gBase;
    gPerm       = s->save_gPerm;
+   gLookup     = s->save_gLookup;
 
    retVal = BZ_OK;
 
@@ -216,7 +255,11 @@ Int32 BZ2_decompress ( DState* s )
          if (s->ll16 == NULL || s->ll4 == NULL) RETURN(BZ_MEM_ERROR);
       } else {
          s->tt  = BZALLOC( s->blockSize100k * 100000 * sizeof(Int32) );
-         if (s->tt == NULL) RETURN(BZ_MEM_ERROR);
+         s->lf  = BZALLOC( s->blockSize100k * 100000 * sizeof(Int32) );
+         s->bwtOut = BZALLOC( s->blockSize100k * 100000 + 
+                              BZ_N_BWT_OVERSHOOT );
+         if (s->tt == NULL || s->lf == NULL || s->bwtOut == NULL) 
+            RETURN(BZ_MEM_ERROR);
       }
 
       GET_UCHAR(BZ_X_BLKHDR_1, uc);
@@ -343,6 +386,13 @@ Int32 BZ2_decompress ( DState* s )
             &(s->len[t][0]),
             minLen, maxLen, alphaSize
          );
+         BZ2_hbCreateLookupTable ( 
+            &(s->lookup[t][0]),
+            &(s->limit[t][0]), 
+            &(s->base[t][0]), 
+            &(s->perm[t][0]), 
+            minLen
+         );
          s->minLens[t] = minLen;
       }
 
@@ -536,14 +586,51 @@ Int32 BZ2_decompress ( DState* s )
 
       } else {
 
-         /*-- compute the T^(-1) vector --*/
-         for (i = 0; i < nblock; i++) {
-            uc = (UChar)(s->tt[i] & 0xff);
-            s->tt[s->cftab[uc]] |= (i << 8);
-            s->cftab[uc]++;
+         /*-- compute the T^(-1) vector, and T alongside it,
+              with each entry's own byte --*/
+         {
+            UInt32* tt = s->tt;
+            UInt32* lf = s->lf;
+            for (i = 0; i < nblock; i++) {
+               uc = (UChar)(tt[i] & 0xff);
+               tt[s->cftab[uc]] |= (i << 8);
+               lf[i] = (s->cftab[uc] << 8) | uc;
+               s->cftab[uc]++;
+            }
+         }
+
+         /*-- Undo the transform into bwtOut, the first half
+              forwards through T^(-1) and the second backwards 
+              through T.  The two walks are independent, so 
+              their cache misses overlap.  Entry j of the 
+              cycle, j = nblock included, is the block's
+              byte j (mod nblock). --*/
+         {
+            const UInt32* tt = s->tt;
+            const UInt32* lf = s->lf;
+            UChar* out = s->bwtOut;
+            UInt32 fPos, bPos, fe, be;
+            Int32  half = (nblock + 1) / 2;
+            fPos = tt[s->origPtr] >> 8;
+            bPos = lf[fPos] >> 8;
+            for (i = 0, j = nblock - 1; j >= half; i++, j--) {
+               fe = tt[fPos];
+               be = lf[bPos];
+               out[i] = (UChar)(fe & 0xff);
+               out[j] = (UChar)(be & 0xff);
+               fPos = fe >> 8;
+               bPos = be >> 8;
+            }
+            for (; i < half; i++) {
+               fe = tt[fPos];
+               out[i] = (UChar)(fe & 0xff);
+               fPos = fe >> 8;
+            }
+            for (i = 0; i < BZ_N_BWT_OVERSHOOT; i++)
+               out[nblock + i] = out[i % nblock];
          }
 
-         s->tPos = s->tt[s->origPtr] >> 8;
+         s->tPos = 0;
          s->nblock_used = 0;
          if (s->blockRandomised) {
             BZ_RAND_INIT_MASK;
@@ -616,6 +703,7 @@ Int32 BZ2_decompress ( DState* s )
    s->save_gLimit      = gLimit;
    s->save_gBase       = gBase;
    s->save_gPerm       = gPerm;
+   s->save_gLookup     = gLookup;
 
    return retVal;   
 }
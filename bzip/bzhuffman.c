@@ -200,6 +200,37 @@ void BZ2_hbCreateDecodeTables ( Int32 *limit,
 }
 
 
+/*---------------------------------------------------*/
+/* Fills the table with what the limit/base/perm walk 
+   in the decoder makes of every BZ_LOOKUP_BITS-bit
+   lookahead, so that one lookup replaces it for codes
+   no longer than that.  Lookaheads the walk rejects, or
+   needs more bits for, are left 0 for it to handle.
+*/
+void BZ2_hbCreateLookupTable ( UInt16 *lookup,
+                               Int32 *limit,
+                               Int32 *base,
+                               Int32 *perm,
+                               Int32 minLen )
+{
+   Int32 v, zn, zvec;
+
+   for (v = 0; v < (1 << BZ_LOOKUP_BITS); v++) {
+      lookup[v] = 0;
+      for (zn = minLen; zn <= BZ_LOOKUP_BITS; zn++) {
+         zvec = v >> (BZ_LOOKUP_BITS - zn);
+         if (zvec <= limit[zn]) {
+            if (zvec - base[zn] >= 0 && 
+                zvec - base[zn] < BZ_MAX_ALPHA_SIZE)
+               lookup[v] = (UInt16)(perm[zvec - base[zn]] | 
+                                    (zn << BZ_LOOKUP_SYM_BITS));
+            break;
+         }
+      }
+   }
+}
+
+
 /*-------------------------------------------------------------*/
 /*--- end                                         huffman.c ---*/
 /*-------------------------------------------------------------*/
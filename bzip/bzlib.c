@@ -523,6 +523,8 @@ int BZ_API(BZ2_bzDecompressInit)
    s->ll4                   = NULL;
    s->ll16                  = NULL;
    s->tt                    = NULL;
+   s->lf                    = NULL;
+   s->bwtOut                = NULL;
    s->currBlockNo           = 0;
    s->verbosity             = verbosity;
 
@@ -596,7 +598,7 @@ Bool unRLE_obuf_to_output_FAST ( DState* s )
       Int32         c_state_out_len      = s->state_out_len;
       Int32         c_nblock_used        = s->nblock_used;
       Int32         c_k0                 = s->k0;
-      UInt32*       c_tt                 = s->tt;
+      UChar*        c_bwtOut             = s->bwtOut;
       UInt32        c_tPos               = s->tPos;
       char*         cs_next_out          = s->strm->next_out;
       unsigned int  cs_avail_out         = s->strm->avail_out;
@@ -673,7 +675,6 @@ Bool unRLE_obuf_to_output_FAST ( DState* s )
       s->state_out_len      = c_state_out_len;
       s->nblock_used        = c_nblock_used;
       s->k0                 = c_k0;
-      s->tt                 = c_tt;
       s->tPos               = c_tPos;
       s->strm->next_out     = cs_next_out;
       s->strm->avail_out    = cs_avail_out;
@@ -869,6 +870,8 @@ int BZ_API(BZ2_bzDecompressEnd)  ( bz_stream *strm )
    if (s->strm != strm) return BZ_PARAM_ERROR;
 
    if (s->tt   != NULL) BZFREE(s->tt);
+   if (s->lf   != NULL) BZFREE(s->lf);
+   if (s->bwtOut != NULL) BZFREE(s->bwtOut);
    if (s->ll16 != NULL) BZFREE(s->ll16);
    if (s->ll4  != NULL) BZFREE(s->ll4);
 
@@ -342,6 +342,16 @@ BZ2_hbMakeCodeLengths ( UChar*, Int32*, Int32, Int32 );
 
 
 
+/*-- Constants for the table-driven Huffman decoder. --*/
+
+/* A lookup table entry holds the symbol in its low 9 bits
+   and the code length above them, or 0 for a code longer 
+   than BZ_LOOKUP_BITS, which is decoded a bit at a time */
+#define BZ_LOOKUP_BITS 10
+#define BZ_LOOKUP_SYM_BITS 9
+
+
+
 /*-- Structure holding all the decompression-side stuff. --*/
 
 typedef
@@ -377,8 +387,12 @@ typedef
       Int32    cftab[257];
       Int32    cftabCopy[257];
 
-      /* for undoing the Burrows-Wheeler transform (FAST) */
+      /* for undoing the Burrows-Wheeler transform (FAST);
+         lf is the inverse of the permutation in tt, and 
+         bwtOut the block, walked both ways at once */
       UInt32   *tt;
+      UInt32   *lf;
+      UChar    *bwtOut;
 
       /* for undoing the Burrows-Wheeler transform (SMALL) */
       UInt16   *ll16;
@@ -407,6 +421,7 @@ typedef
       Int32    base   [BZ_N_GROUPS][BZ_MAX_ALPHA_SIZE];
       Int32    perm   [BZ_N_GROUPS][BZ_MAX_ALPHA_SIZE];
       Int32    minLens[BZ_N_GROUPS];
+      UInt16   lookup [BZ_N_GROUPS][1 << BZ_LOOKUP_BITS];
 
       /* save area for scalars in the main decompress code */
       Int32    save_i;
@@ -433,6 +448,7 @@ typedef
       Int32*   save_gLimit;
       Int32*   save_gBase;
       Int32*   save_gPerm;
+      UInt16*  save_gLookup;
 
    }
    DState;
@@ -441,15 +457,15 @@ typedef
 
 /*-- Macros for decompression. --*/
 
+/* tPos indexes bwtOut, which has BZ_N_BWT_OVERSHOOT bytes
+   past the block for the reads a corrupt stream makes */
+#define BZ_N_BWT_OVERSHOOT 5
+
 #define BZ_GET_FAST(cccc)                     \
-    s->tPos = s->tt[s->tPos];                 \
-    cccc = (UChar)(s->tPos & 0xff);           \
-    s->tPos >>= 8;
+    cccc = s->bwtOut[s->tPos++];
 
 #define BZ_GET_FAST_C(cccc)                   \
-    c_tPos = c_tt[c_tPos];                    \
-    cccc = (UChar)(c_tPos & 0xff);            \
-    c_tPos >>= 8;
+    cccc = c_bwtOut[c_tPos++];
 
 #define SET_LL4(i,n)                                          \
    { if (((i) & 0x1) == 0)                                    \
@@ -485,6 +501,10 @@ extern void
 BZ2_hbCreateDecodeTables ( Int32*, Int32*, Int32*, UChar*,
                            Int32,  Int32, Int32 );
 
+extern void 
+BZ2_hbCreateLookupTable ( UInt16*, Int32*, Int32*, Int32*, 
+                          Int32 );
+
 
 #endif
 
@@ -2,6 +2,31 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <math.h>
+
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <chrono>
+#include <mutex>
+#include <memory>
+#include <new>
+#include <map>
+#include <list>
+#include <unordered_map>
+#include <string>
+#include <algorithm>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #include "compression.h"
 
@@ -37,801 +62,4683 @@ extern "C"
 namespace COMPRESSION
 {
 
-typedef unsigned long CRC32; // crc datatype.
-const CRC32 CRC32_POLYNOMIAL=0xEDB88320L;
+// Two checksums are supported: the original CRC-32, which payloads written before CRC-32C still carry, and CRC-32C.
+// Both are computed eight bytes at a time from slicing tables, and CRC-32C uses the SSE4.2 crc32 instruction
+// when the CPU has it.  Neither pre- nor post-inverts; callers seed and finish the value themselves.
+const unsigned int CRC32_POLYNOMIAL=0xEDB88320;
+const unsigned int CRC32C_POLYNOMIAL=0x82F63B78;
 
-static  bool         mFirst=true;
-static  unsigned int CRCTable[256];
-
-static void BuildCRCTable(void)
+struct CRCTables
 {
-  int i;
-  int j;
-  unsigned int crc;
+  unsigned int mTable[8][256];
 
-  for ( i = 0; i <= 255 ; i++ )
+  CRCTables(unsigned int polynomial)
   {
-    crc = i;
-    for ( j = 8 ; j > 0; j-- )
+    for (unsigned int i=0; i<256; i++)
     {
-      if ( crc & 1 )
-        crc = ( crc >> 1 ) ^ CRC32_POLYNOMIAL;
-      else
-        crc >>= 1;
+      unsigned int crc = i;
+      for (int j=0; j<8; j++)
+      {
+        crc = (crc & 1) ? (crc >> 1) ^ polynomial : crc >> 1;
+      }
+      mTable[0][i] = crc;
+    }
+    for (unsigned int i=0; i<256; i++)
+    {
+      for (int k=1; k<8; k++)
+      {
+        mTable[k][i] = (mTable[k-1][i] >> 8) ^ mTable[0][mTable[k-1][i] & 0xff];
+      }
     }
-    CRCTable[i] = crc;
   }
-}
-
-static inline unsigned int ComputeCRC(char c,unsigned int &crc)  // add into accumulated crc.
-{
-  unsigned int temp1 = ( crc >> 8 ) & 0x00FFFFFFL;
-  unsigned int temp2 = CRCTable[ ( (int) crc ^ c ) & 0xff ];
-  crc = temp1 ^ temp2;
-  return crc;
-}
+};
 
-unsigned int ComputeCRC(const void *buffer,int count,unsigned int crc=0)
+// Function-local statics are built exactly once, even when the first calls are made from several threads at once.
+static const CRCTables & crc32Tables(void)
 {
-
-  if ( mFirst )
-  {
-    BuildCRCTable();
-    mFirst = false;
-  }
-
-  crc = crc^count;
-  const unsigned char * p = (const unsigned char*) buffer;
-  while ( count-- != 0 )
-  {
-    ComputeCRC( *p++, crc );
-  }
-  return( crc&0x7FFFFFFF );
+  static const CRCTables tables(CRC32_POLYNOMIAL);
+  return tables;
 }
 
-void deleteData(void* mem)
+static const CRCTables & crc32cTables(void)
 {
-  free(mem);
+  static const CRCTables tables(CRC32C_POLYNOMIAL);
+  return tables;
 }
 
-struct CompressionHeader
-{
-  int             mRawLength;
-  int             mCompressedLength;
-  unsigned int    mCRC;
-  char            mId[4];
-};
-
-void * compressMiniLZO(const void *source,int len,int &outlen)
+static unsigned int SliceCRC(const CRCTables &tables,const void *buffer,size_t count,unsigned int crc)
 {
-#if USE_MINI_LZO
-  const int SCRATCHPAD=65536;
-  char wrkmem[LZO1X_1_MEM_COMPRESS];
+  const unsigned int (*t)[256] = tables.mTable;
+  const unsigned char *p = (const unsigned char *) buffer;
 
-  CompressionHeader *h = (CompressionHeader *) malloc(len+SCRATCHPAD+sizeof(CompressionHeader));
-  unsigned char *dest = (unsigned char *)h;
-  dest+=sizeof(CompressionHeader);
-  lzo_init();
-  int r = lzo1x_1_compress((const unsigned char *)source,len,dest,(lzo_uint *)&outlen,wrkmem);
-
-  if ( r == LZO_E_OK )
+  for (; count && ((size_t)p & 7); count--)
   {
-    h->mRawLength        = len;
-    h->mCRC              = ComputeCRC((const unsigned char *)dest,outlen,h->mRawLength);
-    outlen+=sizeof(CompressionHeader);
-    h->mCompressedLength = outlen;
-    h->mId[0]            = 'M';
-    h->mId[1]            = 'L';
-    h->mId[2]            = 'Z';
-    h->mId[3]            = 'O';
-
+    crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
   }
-  else
+  for (; count >= 8; count-=8, p+=8)
+  {
+    unsigned int lo, hi;
+    memcpy(&lo,p,4);
+    memcpy(&hi,p+4,4);
+    lo ^= crc;
+    crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+          t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+  }
+  for (; count; count--)
   {
-    free(h);
-    h = 0;
+    crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
   }
+  return crc;
+}
 
-  return h;
+#if defined(_M_X64) || defined(__x86_64__)
+#define CRC32C_HARDWARE 1
+#ifdef _MSC_VER
+#include <intrin.h>
+#include <nmmintrin.h>
+#define CRC32C_TARGET
 #else
-
-  outlen = 0;
-  return 0;
-
+#include <cpuid.h>
+#include <nmmintrin.h>
+#define CRC32C_TARGET __attribute__((target("sse4.2")))
 #endif
 
-}
-
-#if USE_CRYPTO
-void * compressCRYPTO_GZIP(const void *source,int len,int &outlen)
+static bool HasSSE42(void)
 {
-  void * ret = 0;
-
-  outlen = 0;
-  std::string outStringOfBytes;
-  CryptoPP::Gzip zipper( new CryptoPP::StringSink(outStringOfBytes)); // I have been told that this is not a memory leak, that zipper takes ownership of this memory.  Which is bullshit, but what are you gonna do?
-  zipper.Put( (const byte *)source,len);
-  zipper.MessageEnd();
-
-  unsigned int slen = outStringOfBytes.length();
-  const char *data  = outStringOfBytes.c_str();
-
-  outlen = slen+sizeof(CompressionHeader);
-  char *dest = (char *)malloc(outlen);
-  ret = dest;
-
-  CompressionHeader *h = (CompressionHeader *) dest;
-
-  h->mRawLength        = len;
-  h->mCompressedLength = outlen;
-  h->mCRC              = ComputeCRC(data,slen,h->mRawLength);
-  h->mId[0]            = 'C';
-  h->mId[1]            = 'R';
-  h->mId[2]            = 'P';
-  h->mId[3]            = 'T';
-
-  h++;
-  dest = (char *) h;
-  memcpy(dest,data,slen);
-
-  return ret;
-}
+#ifdef _MSC_VER
+  int info[4];
+  __cpuid(info,1);
+  return (info[2] & (1<<20)) != 0;
+#else
+  unsigned int a, b, c, d;
+  return __get_cpuid(1,&a,&b,&c,&d) && (c & bit_SSE4_2) != 0;
 #endif
+}
 
-#if USE_ZLIB
-void * compressZLIB(const void *source,int len,int &outlen)
+CRC32C_TARGET static unsigned int HardwareCRC32C(const void *buffer,size_t count,unsigned int crc)
 {
+  const unsigned char *p = (const unsigned char *) buffer;
 
-  uLong csize = compressBound(len);
-
-  CompressionHeader *h = (CompressionHeader *) malloc(csize+sizeof(CompressionHeader));
-  unsigned char *dest = (unsigned char *)h;
-  dest+=sizeof(CompressionHeader);
-
-  int err = compress2((Bytef *)dest,&csize,(Bytef *)source,len, Z_BEST_SPEED);
-
-  if ( err == Z_OK )
+  for (; count && ((size_t)p & 7); count--)
   {
-    outlen = csize;
-
-    h->mRawLength        = len;
-    h->mCRC              = ComputeCRC((const unsigned char *)dest,outlen,h->mRawLength);
-    outlen+=sizeof(CompressionHeader);
-    h->mCompressedLength = outlen;
-    h->mId[0]            = 'Z';
-    h->mId[1]            = 'L';
-    h->mId[2]            = 'I';
-    h->mId[3]            = 'B';
+    crc = _mm_crc32_u8(crc,*p++);
   }
-  else
+  unsigned long long crc64 = crc;
+  for (; count >= 8; count-=8, p+=8)
   {
-    outlen = 0;
-    free(h);
-    h = 0;
+    unsigned long long v;
+    memcpy(&v,p,8);
+    crc64 = _mm_crc32_u64(crc64,v);
   }
-
-  return h;
+  crc = (unsigned int)crc64;
+  for (; count; count--)
+  {
+    crc = _mm_crc32_u8(crc,*p++);
+  }
+  return crc;
 }
 #endif
 
-void * compressBZIP(const void *source,int len,int &outlen)
+static unsigned int AccumulateCRC(const void *buffer,size_t count,unsigned int crc)
 {
-
-  unsigned int csize = len+65536;
-
-  CompressionHeader *h = (CompressionHeader *) malloc(csize+sizeof(CompressionHeader));
-  unsigned char *dest = (unsigned char *)h;
-  dest+=sizeof(CompressionHeader);
-
-  int err = BZ2_bzBuffToBuffCompress((char *)dest,&csize,(char *)source,(unsigned int)len,1,0,30);
-
-  if ( err == 0 )
-  {
-    outlen = csize;
-
-    h->mRawLength        = len;
-    h->mCRC              = ComputeCRC((const unsigned char *)dest,outlen,h->mRawLength);
-    outlen+=sizeof(CompressionHeader);
-    h->mCompressedLength = outlen;
-    h->mId[0]            = 'B';
-    h->mId[1]            = 'Z';
-    h->mId[2]            = 'I';
-    h->mId[3]            = 'P';
-  }
-  else
-  {
-    outlen = 0;
-    free(h);
-    h = 0;
-  }
-
-  return h;
+  return SliceCRC(crc32Tables(),buffer,count,crc);
 }
 
-void * compressLIBLZF(const void *source,int len,int &outlen)
+static unsigned int AccumulateCRC32C(const void *buffer,size_t count,unsigned int crc)
 {
-  unsigned int csize = len + 65536;
-  CompressionHeader *h = (CompressionHeader *) malloc(csize+sizeof(CompressionHeader));
-  unsigned char *dest = (unsigned char *)h;
-  dest+=sizeof(CompressionHeader);
-
-  outlen = lzf_compress(source, len, dest, csize);
-
-  if (outlen != 0)
+#if CRC32C_HARDWARE
+  static const bool hardware = HasSSE42();
+  if ( hardware )
   {
-    h->mRawLength        = len;
-    h->mCRC              = ComputeCRC((const unsigned char *)dest,outlen,h->mRawLength);
-    outlen+=sizeof(CompressionHeader);
-    h->mCompressedLength = outlen;
-    h->mId[0]            = 'L';
-    h->mId[1]            = 'L';
-    h->mId[2]            = 'Z';
-    h->mId[3]            = 'F';
+    return HardwareCRC32C(buffer,count,crc);
   }
-  else
-  {
-    free(h);
-	h = 0;
-  }
-
-  return h;
+#endif
+  return SliceCRC(crc32cTables(),buffer,count,crc);
 }
 
-void* Alloc(void *p, size_t size) { return malloc(size); }
-void Free(void *p, void *address) { if (address) free(address); }
-
-ISzAlloc alloc = { Alloc, Free };
+// A 64-bit hash of the raw data, computing the same values as XXH64.
+const unsigned long long HASH_PRIME1=11400714785074694791ULL;
+const unsigned long long HASH_PRIME2=14029467366897019727ULL;
+const unsigned long long HASH_PRIME3=1609587929392839161ULL;
+const unsigned long long HASH_PRIME4=9650029242287828579ULL;
+const unsigned long long HASH_PRIME5=2870177450012600261ULL;
 
-void * compressLZMA(const void *source,int len,int &outlen)
+static inline unsigned long long Rotate64(unsigned long long v,int bits)
 {
+  return (v << bits) | (v >> (64-bits));
+}
 
-  uLong csize = len*2;
+static inline unsigned long long Read64(const unsigned char *p)
+{
+  unsigned long long v;
+  memcpy(&v,p,8);
+  return v;
+}
 
-  CompressionHeader *h = (CompressionHeader *) malloc(csize+sizeof(CompressionHeader));
-  unsigned char *dest = (unsigned char *)h;
-  dest+=sizeof(CompressionHeader);
+static inline unsigned long long HashRound(unsigned long long acc,unsigned long long input)
+{
+  return Rotate64(acc+input*HASH_PRIME2,31)*HASH_PRIME1;
+}
 
-    CLzmaEncProps props;
-    LzmaEncProps_Init(&props);
-    props.level = 1;
-    props.algo = 0;
-    props.numThreads = 4;
-    SizeT s = LZMA_PROPS_SIZE;
-    SRes err = LzmaEncode((Byte*)dest + LZMA_PROPS_SIZE, (SizeT*)&csize, (Byte*)source, len, &props, (Byte*)dest, &s, 1, NULL, &alloc, &alloc);
-    csize += LZMA_PROPS_SIZE;
+static inline unsigned long long HashMerge(unsigned long long acc,unsigned long long v)
+{
+  return (acc ^ HashRound(0,v))*HASH_PRIME1+HASH_PRIME4;
+}
 
-  if ( err == SZ_OK )
+// The 8, 4 and 1 byte tail of a hash and its final avalanche, from p up to end.
+static unsigned long long HashFinish(unsigned long long h,const unsigned char *p,const unsigned char *end)
+{
+  for (; end-p >= 8; p+=8)
   {
-    outlen = csize;
-
-    h->mRawLength        = len;
-    h->mCRC              = ComputeCRC((const unsigned char *)dest,outlen,h->mRawLength);
-    outlen+=sizeof(CompressionHeader);
-    h->mCompressedLength = outlen;
-    h->mId[0]            = 'L';
-    h->mId[1]            = 'Z';
-    h->mId[2]            = 'M';
-    h->mId[3]            = 'A';
+    h = Rotate64(h ^ HashRound(0,Read64(p)),27)*HASH_PRIME1+HASH_PRIME4;
   }
-  else
+  if ( end-p >= 4 )
   {
-    outlen = 0;
-    free(h);
-    h = 0;
+    unsigned int v;
+    memcpy(&v,p,4);
+    h = Rotate64(h ^ (v*HASH_PRIME1),23)*HASH_PRIME2+HASH_PRIME3;
+    p+=4;
   }
+  for (; p<end; p++)
+  {
+    h = Rotate64(h ^ (*p*HASH_PRIME5),11)*HASH_PRIME1;
+  }
+
+  h ^= h >> 33;
+  h *= HASH_PRIME2;
+  h ^= h >> 29;
+  h *= HASH_PRIME3;
+  h ^= h >> 32;
   return h;
 }
 
-void * compressFASTLZ(const void *source,int len,int &outlen)
+static unsigned long long ComputeHash64(const void *buffer,size_t count,unsigned long long seed)
 {
-  unsigned int csize = len*2;
-  CompressionHeader *h = (CompressionHeader *) malloc(csize+sizeof(CompressionHeader));
-  unsigned char *dest = (unsigned char *)h;
-  dest+=sizeof(CompressionHeader);
-
-  outlen = fastlz_compress(source, len, dest);
+  const unsigned char *p = (const unsigned char *) buffer;
+  const unsigned char *end = p+count;
+  unsigned long long h;
 
-  if (outlen != 0)
+  if ( count >= 32 )
   {
-    h->mRawLength        = len;
-    h->mCRC              = ComputeCRC((const unsigned char *)dest,outlen,h->mRawLength);
-    outlen+=sizeof(CompressionHeader);
-    h->mCompressedLength = outlen;
-    h->mId[0]            = 'F';
-    h->mId[1]            = 'A';
-    h->mId[2]            = 'S';
-    h->mId[3]            = 'T';
+    unsigned long long v1 = seed+HASH_PRIME1+HASH_PRIME2;
+    unsigned long long v2 = seed+HASH_PRIME2;
+    unsigned long long v3 = seed;
+    unsigned long long v4 = seed-HASH_PRIME1;
+    for (; end-p >= 32; p+=32)
+    {
+      v1 = HashRound(v1,Read64(p));
+      v2 = HashRound(v2,Read64(p+8));
+      v3 = HashRound(v3,Read64(p+16));
+      v4 = HashRound(v4,Read64(p+24));
+    }
+    h = Rotate64(v1,1)+Rotate64(v2,7)+Rotate64(v3,12)+Rotate64(v4,18);
+    h = HashMerge(h,v1);
+    h = HashMerge(h,v2);
+    h = HashMerge(h,v3);
+    h = HashMerge(h,v4);
   }
   else
   {
-    free(h);
-	h = 0;
+    h = seed+HASH_PRIME5;
   }
 
-  return h;
+  h+=count;
+  return HashFinish(h,p,end);
 }
 
-void * compressMINIZ(const void *source,int len,int &outlen)
+// ComputeHash64 of data which arrives a piece at a time; once add has seen all of it, finish gives the same value
+// as a single call over the whole.
+class Hash64Stream
 {
-    unsigned int csize = compressBound(len);
-    CompressionHeader *h = (CompressionHeader *) malloc(csize+sizeof(CompressionHeader));
-    unsigned char *dest = (unsigned char *)h;
-    dest+=sizeof(CompressionHeader);
+public:
+  Hash64Stream(unsigned long long seed=0)
+  {
+    mSeed  = seed;
+    mV[0]  = seed+HASH_PRIME1+HASH_PRIME2;
+    mV[1]  = seed+HASH_PRIME2;
+    mV[2]  = seed;
+    mV[3]  = seed-HASH_PRIME1;
+    mCount = 0;
+    mFill  = 0;
+  }
 
-    uLong out_len = csize;
-    int result = compress(dest, &out_len, (const unsigned char *)source, len);
-    outlen = out_len;
+  void add(const void *data,size_t len)
+  {
+    const unsigned char *p = (const unsigned char *)data;
+    mCount+=len;
+    if ( mFill )
+    {
+      size_t n = std::min(len,sizeof(mStripe)-mFill);
+      memcpy(mStripe+mFill,p,n);
+      mFill+=n;
+      p+=n;
+      len-=n;
+      if ( mFill == sizeof(mStripe) )
+      {
+        stripe(mStripe);
+        mFill = 0;
+      }
+    }
+    if ( mFill == 0 ) // otherwise everything went into the partial stripe
+    {
+      for (; len >= sizeof(mStripe); p+=sizeof(mStripe), len-=sizeof(mStripe))
+      {
+        stripe(p);
+      }
+      memcpy(mStripe,p,len);
+      mFill = len;
+    }
+  }
 
-    if (outlen != 0 && result == 0)
+  unsigned long long finish(void) const
+  {
+    unsigned long long h;
+    if ( mCount >= sizeof(mStripe) )
     {
-        h->mRawLength        = len;
-        h->mCRC              = ComputeCRC((const unsigned char *)dest,outlen,h->mRawLength);
-        outlen+=sizeof(CompressionHeader);
-        h->mCompressedLength = outlen;
-        h->mId[0]            = 'M';
-        h->mId[1]            = 'I';
-        h->mId[2]            = 'N';
-        h->mId[3]            = 'I';
+      h = Rotate64(mV[0],1)+Rotate64(mV[1],7)+Rotate64(mV[2],12)+Rotate64(mV[3],18);
+      h = HashMerge(h,mV[0]);
+      h = HashMerge(h,mV[1]);
+      h = HashMerge(h,mV[2]);
+      h = HashMerge(h,mV[3]);
     }
     else
     {
-        free(h);
-        h = 0;
+      h = mSeed+HASH_PRIME5;
     }
+    h+=mCount;
+    return HashFinish(h,mStripe,mStripe+mFill);
+  }
 
-    return h;
-}
+private:
+  void stripe(const unsigned char *p)
+  {
+    mV[0] = HashRound(mV[0],Read64(p));
+    mV[1] = HashRound(mV[1],Read64(p+8));
+    mV[2] = HashRound(mV[2],Read64(p+16));
+    mV[3] = HashRound(mV[3],Read64(p+24));
+  }
 
-void * compressData(const void *source,int len,int &outlen,CompressionType type)
+  unsigned long long  mSeed;
+  unsigned long long  mV[4];
+  unsigned long long  mCount;
+  unsigned char       mStripe[32];
+  size_t              mFill;
+};
+
+// Which checksum a header holds; recorded in the header flags, see HF_CHECKSUM_MASK.
+enum ChecksumKind
 {
-  void *ret = 0;
+  CK_CRC32  = 0,    // mCRC is the original CRC-32 of the payload; headers without a kind, including every CompressionHeaderV1, use it
+  CK_CRC32C = 1,    // mCRC is a CRC-32C of the payload
+  CK_NONE   = 2,    // nothing is checked
+  CK_HASH64 = 3     // the header is followed by the ComputeHash64 of the raw data, and mCRC is zero
+};
 
-  switch ( type )
+static unsigned int getChecksumKind(ChecksumType checksum)
+{
+  unsigned int ret = CK_CRC32C;
+  switch ( checksum )
   {
-#if USE_CRYPTO
-    case CT_CRYPTO_GZIP:
-      ret = compressCRYPTO_GZIP(source,len,outlen);
-      break;
-#endif
-    case CT_MINILZO:
-      ret = compressMiniLZO(source,len,outlen);
-      break;
-    case CT_ZLIB:
-#if USE_ZLIB
-      ret = compressZLIB(source,len,outlen);
-#endif
-      break;
-    case CT_BZIP:
-      ret = compressBZIP(source,len,outlen);
-      break;
-    case CT_LIBLZF:
-      ret = compressLIBLZF(source,len,outlen);
-      break;
-    case CT_LZMA:
-      ret = compressLZMA(source,len,outlen);
+    case CS_NONE:
+      ret = CK_NONE;
       break;
-    case CT_FASTLZ:
-      ret = compressFASTLZ(source,len,outlen);
+    case CS_HASH64:
+      ret = CK_HASH64;
       break;
-    case CT_MINIZ:
-      ret = compressMINIZ(source,len,outlen);
+    case CS_CRC:
       break;
-
   }
   return ret;
 }
 
-void * decompressMiniLZO(const void *source,int clen,int &outlen)
+unsigned int ComputeCRC(const void *buffer,size_t count,unsigned int crc=0)
 {
-#if USE_MINI_LZO
-
-  void * ret = 0;
-
-  CompressionHeader *h = (CompressionHeader *) source;
+  crc = AccumulateCRC(buffer,count,crc^(unsigned int)count);
+  return( crc&0x7FFFFFFF );
+}
 
-  if ( 1 )
+static unsigned int ComputeChecksum(unsigned int kind,const void *buffer,size_t count,unsigned int seed)
+{
+  unsigned int ret = 0;
+  switch ( kind )
   {
-    const char *data = (const char *) h;
-    data+=sizeof(CompressionHeader);
-    unsigned int slen = clen-sizeof(CompressionHeader);
-    unsigned int crc = ComputeCRC((const unsigned char *)data,slen,h->mRawLength);
-    if ( crc == h->mCRC )
-    {
-      outlen = h->mRawLength;
-      char *dest = (char *)malloc(h->mRawLength);
-      lzo_init();
-
-      int r = lzo1x_decompress((const unsigned char *)data,
-                               slen,
-                               (unsigned char *)dest,
-                               (lzo_uint *)&outlen,0);
-
-      if ( r == LZO_E_OK )
-      {
-        ret = dest;
-        assert( outlen == h->mRawLength );
-        outlen = h->mRawLength;
-      }
-      else
-      {
-        free(dest);
-        ret = 0;
-      }
-    }
+    case CK_CRC32:
+      ret = ComputeCRC(buffer,count,seed);
+      break;
+    case CK_CRC32C:
+      ret = ~AccumulateCRC32C(buffer,count,~(seed^(unsigned int)count));
+      break;
   }
-
   return ret;
-#else
-  outlen = 0;
-  return 0;
-#endif
 }
 
-#if USE_CRYPTO
-void * decompressCRYPTO_GZIP(const void *source,int clen,int &outlen)
+// The CRC is seeded with the raw length; 64-bit lengths are folded so that lengths below 4GB seed it exactly as before.
+static inline unsigned int LengthSeed(unsigned long long rawLength)
 {
-  void * ret = 0;
+  return (unsigned int)rawLength ^ (unsigned int)(rawLength>>32);
+}
 
-  outlen = 0;
+void deleteData(void* mem)
+{
+  free(mem);
+}
 
-  CompressionHeader *h = (CompressionHeader *) source;
-  if ( 1 )
-  {
-    const char *data = (const char *) h;
-    data+=sizeof(CompressionHeader);
-    unsigned int slen = clen-sizeof(CompressionHeader);
+// The original 16 byte header.  It is no longer written, but payloads which use it still decompress.
+struct CompressionHeaderV1
+{
+  int             mRawLength;
+  int             mCompressedLength;
+  unsigned int    mCRC;
+  char            mId[4];
+};
 
-    unsigned int crc = ComputeCRC(data,slen,h->mRawLength);
+// The current header.  The CRC and codec id sit at the same offsets as in CompressionHeaderV1, and the
+// first field is always -1 where the old header held its (never negative) raw length, which tells them apart.
+struct CompressionHeader
+{
+  int                 mMarker;
+  unsigned short      mVersion;
+  unsigned short      mFlags;
+  unsigned int        mCRC;
+  char                mId[4];
+  unsigned long long  mRawLength;
+  unsigned long long  mCompressedLength;  // including the header
+};
 
-    if ( crc == h->mCRC )
-    {
-      CryptoPP::Gunzip zipper;
-      zipper.PutMessageEnd((const byte *)data,slen);
-      char *dest = (char *)malloc(h->mRawLength);
-      zipper.Get((byte *)dest,h->mRawLength);
-      ret = dest;
-      outlen = h->mRawLength;
-    }
-  }
+const int            HEADER_MARKER=-1;
+const unsigned short HEADER_VERSION=2;
 
-  return ret;
-}
-#endif
+enum HeaderFlags
+{
+  HF_BLOCKS         = (1<<0),     // the payload is a BlockIndex followed by independently compressed blocks
+  HF_CHECKSUM_SHIFT = 1,
+  HF_CHECKSUM_MASK  = (7<<1),     // the ChecksumKind of mCRC
+  HF_DICTIONARY     = (1<<4)      // the header (and hash) is followed by the 32-bit id of the preset dictionary used
+};
 
-#if USE_ZLIB
-void * decompressZLIB(const void *source,int clen,int &outlen)
+// What decompression needs to know about a payload, whichever header it was written with.
+struct HeaderInfo
 {
-  void * ret = 0;
+  CompressionType     mType;
+  unsigned long long  mRawLength;
+  size_t              mHeaderSize;
+  unsigned int        mCRC;
+  unsigned int        mFlags;
+  unsigned long long  mHash;        // CK_HASH64 only
+  unsigned int        mDictionary;  // HF_DICTIONARY only, otherwise 0
+};
 
-  CompressionHeader *h = (CompressionHeader *) source;
+static unsigned int checksumKind(const HeaderInfo &info)
+{
+  return (info.mFlags & HF_CHECKSUM_MASK) >> HF_CHECKSUM_SHIFT;
+}
 
-  if ( 1 )
-  {
+// The bytes written before the payload, which with CK_HASH64 include the hash, and then any dictionary id.
+static size_t headerSize(unsigned int kind,unsigned int dictionary=0)
+{
+  return sizeof(CompressionHeader)+(kind == CK_HASH64 ? sizeof(unsigned long long) : 0)+(dictionary ? sizeof(unsigned int) : 0);
+}
 
-    const char *data = (const char *) h;
-    data+=sizeof(CompressionHeader);
-    unsigned int slen = clen-sizeof(CompressionHeader);
-    unsigned int crc = ComputeCRC((const unsigned char *)data,slen,h->mRawLength);
-    if ( crc == h->mCRC )
-    {
+const size_t MAX_HEADER_SIZE=sizeof(CompressionHeader)+sizeof(unsigned long long)+sizeof(unsigned int);
 
-      outlen = h->mRawLength;
-      char *dest = (char *)malloc(h->mRawLength);
+static void writeHeader(void *dest,const char *id,unsigned int flags,unsigned int kind,unsigned long long rawLength,size_t outlen,unsigned int crc,unsigned long long hash,unsigned int dictionary=0)
+{
+  CompressionHeader *h = (CompressionHeader *) dest;
+  h->mMarker           = HEADER_MARKER;
+  h->mVersion          = HEADER_VERSION;
+  h->mFlags            = (unsigned short)(flags | (kind << HF_CHECKSUM_SHIFT) | (dictionary ? HF_DICTIONARY : 0));
+  h->mRawLength        = rawLength;
+  h->mCompressedLength = outlen;
+  h->mCRC              = crc;
+  memcpy(h->mId,id,4);
+  if ( kind == CK_HASH64 )
+  {
+    memcpy(h+1,&hash,sizeof(hash));
+  }
+  if ( dictionary )
+  {
+    memcpy((unsigned char *)dest+headerSize(kind),&dictionary,sizeof(dictionary));
+  }
+}
 
-      int err;
+// Checks the CRC of the payload; the hash of the raw data can only be checked once it is decompressed.
+static bool verifyPayload(const HeaderInfo &info,const void *data,size_t slen)
+{
+  unsigned int kind = checksumKind(info);
+  return kind == CK_NONE || kind == CK_HASH64 || ComputeChecksum(kind,data,slen,LengthSeed(info.mRawLength)) == info.mCRC;
+}
 
-      uLongf destLen = outlen;
+static bool verifyRaw(const HeaderInfo &info,const void *data,size_t len)
+{
+  return checksumKind(info) != CK_HASH64 || ComputeHash64(data,len,0) == info.mHash;
+}
 
-      err = uncompress( (Bytef *) dest,&destLen,(Bytef *) data, slen );
+static CompressionType getCompressionTypeFromId(const char *id);
 
-      assert( destLen == outlen );
-      if ( destLen != outlen )
-        err = -1;
+static bool readHeader(const void *mem,size_t len,HeaderInfo &info)
+{
+  bool ret = false;
 
-      if ( err == Z_OK )
+  if ( mem && len > sizeof(CompressionHeaderV1) )
+  {
+    const CompressionHeaderV1 *h1 = (const CompressionHeaderV1 *) mem;
+    if ( h1->mRawLength != HEADER_MARKER )
+    {
+      if ( h1->mRawLength >= 0 && h1->mCompressedLength >= 0 && (size_t)h1->mCompressedLength == len )
       {
-        ret = dest;
+        info.mType       = getCompressionTypeFromId(h1->mId);
+        info.mRawLength  = (unsigned long long)h1->mRawLength;
+        info.mHeaderSize = sizeof(CompressionHeaderV1);
+        info.mCRC        = h1->mCRC;
+        info.mFlags      = 0;
+        info.mHash       = 0;
+        info.mDictionary = 0;
+        ret = info.mType != CT_INVALID;
       }
-      else
+    }
+    else if ( len >= sizeof(CompressionHeader) ) // an empty CT_STORED payload is just the header
+    {
+      const CompressionHeader *h = (const CompressionHeader *) mem;
+      if ( h->mVersion == HEADER_VERSION && h->mCompressedLength == (unsigned long long)len && h->mRawLength <= (size_t)-1 )
       {
-        free(dest);
-        outlen = 0;
-        ret = 0;
+        info.mType       = getCompressionTypeFromId(h->mId);
+        info.mRawLength  = h->mRawLength;
+        info.mHeaderSize = sizeof(CompressionHeader);
+        info.mCRC        = h->mCRC;
+        info.mFlags      = h->mFlags;
+        info.mHash       = 0;
+        info.mDictionary = 0;
+        ret = info.mType != CT_INVALID && checksumKind(info) <= CK_HASH64;
+        if ( ret && checksumKind(info) == CK_HASH64 )
+        {
+          info.mHeaderSize = headerSize(CK_HASH64);
+          ret = len >= info.mHeaderSize;
+          if ( ret ) memcpy(&info.mHash,h+1,sizeof(info.mHash));
+        }
+        if ( ret && (info.mFlags & HF_DICTIONARY) )
+        {
+          ret = len >= info.mHeaderSize+sizeof(info.mDictionary);
+          if ( ret )
+          {
+            memcpy(&info.mDictionary,(const unsigned char *)mem+info.mHeaderSize,sizeof(info.mDictionary));
+            info.mHeaderSize+=sizeof(info.mDictionary);
+            ret = info.mDictionary != 0;
+          }
+        }
       }
     }
   }
 
   return ret;
 }
-#endif
 
-void * decompressBZIP(const void *source,int clen,int &outlen)
-{
-  void * ret = 0;
+// zlib and bzip2 count their stream buffers in 32 bits, so larger buffers are fed through in pieces of this size.
+const size_t MAX_STREAM_CHUNK=0x40000000;
 
-  CompressionHeader *h = (CompressionHeader *) source;
+static size_t chunkOf(size_t len)
+{
+  return len < MAX_STREAM_CHUNK ? len : MAX_STREAM_CHUNK;
+}
 
-  if ( 1 )
+void* Alloc(void *p, size_t size) { return malloc(size); }
+void Free(void *p, void *address) { if (address) free(address); }
+
+ISzAlloc alloc = { Alloc, Free };
+
+#if USE_MINI_LZO
+static bool initMiniLZO(void)
+{
+  static int r = lzo_init(); // runs once, thread safe.
+  return r == LZO_E_OK;
+}
+#endif
+
+// bzip2 has no way to reset a stream, so BZ2_bzCompressInit/BZ2_bzDecompressInit run on every call.  The context
+// hands them an allocator which keeps the (large) block buffers around and returns them on the next call instead.
+class BlockCache
+{
+public:
+  enum { MAX_BLOCKS = 8 };
+
+  BlockCache(void)
+  {
+    memset(mBlocks,0,sizeof(mBlocks));
+  }
+
+  ~BlockCache(void)
+  {
+    for (int i=0; i<MAX_BLOCKS; i++)
+    {
+      free(mBlocks[i].mMem);
+    }
+  }
+
+  void * alloc(size_t size)
+  {
+    void *ret = 0;
+    int freeSlot = -1;
+    for (int i=0; i<MAX_BLOCKS && !ret; i++)
+    {
+      Block &b = mBlocks[i];
+      if ( b.mMem && !b.mInUse && b.mSize == size )
+      {
+        b.mInUse = true;
+        ret = b.mMem;
+      }
+      else if ( !b.mMem && freeSlot == -1 )
+      {
+        freeSlot = i;
+      }
+    }
+    if ( !ret )
+    {
+      ret = malloc(size);
+      if ( ret && freeSlot != -1 )
+      {
+        Block &b = mBlocks[freeSlot];
+        b.mMem   = ret;
+        b.mSize  = size;
+        b.mInUse = true;
+      }
+    }
+    return ret;
+  }
+
+  void release(void *mem)
+  {
+    bool cached = false;
+    for (int i=0; i<MAX_BLOCKS && !cached; i++)
+    {
+      if ( mBlocks[i].mMem == mem )
+      {
+        mBlocks[i].mInUse = false;
+        cached = true;
+      }
+    }
+    if ( !cached )
+    {
+      free(mem);
+    }
+  }
+
+  static void * bzAlloc(void *opaque,int items,int size)
+  {
+    BlockCache *cache = (BlockCache *)opaque;
+    return cache->alloc((size_t)items*size);
+  }
+
+  static void bzFree(void *opaque,void *mem)
+  {
+    BlockCache *cache = (BlockCache *)opaque;
+    if ( mem ) cache->release(mem);
+  }
+
+private:
+  struct Block
+  {
+    void   *mMem;
+    size_t  mSize;
+    bool    mInUse;
+  };
+  Block mBlocks[MAX_BLOCKS];
+};
+
+// Each codec's reading of CompressionOptions; a negative level or zero window keeps the built-in default.
+const CompressionOptions gDefaultOptions;
+
+static int clampOption(int value,int minValue,int maxValue)
+{
+  return value < minValue ? minValue : value > maxValue ? maxValue : value;
+}
+
+#if USE_ZLIB
+struct DeflateParams
+{
+  int mLevel;
+  int mWindowBits;
+  int mStrategy;
+
+  DeflateParams(const CompressionOptions &options)
+  {
+    mLevel      = options.mLevel < 0 ? Z_BEST_SPEED : clampOption(options.mLevel,0,9);
+    mWindowBits = options.mWindowBits ? clampOption(options.mWindowBits,9,MAX_WBITS) : MAX_WBITS;
+    switch ( options.mStrategy )
+    {
+      case SG_FILTERED:     mStrategy = Z_FILTERED; break;
+      case SG_HUFFMAN_ONLY: mStrategy = Z_HUFFMAN_ONLY; break;
+      case SG_RLE:          mStrategy = Z_RLE; break;
+      case SG_FIXED:        mStrategy = Z_FIXED; break;
+      default:              mStrategy = Z_DEFAULT_STRATEGY; break;
+    }
+  }
+
+  bool operator==(const DeflateParams &p) const
+  {
+    return mLevel == p.mLevel && mWindowBits == p.mWindowBits && mStrategy == p.mStrategy;
+  }
+
+  int init(z_stream *strm) const
+  {
+    return deflateInit2(strm,mLevel,Z_DEFLATED,mWindowBits,8,mStrategy);
+  }
+};
+#endif
+
+static int bzipBlockSize(const CompressionOptions &options)
+{
+  return options.mLevel < 0 ? 1 : clampOption(options.mLevel,1,9);
+}
+
+// One block's worth of input (nblockMAX in bzlib), the unit of parallel bzip2.
+static size_t bzipChunkSize(int blockSize100k)
+{
+  return (size_t)blockSize100k*100000-19;
+}
+
+// The encoder settings of each LzmaPreset, in its order.
+struct LzmaPresetProps
+{
+  const char   *mName;
+  int           mAlgo;          // 0 for fast parsing, 1 for optimal
+  int           mBtMode;        // 0 for the Hc4 hash chains, 1 for binary trees
+  int           mNumHashBytes;  // 2-4 with binary trees; hash chains always hash 4
+  int           mFb;
+  UInt32        mMc;
+  UInt32        mDictSize;
+  int           mLc;
+  int           mLp;
+  int           mPb;
+};
+
+static const LzmaPresetProps gLzmaPresets[] =
+{
+  { "LP_DEFAULT",    -1, -1, -1,  -1,  0,        0, -1, -1, -1 },
+  { "LP_ULTRA_FAST",  0,  0,  4,  16,  3, 1u << 17,  3,  0,  2 },
+  { "LP_FAST",        0,  0,  4,  32,  8, 1u << 18,  3,  0,  2 },
+  { "LP_BALANCED",    1,  0,  4,  32,  8, 1u << 22,  3,  0,  2 },
+  { "LP_MAX",         1,  1,  4, 128, 64, 1u << 26,  3,  0,  2 },
+};
+
+static void lzmaProps(const CompressionOptions &options,CLzmaEncProps &props)
+{
+  LzmaEncProps_Init(&props);
+  props.level = 1;
+  props.algo = 0;
+  if ( options.mLzmaPreset > LP_DEFAULT && options.mLzmaPreset <= LP_MAX )
+  {
+    const LzmaPresetProps &p = gLzmaPresets[options.mLzmaPreset];
+    props.algo         = p.mAlgo;
+    props.btMode       = p.mBtMode;
+    props.numHashBytes = p.mNumHashBytes;
+    props.fb           = p.mFb;
+    props.mc           = p.mMc;
+    props.dictSize     = p.mDictSize;
+    props.lc           = p.mLc;
+    props.lp           = p.mLp;
+    props.pb           = p.mPb;
+  }
+  else if ( options.mLevel >= 0 )
+  {
+    props.level = clampOption(options.mLevel,0,9);
+    props.algo = -1; // chosen by the level
+  }
+  if ( options.mWindowBits )
+  {
+    props.dictSize = 1u << clampOption(options.mWindowBits,12,27);
+  }
+  if ( options.mThreads )
+  {
+    props.numThreads = (int)options.mThreads;
+  }
+}
+
+// miniz has no zlib style level parameter with MINIZ_NO_ZLIB_APIS, so this mirrors tdefl_create_comp_flags_from_zip_params.
+static int tdeflFlags(const CompressionOptions &options)
+{
+  static const int probes[11] = { 0, 1, 6, 32, 16, 32, 128, 256, 512, 768, 1500 };
+  int flags = TDEFL_WRITE_ZLIB_HEADER;
+  if ( options.mLevel < 0 )
+  {
+    flags |= TDEFL_DEFAULT_MAX_PROBES;
+  }
+  else
+  {
+    int level = clampOption(options.mLevel,0,10);
+    flags |= probes[level] | (level <= 3 ? TDEFL_GREEDY_PARSING_FLAG : 0);
+    if ( level == 0 ) flags |= TDEFL_FORCE_ALL_RAW_BLOCKS;
+  }
+  switch ( options.mStrategy )
+  {
+    case SG_FILTERED:     flags |= TDEFL_FILTER_MATCHES; break;
+    case SG_HUFFMAN_ONLY: flags &= ~TDEFL_MAX_PROBES_MASK; break;
+    case SG_RLE:          flags |= TDEFL_RLE_MATCHES; break;
+    case SG_FIXED:        flags |= TDEFL_FORCE_ALL_STATIC_BLOCKS; break;
+    default: break;
+  }
+  return flags;
+}
+
+const char * getLzmaPresetString(LzmaPreset preset)
+{
+  return preset >= LP_DEFAULT && preset <= LP_MAX ? gLzmaPresets[preset].mName : "LP_INVALID";
+}
+
+bool getCompressionLevelRange(CompressionType type,int &minLevel,int &maxLevel)
+{
+  bool ret = true;
+  switch ( type )
+  {
+    case CT_ZLIB:   minLevel = 0; maxLevel = 9; break;
+    case CT_BZIP:   minLevel = 1; maxLevel = 9; break;
+    case CT_LZMA:   minLevel = 0; maxLevel = 9; break;
+    case CT_FASTLZ: minLevel = 1; maxLevel = 2; break;
+    case CT_MINIZ:  minLevel = 0; maxLevel = 10; break;
+    default:
+      minLevel = maxLevel = 0;
+      ret = false;
+      break;
+  }
+  return ret;
+}
+
+// Every piece of codec state is created on first use and then reset, rather than rebuilt, on each later call.
+class CompressionContext
+{
+public:
+  CompressionContext(void)
+#if USE_ZLIB
+    : mDeflateParams(gDefaultOptions)
+#endif
+  {
+#if USE_ZLIB
+    mDeflateInit = false;
+    mInflateInit = false;
+    memset(&mDeflate,0,sizeof(mDeflate));
+    memset(&mInflate,0,sizeof(mInflate));
+#endif
+    mLzmaEncoder = 0;
+    LzmaDec_Construct(&mLzmaDecoder);
+    mLZFState = 0;
+    mTdefl = 0;
+    mLZOWorkMemory = 0;
+    mBlockBuffer = 0;
+    mBlockCapacity = 0;
+    mDictionaryBuffer = 0;
+    mDictionaryCapacity = 0;
+    mDictionarySerial = 0;
+  }
+
+  ~CompressionContext(void)
+  {
+#if USE_ZLIB
+    if ( mDeflateInit ) deflateEnd(&mDeflate);
+    if ( mInflateInit ) inflateEnd(&mInflate);
+#endif
+    if ( mLzmaEncoder ) LzmaEnc_Destroy(mLzmaEncoder,&alloc,&alloc);
+    LzmaDec_FreeProbs(&mLzmaDecoder,&alloc);
+    free(mLZFState);
+    free(mTdefl);
+    free(mLZOWorkMemory);
+    free(mBlockBuffer);
+    free(mDictionaryBuffer);
+  }
+
+#if USE_ZLIB
+  // The stream is kept between calls with the same parameters, and set up afresh when they change.
+  z_stream * getDeflate(const DeflateParams &params)
+  {
+    z_stream *ret = 0;
+    if ( mDeflateInit && !(params == mDeflateParams) )
+    {
+      deflateEnd(&mDeflate);
+      memset(&mDeflate,0,sizeof(mDeflate));
+      mDeflateInit = false;
+    }
+    if ( mDeflateInit )
+    {
+      if ( deflateReset(&mDeflate) == Z_OK ) ret = &mDeflate;
+    }
+    else if ( params.init(&mDeflate) == Z_OK )
+    {
+      mDeflateInit = true;
+      mDeflateParams = params;
+      ret = &mDeflate;
+    }
+    return ret;
+  }
+
+  z_stream * getInflate(void)
+  {
+    z_stream *ret = 0;
+    if ( mInflateInit )
+    {
+      if ( inflateReset(&mInflate) == Z_OK ) ret = &mInflate;
+    }
+    else if ( inflateInit(&mInflate) == Z_OK )
+    {
+      mInflateInit = true;
+      ret = &mInflate;
+    }
+    return ret;
+  }
+#endif
+
+  void initBzip(bz_stream &strm)
+  {
+    strm.bzalloc = BlockCache::bzAlloc;
+    strm.bzfree  = BlockCache::bzFree;
+    strm.opaque  = &mBzipBlocks;
+  }
+
+  CLzmaEncHandle getLzmaEncoder(void)
+  {
+    if ( !mLzmaEncoder ) mLzmaEncoder = LzmaEnc_Create(&alloc);
+    return mLzmaEncoder;
+  }
+
+  CLzmaDec * getLzmaDecoder(void)
+  {
+    return &mLzmaDecoder;
+  }
+
+  void * getLZFState(void)
+  {
+    if ( !mLZFState ) mLZFState = malloc(lzf_state_size());
+    return mLZFState;
+  }
+
+  tdefl_compressor * getTdefl(void)
+  {
+    if ( !mTdefl ) mTdefl = (tdefl_compressor *)malloc(sizeof(tdefl_compressor));
+    return mTdefl;
+  }
+
+  void * getLZOWorkMemory(void)
+  {
+#if USE_MINI_LZO
+    if ( !mLZOWorkMemory ) mLZOWorkMemory = malloc(LZO1X_1_MEM_COMPRESS);
+#endif
+    return mLZOWorkMemory;
+  }
+
+  // Somewhere to decompress a block of which only part is wanted, or 0 if it cannot be had.  The contents are not
+  // kept when it grows.
+  unsigned char * getBlockBuffer(size_t len)
+  {
+    if ( mBlockCapacity < len )
+    {
+      free(mBlockBuffer);
+      mBlockBuffer = (unsigned char *)malloc(len);
+      mBlockCapacity = mBlockBuffer ? len : 0;
+    }
+    return len ? mBlockBuffer : 0;
+  }
+
+  // Somewhere to decode LZMA after a preset dictionary: the dictionary, then room for 'len' bytes.  Decoding leaves
+  // the dictionary untouched, so it is only copied in when the last call used another one.  Returns 0 if it cannot
+  // be had.
+  unsigned char * getDictionaryBuffer(const unsigned char *dict,size_t dictLen,unsigned long long serial,size_t len)
+  {
+    if ( mDictionaryCapacity < dictLen+len )
+    {
+      free(mDictionaryBuffer);
+      mDictionaryBuffer = (unsigned char *)malloc(dictLen+len);
+      mDictionaryCapacity = mDictionaryBuffer ? dictLen+len : 0;
+      mDictionarySerial = 0;
+    }
+    if ( mDictionaryBuffer && mDictionarySerial != serial )
+    {
+      memcpy(mDictionaryBuffer,dict,dictLen);
+      mDictionarySerial = serial;
+    }
+    return mDictionaryBuffer;
+  }
+
+private:
+#if USE_ZLIB
+  bool              mDeflateInit;
+  bool              mInflateInit;
+  DeflateParams     mDeflateParams;
+  z_stream          mDeflate;
+  z_stream          mInflate;
+#endif
+  BlockCache        mBzipBlocks;
+  CLzmaEncHandle    mLzmaEncoder;
+  CLzmaDec          mLzmaDecoder;
+  void             *mLZFState;
+  tdefl_compressor *mTdefl;
+  void             *mLZOWorkMemory;
+  unsigned char    *mBlockBuffer;
+  size_t            mBlockCapacity;
+  unsigned char    *mDictionaryBuffer;
+  size_t            mDictionaryCapacity;
+  unsigned long long mDictionarySerial; // the Dictionary::mSerial at the front of mDictionaryBuffer, 0 for none
+};
+
+CompressionContext * createCompressionContext(void)
+{
+  return new CompressionContext;
+}
+
+void releaseCompressionContext(CompressionContext *context)
+{
+  delete context;
+}
+
+//*** Mapped files
+
+// A read only view of a whole file.  Empty files fail to open, as there is nothing to map.
+class MappedFile
+{
+public:
+  MappedFile(void) : mData(0), mLength(0), mReleased(0)
+  {
+#ifdef _WIN32
+    mFile = INVALID_HANDLE_VALUE;
+    mMapping = 0;
+#endif
+  }
+
+  ~MappedFile(void)
+  {
+    close();
+  }
+
+  bool open(const char *fname)
+  {
+    bool ret = false;
+
+    close();
+#ifdef _WIN32
+    mFile = CreateFileA(fname,GENERIC_READ,FILE_SHARE_READ,0,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,0);
+    LARGE_INTEGER size;
+    if ( mFile != INVALID_HANDLE_VALUE && GetFileSizeEx(mFile,&size) && size.QuadPart > 0 && (unsigned long long)size.QuadPart <= (size_t)-1 )
+    {
+      mMapping = CreateFileMappingA(mFile,0,PAGE_READONLY,0,0,0);
+      if ( mMapping )
+      {
+        mData = (const unsigned char *)MapViewOfFile(mMapping,FILE_MAP_READ,0,0,0);
+        mLength = mData ? (size_t)size.QuadPart : 0;
+        ret = mData != 0;
+      }
+    }
+#else
+    int fd = ::open(fname,O_RDONLY);
+    if ( fd >= 0 )
+    {
+      struct stat st;
+      if ( fstat(fd,&st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && (unsigned long long)st.st_size <= (size_t)-1 )
+      {
+        void *mem = mmap(0,(size_t)st.st_size,PROT_READ,MAP_SHARED,fd,0);
+        if ( mem != MAP_FAILED )
+        {
+          mData = (const unsigned char *)mem;
+          mLength = (size_t)st.st_size;
+          ret = true;
+        }
+      }
+      ::close(fd); // the mapping keeps the file open
+    }
+#endif
+    if ( !ret ) close();
+
+    return ret;
+  }
+
+  void close(void)
+  {
+#ifdef _WIN32
+    if ( mData ) UnmapViewOfFile(mData);
+    if ( mMapping ) CloseHandle(mMapping);
+    if ( mFile != INVALID_HANDLE_VALUE ) CloseHandle(mFile);
+    mMapping = 0;
+    mFile = INVALID_HANDLE_VALUE;
+#else
+    if ( mData ) munmap((void *)mData,mLength);
+#endif
+    mData = 0;
+    mLength = 0;
+    mReleased = 0;
+  }
+
+  // Hints that the view will be read once, from front to back, so the system can read ahead.
+  void adviseSequential(void)
+  {
+#ifndef _WIN32
+    if ( mData ) madvise((void *)mData,mLength,MADV_SEQUENTIAL);
+#endif
+  }
+
+  // Drops the pages wholly before 'offset' from memory; they are read back from the file if touched again.
+  void release(size_t offset)
+  {
+#ifndef _WIN32
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t end = offset < mLength ? offset/page*page : mLength;
+    if ( mData && end > mReleased )
+    {
+      madvise((void *)(mData+mReleased),end-mReleased,MADV_DONTNEED);
+      mReleased = end;
+    }
+#endif
+  }
+
+  const unsigned char * data(void) const { return mData; }
+  size_t                length(void) const { return mLength; }
+
+private:
+  MappedFile(const MappedFile &);
+  MappedFile & operator=(const MappedFile &);
+
+  const unsigned char  *mData;
+  size_t                mLength;
+  size_t                mReleased;
+#ifdef _WIN32
+  HANDLE                mFile;
+  HANDLE                mMapping;
+#endif
+};
+
+//*** Preset dictionaries
+
+struct Dictionary
+{
+  unsigned int                mId;
+  unsigned long long          mSerial;  // never reused, unlike the id and the address, so contexts can tell it apart
+  const unsigned char        *mData;
+  size_t                      mLength;
+  std::vector<unsigned char>  mCopy;    // registerDictionary's copy of the caller's dictionary
+  MappedFile                  mFile;    // or the dictionary file it lies in
+};
+
+// A dictionary file is this header followed by the dictionary.
+struct DictionaryFileHeader
+{
+  char                mMagic[4];  // "CDIC"
+  unsigned int        mVersion;
+  unsigned int        mId;
+  unsigned int        mCRC;       // CK_CRC32 of the dictionary
+  unsigned long long  mLength;
+};
+
+const unsigned int DICTIONARY_FILE_VERSION=1;
+
+typedef std::shared_ptr<const Dictionary> DictionaryRef;
+
+// Registered dictionaries are shared, so that one unregistered while a call is still using it stays alive until the call ends.
+static std::mutex & dictionaryLock(void)
+{
+  static std::mutex lock;
+  return lock;
+}
+
+static std::map<unsigned int,DictionaryRef> & dictionaries(void)
+{
+  static std::map<unsigned int,DictionaryRef> registry;
+  return registry;
+}
+
+// The last Dictionary::mSerial handed out, under dictionaryLock.
+static unsigned long long & dictionarySerial(void)
+{
+  static unsigned long long serial = 0;
+  return serial;
+}
+
+static DictionaryRef findDictionary(unsigned int id)
+{
+  DictionaryRef ret;
+  std::lock_guard<std::mutex> guard(dictionaryLock());
+  std::map<unsigned int,DictionaryRef>::const_iterator i = dictionaries().find(id);
+  if ( i != dictionaries().end() )
+  {
+    ret = i->second;
+  }
+  return ret;
+}
+
+// The codecs which can start from a preset dictionary.
+static bool usesDictionary(CompressionType type)
+{
+  return type == CT_LZMA
+#if USE_ZLIB
+      || type == CT_ZLIB
+#endif
+      ;
+}
+
+bool registerDictionary(unsigned int id,const void *dict,size_t len)
+{
+  bool ret = false;
+
+  if ( id && dict && len )
+  {
+    std::shared_ptr<Dictionary> d(new Dictionary);
+    d->mId = id;
+    d->mCopy.assign((const unsigned char *)dict,(const unsigned char *)dict+len);
+    d->mData = &d->mCopy[0];
+    d->mLength = len;
+    std::lock_guard<std::mutex> guard(dictionaryLock());
+    d->mSerial = ++dictionarySerial();
+    ret = dictionaries().insert(std::make_pair(id,DictionaryRef(d))).second;
+  }
+
+  return ret;
+}
+
+bool saveDictionary(const char *fname,unsigned int id,const void *dict,size_t len)
+{
+  bool ret = false;
+
+  if ( fname && id && dict && len )
+  {
+    FILE *fph = fopen(fname,"wb");
+    if ( fph )
+    {
+      DictionaryFileHeader h;
+      memcpy(h.mMagic,"CDIC",4);
+      h.mVersion = DICTIONARY_FILE_VERSION;
+      h.mId      = id;
+      h.mCRC     = ComputeChecksum(CK_CRC32,dict,len,0);
+      h.mLength  = len;
+      ret = fwrite(&h,sizeof(h),1,fph) == 1 && fwrite(dict,len,1,fph) == 1;
+      ret = fclose(fph) == 0 && ret;
+      if ( !ret ) remove(fname);
+    }
+  }
+
+  return ret;
+}
+
+bool registerDictionaryFile(const char *fname,unsigned int *id)
+{
+  bool ret = false;
+
+  std::shared_ptr<Dictionary> d(new Dictionary);
+  if ( fname && d->mFile.open(fname) && d->mFile.length() > sizeof(DictionaryFileHeader) )
+  {
+    DictionaryFileHeader h;
+    memcpy(&h,d->mFile.data(),sizeof(h));
+    d->mId = h.mId;
+    d->mData = d->mFile.data()+sizeof(h);
+    d->mLength = d->mFile.length()-sizeof(h);
+    if ( memcmp(h.mMagic,"CDIC",4) == 0 && h.mVersion == DICTIONARY_FILE_VERSION && h.mId && h.mLength == d->mLength &&
+         ComputeChecksum(CK_CRC32,d->mData,d->mLength,0) == h.mCRC )
+    {
+      std::lock_guard<std::mutex> guard(dictionaryLock());
+      d->mSerial = ++dictionarySerial();
+      ret = dictionaries().insert(std::make_pair(h.mId,DictionaryRef(d))).second;
+      if ( ret && id ) *id = h.mId;
+    }
+  }
+
+  return ret;
+}
+
+bool unregisterDictionary(unsigned int id)
+{
+  std::lock_guard<std::mutex> guard(dictionaryLock());
+  return dictionaries().erase(id) != 0;
+}
+
+// Training follows the cover approach: every 8 byte substring is scored by the number of samples it occurs in, the
+// samples are divided into one epoch per segment of the dictionary, and from each epoch the 256 byte segment whose
+// distinct substrings score highest is taken.  Taken substrings score nothing afterwards, so segments do not repeat
+// one another.  Substrings are counted by hash, so rare collisions only blur the scores.
+const size_t       TRAIN_DMER=8;
+const size_t       TRAIN_SEGMENT=256;
+const unsigned int TRAIN_HASH_BITS=20;
+const unsigned int TRAIN_NO_DMER=0xFFFFFFFF;
+
+struct TrainSegment
+{
+  size_t              mPos;
+  unsigned long long  mScore;
+
+  bool operator<(const TrainSegment &s) const
+  {
+    return mScore < s.mScore;
+  }
+};
+
+size_t trainDictionary(const void * const *samples,const size_t *sampleLengths,size_t sampleCount,void *dict,size_t maxSize)
+{
+  size_t ret = 0;
+
+  std::vector<unsigned char> data;
+  for (size_t i=0; i<sampleCount; i++)
+  {
+    data.insert(data.end(),(const unsigned char *)samples[i],(const unsigned char *)samples[i]+sampleLengths[i]);
+  }
+
+  if ( dict && maxSize >= TRAIN_SEGMENT && data.size() >= TRAIN_SEGMENT )
+  {
+    // The hash of the substring starting at each position, or TRAIN_NO_DMER where it would run past its sample.
+    std::vector<unsigned int> dmers(data.size(),TRAIN_NO_DMER);
+    std::vector<unsigned int> score(1u << TRAIN_HASH_BITS,0);
+    std::vector<unsigned int> seen(1u << TRAIN_HASH_BITS,0);
+    size_t pos = 0;
+    for (size_t i=0; i<sampleCount; i++)
+    {
+      for (size_t j=0; j+TRAIN_DMER<=sampleLengths[i]; j++)
+      {
+        unsigned int h = (unsigned int)((Read64(&data[pos+j])*HASH_PRIME1) >> (64-TRAIN_HASH_BITS));
+        dmers[pos+j] = h;
+        if ( seen[h] != i+1 )
+        {
+          seen[h] = (unsigned int)(i+1);
+          score[h]++;
+        }
+      }
+      pos+=sampleLengths[i];
+    }
+
+    // seen[] now counts how often each substring occurs in the current window.
+    std::fill(seen.begin(),seen.end(),0);
+    std::vector<TrainSegment> segments;
+    size_t epochs = maxSize/TRAIN_SEGMENT;
+    if ( epochs > data.size()/TRAIN_SEGMENT ) epochs = data.size()/TRAIN_SEGMENT;
+    size_t epochSize = data.size()/epochs;
+    const size_t window = TRAIN_SEGMENT-TRAIN_DMER+1; // the substrings lying wholly within a segment
+
+    for (size_t e=0; e<epochs; e++)
+    {
+      size_t begin = e*epochSize;
+      size_t end = begin+epochSize;
+      TrainSegment best = { begin, 0 };
+      unsigned long long current = 0;
+      for (size_t i=begin; i<end; i++)
+      {
+        unsigned int h = dmers[i];
+        if ( h != TRAIN_NO_DMER && seen[h]++ == 0 ) current+=score[h];
+        if ( i >= begin+window )
+        {
+          h = dmers[i-window];
+          if ( h != TRAIN_NO_DMER && --seen[h] == 0 ) current-=score[h];
+        }
+        if ( i+1 >= begin+window && current > best.mScore && i+1-window+TRAIN_SEGMENT <= data.size() )
+        {
+          best.mPos = i+1-window;
+          best.mScore = current;
+        }
+      }
+      for (size_t i=(end > begin+window ? end-window : begin); i<end; i++)
+      {
+        if ( dmers[i] != TRAIN_NO_DMER ) seen[dmers[i]] = 0;
+      }
+
+      if ( best.mScore )
+      {
+        segments.push_back(best);
+        for (size_t i=best.mPos; i<best.mPos+window; i++)
+        {
+          if ( dmers[i] != TRAIN_NO_DMER ) score[dmers[i]] = 0;
+        }
+      }
+    }
+
+    // The best segments go last, nearest the data, where matches against them are cheapest to code.
+    std::stable_sort(segments.begin(),segments.end());
+    unsigned char *dst = (unsigned char *)dict;
+    for (size_t i=0; i<segments.size(); i++)
+    {
+      memcpy(dst+ret,&data[segments[i].mPos],TRAIN_SEGMENT);
+      ret+=TRAIN_SEGMENT;
+    }
+  }
+
+  return ret;
+}
+
+// Each backend compresses 'len' bytes of 'source' into 'dest' (the payload area following the header),
+// writing at most 'capacity' bytes.  On success 'outlen' holds the number of payload bytes written.
+
+bool compressMiniLZO(CompressionContext *context,const CompressionOptions & /*options*/,const void *source,size_t len,void *dest,size_t capacity,size_t &outlen)
+{
+#if USE_MINI_LZO
+  bool ret = false;
+
+  // the LZO worst case expansion; lzo1x_1_compress does not check the output size.
+  if ( (lzo_uint)len == len && capacity >= len+len/16+64+3 && initMiniLZO() )
+  {
+    void *wrkmem = context ? context->getLZOWorkMemory() : malloc(LZO1X_1_MEM_COMPRESS);
+    if ( wrkmem )
+    {
+      lzo_uint csize = 0;
+      int r = lzo1x_1_compress((const unsigned char *)source,(lzo_uint)len,(unsigned char *)dest,&csize,wrkmem);
+      if ( r == LZO_E_OK )
+      {
+        outlen = csize;
+        ret = true;
+      }
+      if ( !context ) free(wrkmem);
+    }
+  }
+
+  return ret;
+#else
+  return false;
+#endif
+}
+
+#if USE_CRYPTO
+bool compressCRYPTO_GZIP(CompressionContext * /*context*/,const CompressionOptions & /*options*/,const void *source,size_t len,void *dest,size_t capacity,size_t &outlen)
+{
+  bool ret = false;
+
+  std::string outStringOfBytes;
+  CryptoPP::Gzip zipper( new CryptoPP::StringSink(outStringOfBytes)); // I have been told that this is not a memory leak, that zipper takes ownership of this memory.  Which is bullshit, but what are you gonna do?
+  zipper.Put( (const byte *)source,len);
+  zipper.MessageEnd();
+
+  size_t slen = outStringOfBytes.length();
+  if ( slen <= capacity )
+  {
+    memcpy(dest,outStringOfBytes.c_str(),slen);
+    outlen = slen;
+    ret = true;
+  }
+
+  return ret;
+}
+#endif
+
+#if USE_ZLIB
+static bool deflateBuffer(z_stream *strm,const void *source,size_t len,void *dest,size_t capacity,size_t &outlen)
+{
+  const Bytef *src = (const Bytef *)source;
+  Bytef *dst = (Bytef *)dest;
+  size_t inLeft = len;
+  size_t outLeft = capacity;
+  int err = Z_OK;
+
+  while ( err == Z_OK )
+  {
+    uInt inChunk  = (uInt)chunkOf(inLeft);
+    uInt outChunk = (uInt)chunkOf(outLeft);
+    strm->next_in   = (Bytef *)src;
+    strm->avail_in  = inChunk;
+    strm->next_out  = dst;
+    strm->avail_out = outChunk;
+    err = deflate(strm,inChunk == inLeft ? Z_FINISH : Z_NO_FLUSH);
+    src+=inChunk-strm->avail_in;
+    inLeft-=inChunk-strm->avail_in;
+    dst+=outChunk-strm->avail_out;
+    outLeft-=outChunk-strm->avail_out;
+  }
+
+  outlen = capacity-outLeft;
+  return err == Z_STREAM_END;
+}
+
+// zlib only looks back over its window, so only the end of a longer dictionary is handed to it.
+static const Bytef * zlibDictionary(const Dictionary *dictionary,uInt &len)
+{
+  const size_t maxLen = 1 << MAX_WBITS;
+  size_t size = dictionary->mLength;
+  len = (uInt)(size < maxLen ? size : maxLen);
+  return dictionary->mData+size-len;
+}
+
+static bool inflateBuffer(z_stream *strm,const Dictionary *dictionary,const void *data,size_t slen,void *dest,size_t rawLength)
+{
+  const Bytef *src = (const Bytef *)data;
+  Bytef *dst = (Bytef *)dest;
+  size_t inLeft = slen;
+  size_t outLeft = rawLength;
+  int err = Z_OK;
+
+  while ( err == Z_OK )
+  {
+    uInt inChunk  = (uInt)chunkOf(inLeft);
+    uInt outChunk = (uInt)chunkOf(outLeft);
+    strm->next_in   = (Bytef *)src;
+    strm->avail_in  = inChunk;
+    strm->next_out  = dst;
+    strm->avail_out = outChunk;
+    err = inflate(strm,Z_NO_FLUSH);
+    src+=inChunk-strm->avail_in;
+    inLeft-=inChunk-strm->avail_in;
+    dst+=outChunk-strm->avail_out;
+    outLeft-=outChunk-strm->avail_out;
+    if ( err == Z_NEED_DICT && dictionary )
+    {
+      uInt dlen;
+      const Bytef *dict = zlibDictionary(dictionary,dlen);
+      err = inflateSetDictionary(strm,dict,dlen);
+      dictionary = 0;
+    }
+  }
+
+  return err == Z_STREAM_END && outLeft == 0;
+}
+
+static bool deflateWithDictionary(z_stream *strm,const Dictionary *dictionary,const void *source,size_t len,void *dest,size_t capacity,size_t &outlen)
+{
+  bool ret = true;
+  if ( dictionary )
+  {
+    uInt dlen;
+    const Bytef *dict = zlibDictionary(dictionary,dlen);
+    ret = deflateSetDictionary(strm,dict,dlen) == Z_OK;
+  }
+  return ret && deflateBuffer(strm,source,len,dest,capacity,outlen);
+}
+
+bool compressZLIB(CompressionContext *context,const CompressionOptions &options,const Dictionary *dictionary,const void *source,size_t len,void *dest,size_t capacity,size_t &outlen)
+{
+  bool ret = false;
+
+  DeflateParams params(options);
+  if ( context )
+  {
+    z_stream *strm = context->getDeflate(params);
+    ret = strm && deflateWithDictionary(strm,dictionary,source,len,dest,capacity,outlen);
+  }
+  else
+  {
+    z_stream strm;
+    memset(&strm,0,sizeof(strm));
+    if ( params.init(&strm) == Z_OK )
+    {
+      ret = deflateWithDictionary(&strm,dictionary,source,len,dest,capacity,outlen);
+      deflateEnd(&strm);
+    }
+  }
+
+  return ret;
+}
+#endif
+
+static bool compressBZIPParallel(const CompressionOptions &options,const void *source,size_t len,void *dest,size_t capacity,size_t &outlen);
+
+bool compressBZIP(CompressionContext *context,const CompressionOptions &options,const void *source,size_t len,void *dest,size_t capacity,size_t &outlen)
+{
+  bool ret = false;
+
+  bz_stream strm;
+  memset(&strm,0,sizeof(strm));
+  if ( context ) context->initBzip(strm);
+
+  if ( options.mThreads > 1 )
+  {
+    ret = compressBZIPParallel(options,source,len,dest,capacity,outlen);
+  }
+  else if ( BZ2_bzCompressInit(&strm,bzipBlockSize(options),0,30) == BZ_OK )
+  {
+    char *src = (char *)source;
+    char *dst = (char *)dest;
+    size_t inLeft = len;
+    size_t outLeft = capacity;
+    int err = BZ_RUN_OK;
+
+    // BZ_FINISH may only be issued once the remaining input fits in a single call.
+    while ( err == BZ_RUN_OK || err == BZ_FINISH_OK )
+    {
+      unsigned int inChunk  = (unsigned int)chunkOf(inLeft);
+      unsigned int outChunk = (unsigned int)chunkOf(outLeft);
+      if ( outChunk == 0 ) break;
+      strm.next_in   = src;
+      strm.avail_in  = inChunk;
+      strm.next_out  = dst;
+      strm.avail_out = outChunk;
+      err = BZ2_bzCompress(&strm,inChunk == inLeft ? BZ_FINISH : BZ_RUN);
+      src+=inChunk-strm.avail_in;
+      inLeft-=inChunk-strm.avail_in;
+      dst+=outChunk-strm.avail_out;
+      outLeft-=outChunk-strm.avail_out;
+    }
+
+    if ( err == BZ_STREAM_END )
+    {
+      outlen = capacity-outLeft;
+      ret = true;
+    }
+    BZ2_bzCompressEnd(&strm);
+  }
+
+  return ret;
+}
+
+bool compressLIBLZF(CompressionContext *context,const CompressionOptions & /*options*/,const void *source,size_t len,void *dest,size_t capacity,size_t &outlen)
+{
+  bool ret = false;
+
+  if ( len <= 0xFFFFFFFF ) // LZF counts in 32 bits.
+  {
+    unsigned int clen = capacity < 0xFFFFFFFF ? (unsigned int)capacity : 0xFFFFFFFF;
+    void *state = context ? context->getLZFState() : 0;
+    unsigned int csize = state ? lzf_compress_state(source, (unsigned int)len, dest, clen, state) : lzf_compress(source, (unsigned int)len, dest, clen);
+
+    if ( csize != 0 )
+    {
+      outlen = csize;
+      ret = true;
+    }
+  }
+
+  return ret;
+}
+
+bool compressLZMA(CompressionContext *context,const CompressionOptions &options,const Dictionary *dictionary,const void *source,size_t len,void *dest,size_t capacity,size_t &outlen)
+{
+  bool ret = false;
+
+  if ( capacity > LZMA_PROPS_SIZE )
+  {
+    CLzmaEncProps props;
+    lzmaProps(options,props);
+    const Byte *dict = dictionary ? dictionary->mData : 0;
+    SizeT dictLen = dictionary ? dictionary->mLength : 0;
+    if ( dictionary && !options.mWindowBits )
+    {
+      // Widen the window by the dictionary, so that it reaches as far back into the data as it would without one.
+      unsigned long long size = LzmaEncProps_GetDictSize(&props)+(unsigned long long)dictLen;
+      props.dictSize = size < (1u << 27) ? (UInt32)size : (1u << 27);
+    }
+    SizeT s = LZMA_PROPS_SIZE;
+    SizeT csize = capacity-LZMA_PROPS_SIZE;
+    SRes err = SZ_ERROR_MEM;
+    CLzmaEncHandle enc = context ? context->getLzmaEncoder() : LzmaEnc_Create(&alloc);
+    if ( enc )
+    {
+      err = LzmaEnc_SetProps(enc,&props);
+      if ( err == SZ_OK )
+        err = LzmaEnc_WriteProperties(enc,(Byte*)dest,&s);
+      if ( err == SZ_OK )
+        err = LzmaEnc_MemEncodeWithDic(enc,(Byte*)dest + LZMA_PROPS_SIZE, &csize, dict, dictLen, (const Byte*)source, len, 1, NULL, &alloc, &alloc);
+      if ( !context )
+        LzmaEnc_Destroy(enc,&alloc,&alloc);
+    }
+
+    if ( err == SZ_OK )
+    {
+      outlen = csize+LZMA_PROPS_SIZE;
+      ret = true;
+    }
+  }
+
+  return ret;
+}
+
+bool compressFASTLZ(CompressionContext * /*context*/,const CompressionOptions &options,const void *source,size_t len,void *dest,size_t capacity,size_t &outlen)
+{
+  bool ret = false;
+
+  // fastlz_compress does not check the output size, and counts in a signed int.
+  if ( len <= 0x7FFFFFFF-0x7FFFFFFF/20-66 && capacity >= len+len/20+66 )
+  {
+    int csize = options.mLevel < 0 ? fastlz_compress(source, (int)len, dest) : fastlz_compress_level(clampOption(options.mLevel,1,2), source, (int)len, dest);
+    if ( csize > 0 )
+    {
+      outlen = csize;
+      ret = true;
+    }
+  }
+
+  return ret;
+}
+
+bool compressSTORED(CompressionContext * /*context*/,const CompressionOptions & /*options*/,const void *source,size_t len,void *dest,size_t capacity,size_t &outlen)
+{
+  bool ret = len <= capacity;
+  if ( ret )
+  {
+    if ( len ) memcpy(dest,source,len);
+    outlen = len;
+  }
+  return ret;
+}
+
+bool compressMINIZ(CompressionContext *context,const CompressionOptions &options,const void *source,size_t len,void *dest,size_t capacity,size_t &outlen)
+{
+  bool ret = false;
+
+  const int flags = tdeflFlags(options);
+  size_t csize = 0;
+  tdefl_compressor *d = context ? context->getTdefl() : 0;
+  if ( d )
+  {
+    size_t inSize = len;
+    size_t outSize = capacity;
+    if ( tdefl_init(d,NULL,NULL,flags) == TDEFL_STATUS_OKAY &&
+         tdefl_compress(d,source,&inSize,dest,&outSize,TDEFL_FINISH) == TDEFL_STATUS_DONE )
+    {
+      csize = outSize;
+    }
+  }
+  else
+  {
+    csize = tdefl_compress_mem_to_mem(dest, capacity, source, len, flags);
+  }
+
+  if ( csize != 0 )
+  {
+    outlen = csize;
+    ret = true;
+  }
+
+  return ret;
+}
+
+static const char * getCompressionId(CompressionType type)
+{
+  const char *ret = 0;
+  switch ( type )
+  {
+    case CT_CRYPTO_GZIP: ret = "CRPT"; break;
+    case CT_MINILZO: ret = "MLZO"; break;
+    case CT_ZLIB: ret = "ZLIB"; break;
+    case CT_BZIP: ret = "BZIP"; break;
+    case CT_LIBLZF: ret = "LLZF"; break;
+    case CT_LZMA: ret = "LZMA"; break;
+    case CT_FASTLZ: ret = "FAST"; break;
+    case CT_MINIZ: ret = "MINI"; break;
+    case CT_STORED: ret = "STOR"; break;
+    default: break;
+  }
+  return ret;
+}
+
+static CompressionType getCompressionTypeFromId(const char *id)
+{
+  CompressionType ret = CT_INVALID;
+  for (int i=CT_INVALID+1; i<=CT_STORED && ret == CT_INVALID; i++)
+  {
+    const char *tid = getCompressionId((CompressionType)i);
+    if ( tid && memcmp(tid,id,4) == 0 )
+    {
+      ret = (CompressionType)i;
+    }
+  }
+  return ret;
+}
+
+size_t getMaxCompressedSize(CompressionType type,size_t len)
+{
+  size_t ret = 0;
+  bool known = true;
+
+  switch ( type )
+  {
+    case CT_CRYPTO_GZIP: ret = len+len/1000+64; break;                        // stored deflate blocks plus the gzip header and trailer
+    case CT_MINILZO: ret = len+len/16+64+3; break;                            // documented LZO1X worst case
+    case CT_ZLIB: ret = len+(len>>12)+(len>>14)+(len>>25)+13+(len/MAX_STREAM_CHUNK)*5; break; // zlib compressBound, plus a block boundary per piece
+    case CT_BZIP: ret = len+len/100+600; break;                               // documented bzip2 worst case
+    case CT_LIBLZF: ret = len+len/32+16; break;                               // one control byte per 32 literals
+    case CT_LZMA: ret = len+len/3+128+LZMA_PROPS_SIZE; break;                 // 7-zip SDK recommendation
+    case CT_FASTLZ: ret = len+len/20+66; break;                               // documented FastLZ minimum output size
+    case CT_MINIZ: ret = len+(len/(31*1024)+1)*5+128+len/10; break;          // stored deflate blocks plus the zlib header and trailer
+    case CT_STORED: ret = len; break;
+    default: known = false; break;
+  }
+
+  if ( type == CT_AUTO )
+  {
+    // Whichever codec is chosen must fit.
+    for (int i=CT_INVALID+1; i<=CT_STORED; i++)
+    {
+      size_t len2 = getMaxCompressedSize((CompressionType)i,len);
+      if ( len2 > ret ) ret = len2;
+    }
+  }
+  else if ( known ) // even empty input needs a header
+  {
+    ret+=MAX_HEADER_SIZE;
+  }
+
+  return ret;
+}
+
+static bool compressPayload(CompressionType type,CompressionContext *context,const CompressionOptions &options,const Dictionary *dictionary,const void *source,size_t len,void *data,size_t capacity,size_t &clen)
+{
+  bool ret = false;
+
+  switch ( type )
+  {
+#if USE_CRYPTO
+    case CT_CRYPTO_GZIP:
+      ret = compressCRYPTO_GZIP(context,options,source,len,data,capacity,clen);
+      break;
+#endif
+    case CT_MINILZO:
+      ret = compressMiniLZO(context,options,source,len,data,capacity,clen);
+      break;
+    case CT_ZLIB:
+#if USE_ZLIB
+      ret = compressZLIB(context,options,dictionary,source,len,data,capacity,clen);
+#endif
+      break;
+    case CT_BZIP:
+      ret = compressBZIP(context,options,source,len,data,capacity,clen);
+      break;
+    case CT_LIBLZF:
+      ret = compressLIBLZF(context,options,source,len,data,capacity,clen);
+      break;
+    case CT_LZMA:
+      ret = compressLZMA(context,options,dictionary,source,len,data,capacity,clen);
+      break;
+    case CT_FASTLZ:
+      ret = compressFASTLZ(context,options,source,len,data,capacity,clen);
+      break;
+    case CT_MINIZ:
+      ret = compressMINIZ(context,options,source,len,data,capacity,clen);
+      break;
+    case CT_STORED:
+      ret = compressSTORED(context,options,source,len,data,capacity,clen);
+      break;
+    default:
+      break;
+  }
+
+  return ret;
+}
+
+//*** Incompressible data
+
+const size_t   ENTROPY_SAMPLE_SIZE=4096;
+const size_t   ENTROPY_SAMPLE_COUNT=4;
+const double   INCOMPRESSIBLE_BITS=7.95;   // per byte; random data measures about 7.99 over the 16KB sampled
+
+// Estimates the order-0 entropy of a few samples of the input.  Data which is already compressed or encrypted
+// measures close to 8 bits per byte, and is stored rather than handed to a codec which could only expand it.
+// Inputs too small to sample fairly are left to the codec; compressInto stores them if they do not shrink.
+static bool isIncompressible(const void *source,size_t len)
+{
+  bool ret = false;
+
+  if ( len >= ENTROPY_SAMPLE_SIZE*ENTROPY_SAMPLE_COUNT )
+  {
+    const unsigned char *src = (const unsigned char *)source;
+    unsigned int counts[256];
+    memset(counts,0,sizeof(counts));
+    for (size_t i=0; i<ENTROPY_SAMPLE_COUNT; i++)
+    {
+      const unsigned char *p = src+(len-ENTROPY_SAMPLE_SIZE)/(ENTROPY_SAMPLE_COUNT-1)*i;
+      for (size_t j=0; j<ENTROPY_SAMPLE_SIZE; j++)
+      {
+        counts[p[j]]++;
+      }
+    }
+
+    const double total = (double)(ENTROPY_SAMPLE_SIZE*ENTROPY_SAMPLE_COUNT);
+    double bits = 0;
+    for (int i=0; i<256; i++)
+    {
+      if ( counts[i] )
+      {
+        double p = counts[i]/total;
+        bits-=p*log(p);
+      }
+    }
+    ret = bits/log(2.0) > INCOMPRESSIBLE_BITS;
+  }
+
+  return ret;
+}
+
+//*** Automatic codec selection
+
+const size_t AUTO_SAMPLE_SIZE=16*1024;
+const size_t AUTO_SAMPLE_COUNT=4;
+
+// A codec and the level it is tried at, -1 for one without levels.
+struct AutoCodec
+{
+  CompressionType mType;
+  int             mLevel;
+};
+
+// The fast codecs are always tried; the stronger ones only when the target cannot be met without them.
+static const AutoCodec gFastCodecs[] = { { CT_LIBLZF, -1 }, { CT_FASTLZ, 1 },
+#if USE_MINI_LZO
+                                         { CT_MINILZO, -1 },
+#endif
+                                         { CT_MINIZ, 1 } };
+static const AutoCodec gStrongCodecs[] = { { CT_ZLIB, 1 }, { CT_ZLIB, 6 }, { CT_LZMA, 1 } };
+
+// A strong codec is worth trying for a latency budget only if it is at least this many times the fastest codec's time.
+const double AUTO_STRONG_FACTOR=8.0;
+
+struct Trial
+{
+  CompressionType mType;
+  int             mLevel;
+  double          mRatio;       // uncompressed/compressed size of the samples
+  double          mSeconds;     // expected time for the whole input
+};
+
+// Compresses up to AUTO_SAMPLE_COUNT evenly spaced samples of the input (all of it, if it is small enough) with
+// 'codec', at the level the input will then be compressed at, so that the timings predict the real run.
+static bool trialCompress(const AutoCodec &codec,CompressionContext *context,const unsigned char *source,size_t len,std::vector<unsigned char> &scratch,Trial &trial)
+{
+  bool ret = true;
+  CompressionType type = codec.mType;
+  CompressionOptions options(codec.mLevel);
+
+  size_t sampleSize = len;
+  size_t sampleCount = 1;
+  if ( len > AUTO_SAMPLE_SIZE*AUTO_SAMPLE_COUNT )
+  {
+    sampleSize = AUTO_SAMPLE_SIZE;
+    sampleCount = AUTO_SAMPLE_COUNT;
+  }
+
+  scratch.resize(getMaxCompressedSize(type,sampleSize));
+  size_t raw = 0;
+  size_t compressed = 0;
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (size_t i=0; i<sampleCount && ret; i++)
+  {
+    size_t offset = sampleCount > 1 ? (len-sampleSize)/(sampleCount-1)*i : 0;
+    size_t clen = 0;
+    ret = compressPayload(type,context,options,0,source+offset,sampleSize,&scratch[0],scratch.size(),clen);
+    raw+=sampleSize;
+    compressed+=clen;
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+
+  if ( ret )
+  {
+    trial.mType    = type;
+    trial.mLevel   = codec.mLevel;
+    trial.mRatio   = compressed ? (double)raw/(double)compressed : 1;
+    trial.mSeconds = raw ? seconds*(double)len/(double)raw : 0;
+  }
+
+  return ret;
+}
+
+static void runTrials(const AutoCodec *codecs,size_t count,CompressionContext *context,const unsigned char *source,size_t len,std::vector<unsigned char> &scratch,std::vector<Trial> &trials)
+{
+  for (size_t i=0; i<count; i++)
+  {
+    Trial trial;
+    if ( trialCompress(codecs[i],context,source,len,scratch,trial) )
+    {
+      trials.push_back(trial);
+    }
+  }
+}
+
+static const Trial * fastest(const std::vector<Trial> &trials,double minRatio)
+{
+  const Trial *ret = 0;
+  for (size_t i=0; i<trials.size(); i++)
+  {
+    if ( trials[i].mRatio >= minRatio && (!ret || trials[i].mSeconds < ret->mSeconds) )
+    {
+      ret = &trials[i];
+    }
+  }
+  return ret;
+}
+
+static const Trial * smallest(const std::vector<Trial> &trials,double maxSeconds)
+{
+  const Trial *ret = 0;
+  for (size_t i=0; i<trials.size(); i++)
+  {
+    if ( trials[i].mSeconds <= maxSeconds && (!ret || trials[i].mRatio > ret->mRatio) )
+    {
+      ret = &trials[i];
+    }
+  }
+  return ret;
+}
+
+CompressionType chooseCompressionType(const void *source,size_t len,const AutoTarget &target,CompressionContext *context,int *level)
+{
+  CompressionType ret = CT_ZLIB;
+  int retLevel = -1;
+
+  if ( isIncompressible(source,len) )
+  {
+    ret = CT_STORED;
+  }
+  else if ( source && len )
+  {
+    CompressionContext *local = context ? 0 : new CompressionContext;
+    if ( !context ) context = local;
+
+    const unsigned char *src = (const unsigned char *)source;
+    std::vector<unsigned char> scratch;
+    std::vector<Trial> trials;
+    runTrials(gFastCodecs,sizeof(gFastCodecs)/sizeof(gFastCodecs[0]),context,src,len,scratch,trials);
+
+    const Trial *choice = 0;
+    switch ( target.mGoal )
+    {
+      case AG_THROUGHPUT:
+        choice = fastest(trials,1.0);
+        if ( !choice ) ret = CT_STORED;
+        break;
+      case AG_RATIO:
+        choice = fastest(trials,target.mMinRatio);
+        if ( !choice )
+        {
+          runTrials(gStrongCodecs,sizeof(gStrongCodecs)/sizeof(gStrongCodecs[0]),context,src,len,scratch,trials);
+          choice = fastest(trials,target.mMinRatio);
+          if ( !choice ) choice = smallest(trials,1e300);
+        }
+        break;
+      case AG_LATENCY:
+        {
+          const Trial *quickest = fastest(trials,0);
+          if ( quickest && quickest->mSeconds*AUTO_STRONG_FACTOR <= target.mLatencyBudget )
+          {
+            runTrials(gStrongCodecs,sizeof(gStrongCodecs)/sizeof(gStrongCodecs[0]),context,src,len,scratch,trials);
+          }
+          choice = smallest(trials,target.mLatencyBudget);
+          if ( !choice ) choice = fastest(trials,0);
+        }
+        break;
+    }
+    if ( !choice && ret != CT_STORED ) choice = fastest(trials,0);
+    if ( choice )
+    {
+      ret = choice->mType;
+      retLevel = choice->mLevel;
+    }
+
+    delete local;
+  }
+
+  if ( level ) *level = retLevel;
+  return ret;
+}
+
+// Resolves CT_AUTO to the codec chosen for this data by the options' mAutoTarget, pointing 'options' at 'resolved',
+// a copy of them with the chosen level.  Any other type is returned as it is.
+static CompressionType resolveAuto(CompressionType type,const void *source,size_t len,CompressionContext *context,const CompressionOptions *&options,CompressionOptions &resolved)
+{
+  if ( type == CT_AUTO )
+  {
+    resolved = options ? *options : gDefaultOptions;
+    type = chooseCompressionType(source,len,resolved.mAutoTarget,context,&resolved.mLevel);
+    options = &resolved;
+  }
+  return type;
+}
+
+bool compressInto(const void *source,size_t len,void *dest,size_t destCapacity,size_t &outlen,CompressionType type,CompressionContext *context,ChecksumType checksum,const CompressionOptions *options)
+{
+  bool ret = false;
+  CompressionOptions resolved;
+  type = resolveAuto(type,source,len,context,options,resolved);
+  const CompressionOptions &opts = options ? *options : gDefaultOptions;
+
+  outlen = 0;
+
+  const char *id = getCompressionId(type);
+  unsigned int kind = getChecksumKind(checksum);
+  DictionaryRef dictionary;
+  if ( opts.mDictionary && usesDictionary(type) )
+  {
+    dictionary = findDictionary(opts.mDictionary);
+    if ( !dictionary ) id = 0; // it must be registered to be used
+  }
+  unsigned int dictionaryId = dictionary ? dictionary->mId : 0;
+  size_t hsize = headerSize(kind,dictionaryId);
+
+  if ( id && dest && destCapacity > hsize )
+  {
+    unsigned char *data = (unsigned char *)dest+hsize;
+    size_t capacity = destCapacity-hsize;
+    size_t clen = 0;
+
+    // Data which will not compress, or which the codec fails on or expands, is stored instead,
+    // so the output is never more than the header larger than the input.
+    if ( type != CT_STORED && !isIncompressible(source,len) )
+    {
+      ret = compressPayload(type,context,opts,dictionary.get(),source,len,data,capacity,clen) && clen < len;
+    }
+    if ( !ret )
+    {
+      type = CT_STORED;
+      id = getCompressionId(type);
+      dictionaryId = 0;
+      hsize = headerSize(kind);
+      data = (unsigned char *)dest+hsize;
+      capacity = destCapacity-hsize;
+      ret = compressPayload(type,context,opts,0,source,len,data,capacity,clen);
+    }
+
+    if ( ret )
+    {
+      outlen = clen+hsize;
+      unsigned int crc = kind == CK_CRC32C ? ComputeChecksum(kind,data,clen,LengthSeed(len)) : 0;
+      unsigned long long hash = kind == CK_HASH64 ? ComputeHash64(source,len,0) : 0;
+      writeHeader(dest,id,0,kind,len,outlen,crc,hash,dictionaryId);
+    }
+  }
+
+  return ret;
+}
+
+void * compressData(const void *source,size_t len,size_t &outlen,CompressionType type,CompressionContext *context,ChecksumType checksum,const CompressionOptions *options)
+{
+  void *ret = 0;
+
+  outlen = 0;
+
+  size_t maxlen = getMaxCompressedSize(type,len);
+  if ( maxlen )
+  {
+    ret = malloc(maxlen);
+    if ( ret && !compressInto(source,len,ret,maxlen,outlen,type,context,checksum,options) )
+    {
+      free(ret);
+      ret = 0;
+    }
+  }
+
+  return ret;
+}
+
+// Each backend decompresses 'slen' bytes of payload into 'dest', which holds exactly 'rawLength' bytes.
+// The header has already been validated and the CRC checked by decompressInto.
+
+bool decompressMiniLZO(CompressionContext * /*context*/,const void *data,size_t slen,void *dest,size_t rawLength)
+{
+#if USE_MINI_LZO
+  if ( !initMiniLZO() || (lzo_uint)slen != slen || (lzo_uint)rawLength != rawLength ) return false;
+  lzo_uint destLen = (lzo_uint)rawLength;
+  int r = lzo1x_decompress_safe((const unsigned char *)data,(lzo_uint)slen,(unsigned char *)dest,&destLen,0);
+  return r == LZO_E_OK && destLen == (lzo_uint)rawLength;
+#else
+  return false;
+#endif
+}
+
+#if USE_CRYPTO
+bool decompressCRYPTO_GZIP(CompressionContext * /*context*/,const void *data,size_t slen,void *dest,size_t rawLength)
+{
+  CryptoPP::Gunzip zipper;
+  zipper.PutMessageEnd((const byte *)data,slen);
+  return zipper.Get((byte *)dest,rawLength) == rawLength;
+}
+#endif
+
+#if USE_ZLIB
+bool decompressZLIB(CompressionContext *context,const Dictionary *dictionary,const void *data,size_t slen,void *dest,size_t rawLength)
+{
+  bool ret = false;
+
+  if ( context )
+  {
+    z_stream *strm = context->getInflate();
+    ret = strm && inflateBuffer(strm,dictionary,data,slen,dest,rawLength);
+  }
+  else
+  {
+    z_stream strm;
+    memset(&strm,0,sizeof(strm));
+    if ( inflateInit(&strm) == Z_OK )
+    {
+      ret = inflateBuffer(&strm,dictionary,data,slen,dest,rawLength);
+      inflateEnd(&strm);
+    }
+  }
+
+  return ret;
+}
+#endif
+
+// Decodes one bzip2 stream, or several concatenated (as parallel bzip2 writes them), into 'dest'.  Given 'grow',
+// which 'dest' must be the data of, the output is not limited to 'capacity' but grows the vector as needed.
+static bool decodeBZIP(CompressionContext *context,const void *data,size_t slen,std::vector<unsigned char> *grow,void *dest,size_t capacity,size_t &outlen)
+{
+  char *src = (char *)data;
+  size_t inLeft = slen;
+  int err = BZ_OK;
+
+  outlen = 0;
+
+  do // once per stream, as BZ2_bzDecompress stops at the end of each
+  {
+    bz_stream strm;
+    memset(&strm,0,sizeof(strm));
+    if ( context ) context->initBzip(strm);
+
+    err = BZ2_bzDecompressInit(&strm,0,0);
+    if ( err == BZ_OK )
+    {
+      while ( err == BZ_OK )
+      {
+        if ( grow && outlen == capacity )
+        {
+          grow->resize(capacity ? capacity*2 : 65536);
+          capacity = grow->size();
+          dest = &(*grow)[0];
+        }
+        unsigned int inChunk  = (unsigned int)chunkOf(inLeft);
+        unsigned int outChunk = (unsigned int)chunkOf(capacity-outlen);
+        strm.next_in   = src;
+        strm.avail_in  = inChunk;
+        strm.next_out  = (char *)dest+outlen;
+        strm.avail_out = outChunk;
+        err = BZ2_bzDecompress(&strm);
+        unsigned int used = inChunk-strm.avail_in;
+        unsigned int produced = outChunk-strm.avail_out;
+        src+=used;
+        inLeft-=used;
+        outlen+=produced;
+        if ( err == BZ_OK && used == 0 && produced == 0 ) break; // out of input or output space
+      }
+      BZ2_bzDecompressEnd(&strm);
+    }
+  } while ( err == BZ_STREAM_END && inLeft );
+
+  return err == BZ_STREAM_END;
+}
+
+bool decompressBZIP(CompressionContext *context,const void *data,size_t slen,void *dest,size_t rawLength)
+{
+  size_t outlen = 0;
+  return decodeBZIP(context,data,slen,0,dest,rawLength,outlen) && outlen == rawLength;
+}
+
+bool decompressLIBLZF(CompressionContext * /*context*/,const void *data,size_t slen,void *dest,size_t rawLength)
+{
+  bool ret = false;
+  if ( slen <= 0xFFFFFFFF && rawLength <= 0xFFFFFFFF )
+  {
+    unsigned int destLen = lzf_decompress(data, (unsigned int)slen, dest, (unsigned int)rawLength);
+    ret = destLen == rawLength;
+  }
+  return ret;
+}
+
+// The decoder needs the dictionary just before its output, as the encoder had it, so this decodes into a copy of the
+// dictionary and moves the result out.
+// With a context the dictionary stays in its buffer between calls, so a run of small messages pays only for copying
+// out what each one decodes to.
+static bool decompressLZMADictionary(CLzmaDec *dec,CompressionContext *context,const Dictionary &dictionary,const void *data,size_t slen,void *dest,size_t rawLength)
+{
+  bool ret = false;
+
+  size_t dictLen = dictionary.mLength;
+  Byte *buffer = context ? context->getDictionaryBuffer(dictionary.mData,dictLen,dictionary.mSerial,rawLength) : (Byte *)malloc(dictLen+rawLength);
+  if ( buffer && LzmaDec_AllocateProbs(dec,(const Byte*)data,LZMA_PROPS_SIZE,&alloc) == SZ_OK )
+  {
+    SizeT srcLen = slen-LZMA_PROPS_SIZE;
+    ELzmaStatus status;
+    if ( !context ) memcpy(buffer,dictionary.mData,dictLen);
+    dec->dic = buffer;
+    dec->dicBufSize = dictLen+rawLength;
+    LzmaDec_InitWithDic(dec,dictLen);
+    SRes err = LzmaDec_DecodeToDic(dec,dictLen+rawLength,(const Byte*)data + LZMA_PROPS_SIZE,&srcLen,LZMA_FINISH_END,&status);
+    ret = err == SZ_OK && dec->dicPos == (SizeT)(dictLen+rawLength) && status != LZMA_STATUS_NEEDS_MORE_INPUT;
+    if ( ret && rawLength ) memcpy(dest,buffer+dictLen,rawLength);
+    dec->dic = 0;
+    dec->dicBufSize = 0;
+  }
+  if ( !context ) free(buffer);
+
+  return ret;
+}
+
+bool decompressLZMA(CompressionContext *context,const Dictionary *dictionary,const void *data,size_t slen,void *dest,size_t rawLength)
+{
+  bool ret = false;
+
+  if ( slen >= LZMA_PROPS_SIZE && dictionary )
+  {
+    CLzmaDec local;
+    LzmaDec_Construct(&local);
+    CLzmaDec *dec = context ? context->getLzmaDecoder() : &local;
+    ret = decompressLZMADictionary(dec,context,*dictionary,data,slen,dest,rawLength);
+    LzmaDec_FreeProbs(&local,&alloc);
+  }
+  else if ( slen >= LZMA_PROPS_SIZE )
+  {
+    SizeT srcLen = slen-LZMA_PROPS_SIZE;
+    ELzmaStatus status;
+    if ( context )
+    {
+      // Decode straight into the destination as LzmaDecode does, but keep the probability tables between calls.
+      CLzmaDec *dec = context->getLzmaDecoder();
+      if ( LzmaDec_AllocateProbs(dec,(const Byte*)data,LZMA_PROPS_SIZE,&alloc) == SZ_OK )
+      {
+        dec->dic = (Byte*)dest;
+        dec->dicBufSize = rawLength;
+        LzmaDec_Init(dec);
+        SRes err = LzmaDec_DecodeToDic(dec,rawLength,(const Byte*)data + LZMA_PROPS_SIZE,&srcLen,LZMA_FINISH_END,&status);
+        ret = err == SZ_OK && dec->dicPos == (SizeT)rawLength && status != LZMA_STATUS_NEEDS_MORE_INPUT;
+        dec->dic = 0;
+        dec->dicBufSize = 0;
+      }
+    }
+    else
+    {
+      SizeT destLen = rawLength;
+      SRes err = LzmaDecode((Byte*)dest, &destLen, (const Byte*)data + LZMA_PROPS_SIZE, &srcLen, (const Byte*)data, LZMA_PROPS_SIZE, LZMA_FINISH_END, &status, &alloc);
+      ret = err == SZ_OK && destLen == (SizeT)rawLength;
+    }
+  }
+
+  return ret;
+}
+
+bool decompressFASTLZ(CompressionContext * /*context*/,const void *data,size_t slen,void *dest,size_t rawLength)
+{
+  bool ret = false;
+  if ( slen <= 0x7FFFFFFF && rawLength <= 0x7FFFFFFF )
+  {
+    int destLen = fastlz_decompress(data, (int)slen, dest, (int)rawLength);
+    ret = destLen >= 0 && (size_t)destLen == rawLength;
+  }
+  return ret;
+}
+
+bool decompressSTORED(CompressionContext * /*context*/,const void *data,size_t slen,void *dest,size_t rawLength)
+{
+  bool ret = slen == rawLength;
+  if ( ret && slen ) memcpy(dest,data,slen);
+  return ret;
+}
+
+// miniz writes an ordinary zlib stream, so with zlib compiled in it is decoded by zlib's faster inflate.
+bool decompressMINIZ(CompressionContext *context,const void *data,size_t slen,void *dest,size_t rawLength)
+{
+#if USE_ZLIB
+  return decompressZLIB(context,0,data,slen,dest,rawLength);
+#else
+  size_t destLen = tinfl_decompress_mem_to_mem(dest, rawLength, data, slen, TINFL_FLAG_PARSE_ZLIB_HEADER);
+  return destLen == rawLength;
+#endif
+}
+
+size_t getDecompressedSize(const void *mem,size_t clen)
+{
+  size_t ret = 0;
+
+  HeaderInfo info;
+  if ( readHeader(mem,clen,info) )
+  {
+    ret = (size_t)info.mRawLength;
+  }
+
+  return ret;
+}
+
+static bool decompressBZIPParallel(const void *data,size_t slen,void *dest,size_t rawLength,unsigned int numThreads);
+
+// 'numThreads' is only used by bzip2, whose concatenated streams can be decoded in parallel.
+static bool decompressPayload(CompressionType type,CompressionContext *context,const Dictionary *dictionary,const void *data,size_t slen,void *dest,size_t rawLength,unsigned int numThreads=1)
+{
+  bool ret = false;
+
+  switch ( type )
+  {
+#if USE_CRYPTO
+    case CT_CRYPTO_GZIP:
+      ret = decompressCRYPTO_GZIP(context,data,slen,dest,rawLength);
+      break;
+#endif
+    case CT_MINILZO:
+      ret = decompressMiniLZO(context,data,slen,dest,rawLength);
+      break;
+    case CT_ZLIB:
+#if USE_ZLIB
+      ret = decompressZLIB(context,dictionary,data,slen,dest,rawLength);
+#endif
+      break;
+    case CT_BZIP:
+      ret = (numThreads != 1 && decompressBZIPParallel(data,slen,dest,rawLength,numThreads)) || decompressBZIP(context,data,slen,dest,rawLength);
+      break;
+    case CT_LIBLZF:
+      ret = decompressLIBLZF(context,data,slen,dest,rawLength);
+      break;
+    case CT_LZMA:
+      ret = decompressLZMA(context,dictionary,data,slen,dest,rawLength);
+      break;
+    case CT_FASTLZ:
+      ret = decompressFASTLZ(context,data,slen,dest,rawLength);
+      break;
+    case CT_MINIZ:
+      ret = decompressMINIZ(context,data,slen,dest,rawLength);
+      break;
+    case CT_STORED:
+      ret = decompressSTORED(context,data,slen,dest,rawLength);
+      break;
+    default:
+      break;
+  }
+
+  return ret;
+}
+
+//*** Block-parallel mode
+
+// A block container is an ordinary header with HF_BLOCKS set, whose CRC covers only this index.  The index is
+// followed by the blocks, each a complete compressInto payload with its own header and CRC.
+struct BlockIndex
+{
+  unsigned int    mBlockCount;
+  unsigned int    mBlockSize;
+  // unsigned long long offsets[mBlockCount+1]; the position of each block within the payload, and its end.
+};
+
+const size_t DEFAULT_BLOCK_SIZE=1024*1024;
+const size_t MIN_BLOCK_SIZE=64*1024;
+
+typedef bool (*BlockJob)(void *userData,size_t block,CompressionContext *context);
+
+// Runs job() for every block on up to numThreads threads (0 means one per hardware thread), each with its own context.
+static bool runBlockJobs(BlockJob job,void *userData,size_t blockCount,unsigned int numThreads,CompressionContext *context)
+{
+  if ( numThreads == 0 )
+  {
+    numThreads = std::thread::hardware_concurrency();
+    if ( numThreads == 0 ) numThreads = 1;
+  }
+  if ( numThreads > blockCount )
+  {
+    numThreads = (unsigned int)blockCount;
+  }
+
+  std::atomic<size_t> next(0);
+  std::atomic<bool> ok(true);
+
+  struct Worker
+  {
+    static void run(BlockJob job,void *userData,size_t blockCount,std::atomic<size_t> *next,std::atomic<bool> *ok,CompressionContext *context)
+    {
+      CompressionContext *local = context ? 0 : new CompressionContext;
+      for (size_t i=(*next)++; i<blockCount && *ok; i=(*next)++)
+      {
+        if ( !job(userData,i,context ? context : local) ) *ok = false;
+      }
+      delete local;
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned int i=1; i<numThreads; i++)
+  {
+    threads.push_back(std::thread(Worker::run,job,userData,blockCount,&next,&ok,(CompressionContext *)0));
+  }
+  Worker::run(job,userData,blockCount,&next,&ok,context); // the calling thread works too, with the caller's context if any.
+  for (size_t i=0; i<threads.size(); i++)
+  {
+    threads[i].join();
+  }
+
+  return ok;
+}
+
+struct BlockCompressJob
+{
+  const unsigned char  *mSource;
+  size_t                mLength;
+  size_t                mBlockSize;
+  CompressionType       mType;
+  ChecksumType          mChecksum;
+  const CompressionOptions *mOptions;
+  unsigned char        *mSlots;        // one slot of mSlotSize bytes per block
+  size_t                mSlotSize;
+  size_t               *mSizes;
+
+  static bool run(void *userData,size_t block,CompressionContext *context)
+  {
+    BlockCompressJob *j = (BlockCompressJob *)userData;
+    size_t offset = block*j->mBlockSize;
+    size_t len = j->mLength-offset < j->mBlockSize ? j->mLength-offset : j->mBlockSize;
+    return compressInto(j->mSource+offset,len,j->mSlots+block*j->mSlotSize,j->mSlotSize,j->mSizes[block],j->mType,context,j->mChecksum,j->mOptions);
+  }
+};
+
+void * compressDataParallel(const void *source,size_t len,size_t &outlen,CompressionType type,unsigned int numThreads,size_t blockSize,ChecksumType checksum,const CompressionOptions *options)
+{
+  void *ret = 0;
+
+  outlen = 0;
+
+  if ( blockSize == 0 ) blockSize = DEFAULT_BLOCK_SIZE;
+  if ( blockSize < MIN_BLOCK_SIZE ) blockSize = MIN_BLOCK_SIZE;
+  if ( blockSize > 0x7FFFFFFF ) blockSize = 0x7FFFFFFF;
+
+  CompressionOptions resolved;
+  type = resolveAuto(type,source,len,0,options,resolved);
+
+  const char *id = getCompressionId(type);
+  size_t blockCount = (len+blockSize-1)/blockSize;
+  size_t slotSize = getMaxCompressedSize(type,blockSize);
+
+  if ( id && slotSize && blockCount <= 0xFFFFFFFF )
+  {
+    size_t indexSize = sizeof(BlockIndex)+(blockCount+1)*sizeof(unsigned long long);
+    size_t maxlen = sizeof(CompressionHeader)+indexSize+blockCount*slotSize;
+    std::vector<size_t> sizes(blockCount+1);
+    unsigned char *dest = (unsigned char *)malloc(maxlen);
+
+    if ( dest )
+    {
+      CompressionHeader *h = (CompressionHeader *)dest;
+      unsigned char *payload = (unsigned char *)(h+1);
+
+      BlockCompressJob job;
+      job.mSource    = (const unsigned char *)source;
+      job.mLength    = len;
+      job.mBlockSize = blockSize;
+      job.mType      = type;
+      job.mChecksum  = checksum;
+      job.mOptions   = options;
+      job.mSlots     = payload+indexSize;
+      job.mSlotSize  = slotSize;
+      job.mSizes     = &sizes[0];
+
+      if ( runBlockJobs(BlockCompressJob::run,&job,blockCount,numThreads,0) )
+      {
+        // Close up the gaps between the slots; each block only ever moves towards the front.
+        BlockIndex *index = (BlockIndex *)payload;
+        unsigned long long *offsets = (unsigned long long *)(index+1);
+        index->mBlockCount = (unsigned int)blockCount;
+        index->mBlockSize  = (unsigned int)blockSize;
+        size_t pos = indexSize;
+        for (size_t i=0; i<blockCount; i++)
+        {
+          offsets[i] = pos;
+          memmove(payload+pos,job.mSlots+i*slotSize,sizes[i]);
+          pos+=sizes[i];
+        }
+        offsets[blockCount] = pos;
+
+        // The blocks carry the requested checksum; the index itself is covered by a CRC unless checksums are off.
+        unsigned int kind = checksum == CS_NONE ? CK_NONE : CK_CRC32C;
+        outlen = sizeof(CompressionHeader)+pos;
+        writeHeader(h,id,HF_BLOCKS,kind,len,outlen,kind == CK_CRC32C ? ComputeChecksum(kind,payload,indexSize,LengthSeed(len)) : 0,0);
+
+        ret = realloc(dest,outlen);
+        if ( !ret ) ret = dest;
+      }
+      else
+      {
+        free(dest);
+      }
+    }
+  }
+
+  return ret;
+}
+
+struct BlockDecompressJob
+{
+  const unsigned char       *mPayload;
+  const unsigned long long  *mOffsets;
+  unsigned char             *mDest;
+  size_t                     mLength;
+  size_t                     mBlockSize;
+
+  static bool run(void *userData,size_t block,CompressionContext *context)
+  {
+    BlockDecompressJob *j = (BlockDecompressJob *)userData;
+    size_t offset = block*j->mBlockSize;
+    size_t len = j->mLength-offset < j->mBlockSize ? j->mLength-offset : j->mBlockSize;
+    size_t outlen = 0;
+    const unsigned char *src = j->mPayload+j->mOffsets[block];
+    size_t slen = (size_t)(j->mOffsets[block+1]-j->mOffsets[block]);
+    return getDecompressedSize(src,slen) == len && decompressInto(src,slen,j->mDest+offset,len,outlen,context) && outlen == len;
+  }
+};
+
+// Checks the index of a block container, returning the offsets of its blocks within the payload, or 0 if it is damaged.
+static const unsigned long long * readBlockIndex(const HeaderInfo &info,const unsigned char *payload,size_t slen,size_t &blockCount,size_t &blockSize)
+{
+  const unsigned long long *ret = 0;
+
+  if ( slen >= sizeof(BlockIndex) )
+  {
+    const BlockIndex *index = (const BlockIndex *)payload;
+    size_t rawLength = (size_t)info.mRawLength;
+    size_t indexSize = sizeof(BlockIndex)+((size_t)index->mBlockCount+1)*sizeof(unsigned long long);
+    blockCount = index->mBlockCount;
+    blockSize = index->mBlockSize;
+
+    if ( blockSize && blockCount == (rawLength+blockSize-1)/blockSize && indexSize <= slen && verifyPayload(info,payload,indexSize) )
+    {
+      const unsigned long long *offsets = (const unsigned long long *)(index+1);
+      bool ok = offsets[0] == indexSize && offsets[blockCount] == slen;
+      for (size_t i=0; i<blockCount && ok; i++)
+      {
+        ok = offsets[i] <= offsets[i+1];
+      }
+      if ( ok ) ret = offsets;
+    }
+  }
+
+  return ret;
+}
+
+static bool decompressBlocks(const HeaderInfo &info,const unsigned char *payload,size_t slen,void *dest,size_t rawLength,unsigned int numThreads,CompressionContext *context)
+{
+  size_t blockCount = 0;
+  size_t blockSize = 0;
+  const unsigned long long *offsets = readBlockIndex(info,payload,slen,blockCount,blockSize);
+  bool ret = offsets != 0;
+
+  if ( ret && blockCount )
+  {
+    BlockDecompressJob job;
+    job.mPayload   = payload;
+    job.mOffsets   = offsets;
+    job.mDest      = (unsigned char *)dest;
+    job.mLength    = rawLength;
+    job.mBlockSize = blockSize;
+    ret = runBlockJobs(BlockDecompressJob::run,&job,blockCount,numThreads,context);
+  }
+
+  return ret;
+}
+
+// The most raw data a payload of 'slen' bytes of the codec could expand to.
+static unsigned long long getMaxDecompressedSize(CompressionType type,size_t slen)
+{
+  unsigned long long ratio = 0;
+
+  switch ( type )
+  {
+    case CT_CRYPTO_GZIP:
+    case CT_ZLIB:
+    case CT_MINIZ: ratio = 1032; break;           // deflate's limit, a 258 byte match in two bits
+    case CT_MINILZO:
+    case CT_LIBLZF:
+    case CT_FASTLZ: ratio = 256; break;           // a length runs on by at most 255 a byte
+    case CT_LZMA: ratio = 8192; break;            // a 273 byte repeat costs under a third of a bit at the coder's best odds
+    case CT_BZIP: ratio = 45899236/16; break;     // a 900k block of runs holds 51 times that, and costs over 16 bytes
+    case CT_STORED: ratio = 1; break;
+    default: break;
+  }
+
+  return slen < ~0ULL/(ratio ? ratio : 1) ? ratio*slen : ~0ULL;
+}
+
+// Whether the raw length in the header can be trusted enough to allocate for.  A CRC is seeded with the length, so
+// checking it (or for a block container, that of the index) settles it, and 'verified' is set if the payload itself
+// was checked.  Without one the length is only held to what the codec could have expanded the payload to.
+static bool checkRawLength(const HeaderInfo &info,const unsigned char *payload,size_t slen,bool &verified)
+{
+  bool ret = false;
+  unsigned int kind = checksumKind(info);
+
+  verified = false;
+  if ( kind == CK_NONE || kind == CK_HASH64 )
+  {
+    ret = info.mRawLength <= getMaxDecompressedSize(info.mType,slen);
+  }
+  else if ( info.mFlags & HF_BLOCKS )
+  {
+    size_t blockCount = 0;
+    size_t blockSize = 0;
+    ret = readBlockIndex(info,payload,slen,blockCount,blockSize) != 0;
+  }
+  else
+  {
+    ret = verified = verifyPayload(info,payload,slen);
+  }
+
+  return ret;
+}
+
+// 'verified' skips checking the CRC of an ordinary payload which the caller has already checked.
+static bool decompressIntoThreads(const void *source,size_t clen,void *dest,size_t destCapacity,size_t &outlen,CompressionContext *context,unsigned int numThreads,bool verified=false)
+{
+  bool ret = false;
+
+  outlen = 0;
+
+  HeaderInfo info;
+  if ( readHeader(source,clen,info) )
+  {
+    const unsigned char *data = (const unsigned char *)source+info.mHeaderSize;
+    size_t slen = clen-info.mHeaderSize;
+    size_t rawLength = (size_t)info.mRawLength;
+
+    if ( rawLength <= destCapacity && (dest || rawLength == 0) )
+    {
+      if ( info.mFlags & HF_BLOCKS )
+      {
+        ret = decompressBlocks(info,data,slen,dest,rawLength,numThreads,context);
+      }
+      else
+      {
+        DictionaryRef dictionary;
+        if ( info.mDictionary ) dictionary = findDictionary(info.mDictionary);
+        ret = (dictionary || !info.mDictionary) && (verified || verifyPayload(info,data,slen)) &&
+              decompressPayload(info.mType,context,dictionary.get(),data,slen,dest,rawLength,numThreads) && verifyRaw(info,dest,rawLength);
+      }
+    }
+
+    if ( ret )
+    {
+      outlen = rawLength;
+    }
+  }
+
+  return ret;
+}
+
+static void * decompressDataThreads(const void *source,size_t clen,size_t &outlen,CompressionContext *context,unsigned int numThreads)
+{
+  void * ret = 0;
+
+  outlen = 0;
+
+  HeaderInfo info;
+  bool verified = false;
+  if ( readHeader(source,clen,info) && checkRawLength(info,(const unsigned char *)source+info.mHeaderSize,clen-info.mHeaderSize,verified) )
+  {
+    size_t rawLength = (size_t)info.mRawLength;
+    ret = malloc(rawLength ? rawLength : 1);
+    if ( ret && !decompressIntoThreads(source,clen,ret,rawLength,outlen,context,numThreads,verified) )
+    {
+      free(ret);
+      ret = 0;
+    }
+  }
+
+  return ret;
+}
+
+bool decompressInto(const void *source,size_t clen,void *dest,size_t destCapacity,size_t &outlen,CompressionContext *context)
+{
+  return decompressIntoThreads(source,clen,dest,destCapacity,outlen,context,1);
+}
+
+void * decompressData(const void *source,size_t clen,size_t &outlen,CompressionContext *context)
+{
+  return decompressDataThreads(source,clen,outlen,context,1);
+}
+
+void * decompressDataParallel(const void *source,size_t clen,size_t &outlen,unsigned int numThreads)
+{
+  return decompressDataThreads(source,clen,outlen,0,numThreads);
+}
+
+//*** Seekable reads
+
+// A decompressed block for the cache, in malloc'd memory so that one too large to allocate fails the read rather
+// than throwing.
+class BlockData
+{
+public:
+  BlockData(size_t len) : mData((unsigned char *)malloc(len ? len : 1)), mLength(len)
+  {
+  }
+
+  ~BlockData(void)
+  {
+    free(mData);
+  }
+
+  unsigned char * data(void) const { return mData; }
+  size_t          size(void) const { return mLength; }
+
+private:
+  BlockData(const BlockData &);
+  BlockData & operator=(const BlockData &);
+
+  unsigned char  *mData;
+  size_t          mLength;
+};
+
+typedef std::shared_ptr<const BlockData> CachedBlock;
+
+// Decompressed blocks by container and block number.  The cache is split into shards, each with its own lock and
+// least recently used list, so that readers on many threads seldom wait for one another.  The budget is shared by
+// all of them: when the cache is over it, the oldest block at the tail of any shard goes first, so a few large
+// blocks are kept however many shards there are.
+class SeekableCache
+{
+public:
+  SeekableCache(size_t budget,unsigned int shardCount) : mShards(shardCount), mBudget(budget), mBytes(0), mTick(0)
+  {
+  }
+
+  CachedBlock find(unsigned long long container,size_t block)
+  {
+    CachedBlock ret;
+    Key key(container,block);
+    Shard &s = shard(key);
+    std::lock_guard<std::mutex> guard(s.mLock);
+    Map::iterator i = s.mMap.find(key);
+    if ( i != s.mMap.end() )
+    {
+      s.mLRU.splice(s.mLRU.begin(),s.mLRU,i->second);
+      i->second->mTick = ++mTick;
+      ret = i->second->mData;
+      s.mHits++;
+    }
+    else
+    {
+      s.mMisses++;
+    }
+    return ret;
+  }
+
+  // Blocks larger than the whole budget are not kept.  Two readers which miss on the same block at once both
+  // decompress it, and the second copy simply replaces the first.
+  void insert(unsigned long long container,size_t block,const CachedBlock &data)
+  {
+    if ( data->size() <= mBudget )
+    {
+      Key key(container,block);
+      Shard &s = shard(key);
+      {
+        std::lock_guard<std::mutex> guard(s.mLock);
+        mBytes-=s.erase(key);
+        s.mLRU.push_front(Entry(key,data,++mTick));
+        s.mMap[key] = s.mLRU.begin();
+        s.mBytes+=data->size();
+        mBytes+=data->size();
+      }
+      while ( mBytes > mBudget && evictOldest() )
+      {
+      }
+    }
+  }
+
+  void evict(unsigned long long container)
+  {
+    for (size_t i=0; i<mShards.size(); i++)
+    {
+      Shard &s = mShards[i];
+      std::lock_guard<std::mutex> guard(s.mLock);
+      for (List::iterator j=s.mLRU.begin(); j!=s.mLRU.end(); )
+      {
+        List::iterator next = j;
+        ++next;
+        if ( j->mKey.first == container ) mBytes-=s.erase(j->mKey);
+        j = next;
+      }
+    }
+  }
+
+  void getStats(SeekableCacheStats &stats)
+  {
+    memset(&stats,0,sizeof(stats));
+    for (size_t i=0; i<mShards.size(); i++)
+    {
+      Shard &s = mShards[i];
+      std::lock_guard<std::mutex> guard(s.mLock);
+      stats.mHits+=s.mHits;
+      stats.mMisses+=s.mMisses;
+      stats.mEvictions+=s.mEvictions;
+      stats.mBlocks+=s.mMap.size();
+      stats.mBytes+=s.mBytes;
+    }
+    stats.mBudget = mBudget;
+  }
+
+private:
+  typedef std::pair<unsigned long long,size_t> Key;
+
+  struct Entry
+  {
+    Entry(const Key &key,const CachedBlock &data,unsigned long long tick) : mKey(key), mData(data), mTick(tick)
+    {
+    }
+
+    Key                 mKey;
+    CachedBlock         mData;
+    unsigned long long  mTick;     // when it was last used
+  };
+
+  typedef std::list<Entry> List;
+
+  struct KeyHash
+  {
+    size_t operator()(const Key &key) const
+    {
+      unsigned long long h = (key.first*0x9E3779B97F4A7C15ULL) ^ key.second;
+      return (size_t)(h ^ (h >> 29));
+    }
+  };
+
+  typedef std::unordered_map<Key,List::iterator,KeyHash> Map;
+
+  struct Shard
+  {
+    Shard(void) : mBytes(0), mHits(0), mMisses(0), mEvictions(0)
+    {
+    }
+
+    // Returns the bytes released.
+    size_t erase(const Key &key)
+    {
+      size_t ret = 0;
+      Map::iterator i = mMap.find(key);
+      if ( i != mMap.end() )
+      {
+        ret = i->second->mData->size();
+        mBytes-=ret;
+        mLRU.erase(i->second);
+        mMap.erase(i);
+      }
+      return ret;
+    }
+
+    std::mutex          mLock;
+    List                mLRU;       // most recently used first
+    Map                 mMap;
+    size_t              mBytes;
+    unsigned long long  mHits;
+    unsigned long long  mMisses;
+    unsigned long long  mEvictions;
+  };
+
+  Shard & shard(const Key &key)
+  {
+    return mShards[KeyHash()(key) % mShards.size()];
+  }
+
+  // Drops the least recently used block of the whole cache, taking one shard lock at a time.  Returns false if
+  // there was nothing to drop.
+  bool evictOldest(void)
+  {
+    Shard *oldest = 0;
+    unsigned long long tick = 0;
+    for (size_t i=0; i<mShards.size(); i++)
+    {
+      Shard &s = mShards[i];
+      std::lock_guard<std::mutex> guard(s.mLock);
+      if ( !s.mLRU.empty() && (!oldest || s.mLRU.back().mTick < tick) )
+      {
+        oldest = &s;
+        tick = s.mLRU.back().mTick;
+      }
+    }
+    if ( oldest )
+    {
+      std::lock_guard<std::mutex> guard(oldest->mLock);
+      if ( !oldest->mLRU.empty() ) // another thread may have emptied it since
+      {
+        mBytes-=oldest->erase(oldest->mLRU.back().mKey);
+        oldest->mEvictions++;
+      }
+    }
+    return oldest != 0;
+  }
+
+  std::vector<Shard>                mShards;
+  size_t                            mBudget;
+  std::atomic<size_t>               mBytes;     // held by all the shards
+  std::atomic<unsigned long long>   mTick;
+};
+
+// A read only view of a block container, or of an ordinary payload as a container of one block.  Nothing changes
+// after open, so any number of threads may read at once, each with its own context.
+class SeekableReader
+{
+public:
+  SeekableReader(void) : mBase(0), mOffsets(0), mBlockCount(0), mBlockSize(0), mLength(0), mCache(0), mContainer(0)
+  {
+  }
+
+  bool open(const void *container,size_t clen)
+  {
+    bool ret = false;
+
+    // An ordinary payload is checked here, as its length sizes the buffers the reads decompress into.
+    HeaderInfo info;
+    bool verified = false;
+    if ( readHeader(container,clen,info) && checkRawLength(info,(const unsigned char *)container+info.mHeaderSize,clen-info.mHeaderSize,verified) )
+    {
+      mLength = (size_t)info.mRawLength;
+      if ( info.mFlags & HF_BLOCKS )
+      {
+        mBase = (const unsigned char *)container+info.mHeaderSize;
+        mOffsets = readBlockIndex(info,mBase,clen-info.mHeaderSize,mBlockCount,mBlockSize);
+      }
+      else
+      {
+        mBase = (const unsigned char *)container;
+        mSingle[0] = 0;
+        mSingle[1] = clen;
+        mOffsets = mSingle;
+        mBlockCount = 1;
+        mBlockSize = mLength;
+      }
+      ret = mOffsets != 0;
+    }
+
+    return ret;
+  }
+
+  bool openFile(const char *fname)
+  {
+    return mFile.open(fname) && open(mFile.data(),mFile.length());
+  }
+
+  size_t length(void) const { return mLength; }
+
+  void setCache(SeekableCache *cache,unsigned long long container)
+  {
+    mCache = cache;
+    mContainer = container;
+  }
+
+  bool read(size_t offset,void *dest,size_t len,size_t &outlen,CompressionContext *context) const
+  {
+    bool ret = offset <= mLength && (dest || len == 0);
+
+    outlen = 0;
+    if ( ret && len > mLength-offset ) len = mLength-offset;
+
+    CompressionContext *local = context || len == 0 ? 0 : new CompressionContext;
+    if ( !context ) context = local;
+
+    unsigned char *dst = (unsigned char *)dest;
+    size_t end = offset+len;
+    for (size_t pos=offset; pos<end && ret; )
+    {
+      size_t block = pos/mBlockSize;
+      size_t blockStart = block*mBlockSize;
+      size_t blockLen = mLength-blockStart < mBlockSize ? mLength-blockStart : mBlockSize;
+      size_t skip = pos-blockStart;
+      size_t take = blockLen-skip < end-pos ? blockLen-skip : end-pos;
+      if ( mCache )
+      {
+        CachedBlock data = mCache->find(mContainer,block);
+        if ( !data )
+        {
+          CachedBlock fresh(new (std::nothrow) BlockData(blockLen));
+          ret = fresh && fresh->data() && readBlock(block,fresh->data(),blockLen,context);
+          if ( ret ) mCache->insert(mContainer,block,fresh);
+          data = fresh;
+        }
+        if ( ret ) memcpy(dst+(pos-offset),data->data()+skip,take);
+      }
+      else if ( take == blockLen )
+      {
+        ret = readBlock(block,dst+(pos-offset),blockLen,context); // wanted whole, so straight into place
+      }
+      else
+      {
+        unsigned char *buffer = context->getBlockBuffer(blockLen);
+        ret = buffer && readBlock(block,buffer,blockLen,context);
+        if ( ret ) memcpy(dst+(pos-offset),buffer+skip,take);
+      }
+      pos+=take;
+    }
+    delete local;
+
+    if ( ret ) outlen = len;
+
+    return ret;
+  }
+
+private:
+  bool readBlock(size_t block,unsigned char *dest,size_t blockLen,CompressionContext *context) const
+  {
+    const unsigned char *src = mBase+mOffsets[block];
+    size_t slen = (size_t)(mOffsets[block+1]-mOffsets[block]);
+    size_t outlen = 0;
+    return getDecompressedSize(src,slen) == blockLen && decompressInto(src,slen,dest,blockLen,outlen,context) && outlen == blockLen;
+  }
+
+  MappedFile                 mFile;        // openFile only
+  const unsigned char       *mBase;        // what the offsets are relative to
+  const unsigned long long  *mOffsets;     // mBlockCount+1 of them
+  unsigned long long         mSingle[2];   // the offsets of an ordinary payload
+  size_t                     mBlockCount;
+  size_t                     mBlockSize;
+  size_t                     mLength;
+  SeekableCache             *mCache;
+  unsigned long long         mContainer;   // the reader's id within mCache
+};
+
+SeekableReader * openSeekable(const void *container,size_t clen)
+{
+  SeekableReader *ret = new SeekableReader;
+  if ( !ret->open(container,clen) )
+  {
+    delete ret;
+    ret = 0;
+  }
+  return ret;
+}
+
+SeekableReader * openSeekableFile(const char *fname)
+{
+  SeekableReader *ret = new SeekableReader;
+  if ( !ret->openFile(fname) )
+  {
+    delete ret;
+    ret = 0;
+  }
+  return ret;
+}
+
+void closeSeekable(SeekableReader *reader)
+{
+  delete reader;
+}
+
+size_t getSeekableLength(const SeekableReader *reader)
+{
+  return reader ? reader->length() : 0;
+}
+
+bool readAt(const SeekableReader *reader,size_t offset,void *dest,size_t len,size_t &outlen,CompressionContext *context)
+{
+  outlen = 0;
+  return reader && reader->read(offset,dest,len,outlen,context);
+}
+
+const size_t DEFAULT_CACHE_SHARDS=16;
+
+SeekableCache * createSeekableCache(size_t budget,unsigned int shards)
+{
+  return new SeekableCache(budget,shards ? shards : DEFAULT_CACHE_SHARDS);
+}
+
+void releaseSeekableCache(SeekableCache *cache)
+{
+  delete cache;
+}
+
+void setSeekableCache(SeekableReader *reader,SeekableCache *cache,unsigned long long container)
+{
+  if ( reader ) reader->setCache(cache,container);
+}
+
+void evictSeekableCache(SeekableCache *cache,unsigned long long container)
+{
+  if ( cache ) cache->evict(container);
+}
+
+void getSeekableCacheStats(SeekableCache *cache,SeekableCacheStats &stats)
+{
+  memset(&stats,0,sizeof(stats));
+  if ( cache ) cache->getStats(stats);
+}
+
+//*** Parallel deflate
+
+#if USE_ZLIB
+// pigz's defaults: chunks much smaller than the window would lose too much to the sync flushes between them.
+const size_t DEFAULT_DEFLATE_CHUNK=128*1024;
+const size_t DEFLATE_WINDOW=1 << MAX_WBITS;
+
+struct DeflateChunkJob
+{
+  const unsigned char  *mSource;
+  size_t                mLength;
+  size_t                mChunkSize;
+  const DeflateParams  *mParams;       // raw deflate, with no wrapper of its own
+  bool                  mGzip;
+  unsigned char        *mSlots;        // one slot of mSlotSize bytes per chunk
+  size_t                mSlotSize;
+  size_t               *mSizes;
+  uLong                *mChecks;       // the CRC-32 (gzip) or Adler-32 (zlib) of each chunk
+
+  static bool run(void *userData,size_t chunk,CompressionContext *context)
+  {
+    DeflateChunkJob *j = (DeflateChunkJob *)userData;
+    size_t offset = chunk*j->mChunkSize;
+    size_t len = j->mLength-offset < j->mChunkSize ? j->mLength-offset : j->mChunkSize;
+    const Bytef *src = j->mSource+offset;
+    bool last = offset+len == j->mLength;
+
+    j->mChecks[chunk] = j->mGzip ? crc32(crc32(0L,Z_NULL,0),src,(uInt)len) : adler32(adler32(0L,Z_NULL,0),src,(uInt)len);
+
+    z_stream *strm = context->getDeflate(*j->mParams);
+    bool ret = strm != 0;
+    if ( ret && offset )
+    {
+      // The end of the previous chunk, so that matches reach back across the join as they would in one stream.
+      size_t dictLen = offset < DEFLATE_WINDOW ? offset : DEFLATE_WINDOW;
+      ret = deflateSetDictionary(strm,src-dictLen,(uInt)dictLen) == Z_OK;
+    }
+    if ( ret )
+    {
+      // Every chunk but the last ends on a sync flush, an empty stored block which leaves the output byte aligned.
+      strm->next_in   = (Bytef *)src;
+      strm->avail_in  = (uInt)len;
+      strm->next_out  = j->mSlots+chunk*j->mSlotSize;
+      strm->avail_out = (uInt)j->mSlotSize;
+      int err = deflate(strm,last ? Z_FINISH : Z_SYNC_FLUSH);
+      j->mSizes[chunk] = j->mSlotSize-strm->avail_out;
+      ret = last ? err == Z_STREAM_END : err == Z_OK && strm->avail_in == 0 && strm->avail_out != 0;
+    }
+    return ret;
+  }
+};
+
+static void writeLE32(unsigned char *dest,uLong value)
+{
+  for (int i=0; i<4; i++) dest[i] = (unsigned char)(value >> (i*8));
+}
+
+static void writeBE32(unsigned char *dest,uLong value)
+{
+  for (int i=0; i<4; i++) dest[i] = (unsigned char)(value >> (24-i*8));
+}
+
+static uLong readLE32(const unsigned char *src)
+{
+  return (uLong)src[0] | ((uLong)src[1] << 8) | ((uLong)src[2] << 16) | ((uLong)src[3] << 24);
+}
+
+static uLong readBE32(const unsigned char *src)
+{
+  return ((uLong)src[0] << 24) | ((uLong)src[1] << 16) | ((uLong)src[2] << 8) | (uLong)src[3];
+}
+
+static uLong deflateChecksum(bool gzip,const unsigned char *data,size_t len)
+{
+  uLong ret = gzip ? crc32(0L,Z_NULL,0) : adler32(0L,Z_NULL,0);
+  while ( len )
+  {
+    uInt chunk = (uInt)chunkOf(len);
+    ret = gzip ? crc32(ret,data,chunk) : adler32(ret,data,chunk);
+    data+=chunk;
+    len-=chunk;
+  }
+  return ret;
+}
+
+// The length of the gzip member header at 'src' (RFC 1952), or 0 if there is not a complete one.
+static size_t gzipHeaderSize(const unsigned char *src,size_t len)
+{
+  size_t ret = 0;
+
+  if ( len >= 10 && src[0] == 0x1f && src[1] == 0x8b && src[2] == Z_DEFLATED && (src[3] & 0xE0) == 0 )
+  {
+    unsigned int flags = src[3];
+    size_t pos = 10;
+    if ( flags & 4 ) // FEXTRA
+    {
+      pos = len >= 12 ? 12+(src[10] | (src[11] << 8)) : len+1;
+    }
+    for (unsigned int f=8; f<=16; f<<=1) // FNAME then FCOMMENT, each zero terminated
+    {
+      if ( flags & f )
+      {
+        while ( pos < len && src[pos] ) pos++;
+        pos++;
+      }
+    }
+    if ( flags & 2 ) pos+=2; // FHCRC
+    if ( pos <= len ) ret = pos;
+  }
+
+  return ret;
+}
+#endif
+
+void * compressDeflateParallel(const void *source,size_t len,size_t &outlen,DeflateFormat format,unsigned int numThreads,size_t chunkSize,const CompressionOptions *options)
+{
+  void *ret = 0;
+
+  outlen = 0;
+
+#if USE_ZLIB
+  if ( chunkSize == 0 ) chunkSize = DEFAULT_DEFLATE_CHUNK;
+  if ( chunkSize < DEFLATE_WINDOW ) chunkSize = DEFLATE_WINDOW;
+  if ( chunkSize > MAX_STREAM_CHUNK ) chunkSize = MAX_STREAM_CHUNK;
+
+  DeflateParams params(options ? *options : gDefaultOptions);
+  params.mWindowBits = -MAX_WBITS;
+
+  bool gzip = format == DF_GZIP;
+  size_t headerSize = gzip ? 10 : 2;
+  size_t trailerSize = gzip ? 8 : 4;
+  size_t chunkCount = len ? (len+chunkSize-1)/chunkSize : 1; // even empty input needs its final block
+  size_t slotSize = compressBound((uLong)chunkSize)+16;      // room for the sync flush as well
+  size_t maxlen = headerSize+chunkCount*slotSize+trailerSize;
+  std::vector<size_t> sizes(chunkCount);
+  std::vector<uLong> checks(chunkCount);
+  unsigned char *dest = (unsigned char *)malloc(maxlen);
+
+  if ( dest )
+  {
+    DeflateChunkJob job;
+    job.mSource    = (const unsigned char *)source;
+    job.mLength    = len;
+    job.mChunkSize = chunkSize;
+    job.mParams    = &params;
+    job.mGzip      = gzip;
+    job.mSlots     = dest+headerSize;
+    job.mSlotSize  = slotSize;
+    job.mSizes     = &sizes[0];
+    job.mChecks    = &checks[0];
+
+    if ( runBlockJobs(DeflateChunkJob::run,&job,chunkCount,numThreads,0) )
+    {
+      // Close up the gaps between the slots, and fold the checksums of the chunks into that of the whole.
+      uLong check = checks[0];
+      size_t pos = headerSize+sizes[0];
+      for (size_t i=1; i<chunkCount; i++)
+      {
+        size_t chunkLen = i+1 < chunkCount ? chunkSize : len-i*chunkSize;
+        check = gzip ? crc32_combine(check,checks[i],(z_off_t)chunkLen) : adler32_combine(check,checks[i],(z_off_t)chunkLen);
+        memmove(dest+pos,job.mSlots+i*slotSize,sizes[i]);
+        pos+=sizes[i];
+      }
+
+      if ( gzip )
+      {
+        // Written here, as this build of zlib leaves gzip out (NO_GZIP): no name or time, and the OS is unknown.
+        static const unsigned char header[8] = { 0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0 };
+        memcpy(dest,header,sizeof(header));
+        dest[8] = (unsigned char)(params.mLevel == Z_BEST_COMPRESSION ? 2 : params.mLevel == Z_BEST_SPEED ? 4 : 0);
+        dest[9] = 0xFF;
+        writeLE32(dest+pos,check);
+        writeLE32(dest+pos+4,(uLong)len);
+      }
+      else
+      {
+        // The zlib header as deflate itself would write it for this level and a 32K window.
+        unsigned int levelFlags = params.mStrategy >= Z_HUFFMAN_ONLY || params.mLevel < 2 ? 0 : params.mLevel < 6 ? 1 : params.mLevel == 6 ? 2 : 3;
+        unsigned int header = ((Z_DEFLATED+((MAX_WBITS-8) << 4)) << 8) | (levelFlags << 6);
+        header+=31-(header % 31);
+        dest[0] = (unsigned char)(header >> 8);
+        dest[1] = (unsigned char)header;
+        writeBE32(dest+pos,check);
+      }
+      outlen = pos+trailerSize;
+
+      ret = realloc(dest,outlen);
+      if ( !ret ) ret = dest;
+    }
+    else
+    {
+      free(dest);
+    }
+  }
+#endif
+
+  return ret;
+}
+
+void * decompressDeflate(const void *source,size_t clen,size_t &outlen)
+{
+  void *ret = 0;
+
+  outlen = 0;
+
+#if USE_ZLIB
+  const unsigned char *src = (const unsigned char *)source;
+  bool gzip = clen >= 2 && src[0] == 0x1f && src[1] == 0x8b;
+  bool zlib = clen >= 2 && (src[0] & 0x0F) == Z_DEFLATED && (src[0] >> 4) <= MAX_WBITS-8 && !(src[1] & 0x20) && ((src[0] << 8) | src[1]) % 31 == 0;
+  z_stream strm;
+  memset(&strm,0,sizeof(strm));
+
+  if ( (gzip || zlib) && inflateInit2(&strm,-MAX_WBITS) == Z_OK )
+  {
+    // gzip ends with the length of the last member, a good first guess; the buffer grows if it falls short.  The
+    // length is not trusted beyond what deflate can expand to (1032:1), so a damaged trailer cannot claim 4GB.
+    size_t capacity = gzip && clen >= 18 ? (size_t)readLE32(src+clen-4) : clen*4;
+    size_t maxExpansion = clen < (size_t)-1/1032 ? clen*1032 : (size_t)-1;
+    if ( capacity > maxExpansion ) capacity = maxExpansion;
+    if ( capacity < 65536 ) capacity = 65536;
+    unsigned char *dest = (unsigned char *)malloc(capacity);
+    size_t pos = 0;
+    bool ok = dest != 0;
+
+    while ( ok && pos < clen ) // one pass per gzip member; a zlib stream has just the one
+    {
+      size_t headerSize = gzip ? gzipHeaderSize(src+pos,clen-pos) : 2;
+      size_t start = outlen;
+      int err = Z_OK;
+      ok = headerSize && inflateReset(&strm) == Z_OK;
+      pos+=headerSize;
+      while ( ok && err == Z_OK )
+      {
+        if ( outlen == capacity )
+        {
+          unsigned char *grown = (unsigned char *)realloc(dest,capacity*2);
+          ok = grown != 0;
+          if ( ok )
+          {
+            dest = grown;
+            capacity*=2;
+          }
+        }
+        if ( ok )
+        {
+          uInt inChunk  = (uInt)chunkOf(clen-pos);
+          uInt outChunk = (uInt)chunkOf(capacity-outlen);
+          strm.next_in   = (Bytef *)src+pos;
+          strm.avail_in  = inChunk;
+          strm.next_out  = dest+outlen;
+          strm.avail_out = outChunk;
+          err = inflate(&strm,Z_NO_FLUSH);
+          pos+=inChunk-strm.avail_in;
+          outlen+=outChunk-strm.avail_out;
+        }
+      }
+      ok = ok && err == Z_STREAM_END;
+      if ( ok && gzip )
+      {
+        ok = clen-pos >= 8 && readLE32(src+pos) == deflateChecksum(true,dest+start,outlen-start) && readLE32(src+pos+4) == ((outlen-start) & 0xFFFFFFFF);
+        pos+=8;
+      }
+      else if ( ok )
+      {
+        ok = clen-pos == 4 && readBE32(src+pos) == deflateChecksum(false,dest+start,outlen-start);
+        pos+=4;
+      }
+    }
+    inflateEnd(&strm);
+
+    if ( ok )
+    {
+      ret = outlen ? realloc(dest,outlen) : 0;
+      if ( !ret ) ret = dest;
+    }
+    else
+    {
+      free(dest);
+      outlen = 0;
+    }
+  }
+#endif
+
+  return ret;
+}
+
+//*** Parallel bzip2
+
+struct BzipChunkJob
+{
+  const unsigned char  *mSource;
+  size_t                mLength;
+  size_t                mChunkSize;
+  CompressionOptions    mOptions;      // without mThreads, so that each chunk is compressed on its own thread
+  unsigned char        *mSlots;        // one slot of mSlotSize bytes per chunk
+  size_t                mSlotSize;
+  size_t               *mSizes;
+
+  static bool run(void *userData,size_t chunk,CompressionContext *context)
+  {
+    BzipChunkJob *j = (BzipChunkJob *)userData;
+    size_t offset = chunk*j->mChunkSize;
+    size_t len = j->mLength-offset < j->mChunkSize ? j->mLength-offset : j->mChunkSize;
+    return compressBZIP(context,j->mOptions,j->mSource+offset,len,j->mSlots+chunk*j->mSlotSize,j->mSlotSize,j->mSizes[chunk]);
+  }
+};
+
+// Compresses the chunks into slots, returning the concatenated streams' length, or 0 on failure.
+static size_t compressBzipChunks(const CompressionOptions &options,const void *source,size_t len,unsigned int numThreads,std::vector<unsigned char> &slots,std::vector<size_t> &sizes)
+{
+  size_t ret = 0;
+
+  BzipChunkJob job;
+  job.mOptions = options;
+  job.mOptions.mThreads = 0;
+  job.mChunkSize = bzipChunkSize(bzipBlockSize(options));
+
+  size_t chunkCount = len ? (len+job.mChunkSize-1)/job.mChunkSize : 1; // even empty input needs its stream header
+  job.mSlotSize = getMaxCompressedSize(CT_BZIP,job.mChunkSize);
+  slots.resize(chunkCount*job.mSlotSize);
+  sizes.resize(chunkCount);
+
+  job.mSource = (const unsigned char *)source;
+  job.mLength = len;
+  job.mSlots  = &slots[0];
+  job.mSizes  = &sizes[0];
+
+  if ( runBlockJobs(BzipChunkJob::run,&job,chunkCount,numThreads,0) )
+  {
+    // Close up the gaps between the slots, so the streams follow one another.
+    for (size_t i=0; i<chunkCount; i++)
+    {
+      memmove(&slots[ret],&slots[i*job.mSlotSize],sizes[i]);
+      ret+=sizes[i];
+    }
+  }
+
+  return ret;
+}
+
+static bool compressBZIPParallel(const CompressionOptions &options,const void *source,size_t len,void *dest,size_t capacity,size_t &outlen)
+{
+  CompressionOptions chunkOptions(options);
+  if ( chunkOptions.mLevel < 0 ) chunkOptions.mLevel = 9; // pbzip2's default; the smallest blocks would spend more on stream overhead
+
+  std::vector<unsigned char> slots;
+  std::vector<size_t> sizes;
+  size_t clen = compressBzipChunks(chunkOptions,source,len,options.mThreads,slots,sizes);
+  bool ret = clen && clen <= capacity;
+  if ( ret )
+  {
+    memcpy(dest,&slots[0],clen);
+    outlen = clen;
+  }
+  return ret;
+}
+
+// The offset of every stream in a concatenation: "BZh", the block size digit, and then the magic of either a block or
+// (for an empty stream) the end of the stream.  A stream cannot be told apart from the same bytes inside compressed
+// bits, so the parallel decode checks that each piece decodes to the end exactly, and the caller falls back to a
+// serial decode otherwise.
+static void findBzipStreams(const unsigned char *src,size_t len,std::vector<size_t> &starts)
+{
+  static const unsigned char blockMagic[6] = { 0x31, 0x41, 0x59, 0x26, 0x53, 0x59 };
+  static const unsigned char endMagic[6]   = { 0x17, 0x72, 0x45, 0x38, 0x50, 0x90 };
+
+  for (size_t i=0; i+10<=len; i++)
+  {
+    const unsigned char *p = (const unsigned char *)memchr(src+i,'B',len-9-i);
+    if ( !p ) break;
+    i = p-src;
+    if ( p[1] == 'Z' && p[2] == 'h' && p[3] >= '1' && p[3] <= '9' && (memcmp(p+4,blockMagic,6) == 0 || memcmp(p+4,endMagic,6) == 0) )
+    {
+      starts.push_back(i);
+    }
+  }
+}
+
+struct BzipStreamJob
+{
+  const unsigned char                       *mSource;
+  const size_t                              *mStarts;     // one more than there are pieces; the last is the end
+  std::vector< std::vector<unsigned char> > *mOutputs;
+  size_t                                     mSizeHint;
+  size_t                                    *mSizes;
+
+  static bool run(void *userData,size_t piece,CompressionContext *context)
+  {
+    BzipStreamJob *j = (BzipStreamJob *)userData;
+    std::vector<unsigned char> &out = (*j->mOutputs)[piece];
+    out.resize(j->mSizeHint);
+    return decodeBZIP(context,j->mSource+j->mStarts[piece],j->mStarts[piece+1]-j->mStarts[piece],&out,out.empty() ? 0 : &out[0],out.size(),j->mSizes[piece]);
+  }
+};
+
+// Decodes the streams of a concatenation on several threads, each into its own buffer.  False if there are not
+// several streams to share out, or any of them fails.
+static bool decodeBzipStreams(const void *data,size_t slen,size_t sizeHint,unsigned int numThreads,std::vector< std::vector<unsigned char> > &outputs,std::vector<size_t> &sizes)
+{
+  bool ret = false;
+
+  std::vector<size_t> starts;
+  findBzipStreams((const unsigned char *)data,slen,starts);
+  if ( starts.size() > 1 && starts[0] == 0 )
+  {
+    size_t pieces = starts.size();
+    starts.push_back(slen);
+    outputs.resize(pieces);
+    sizes.resize(pieces);
+
+    BzipStreamJob job;
+    job.mSource   = (const unsigned char *)data;
+    job.mStarts   = &starts[0];
+    job.mOutputs  = &outputs;
+    job.mSizeHint = sizeHint/(pieces-1)+1; // all but the last are usually full chunks
+    job.mSizes    = &sizes[0];
+    ret = runBlockJobs(BzipStreamJob::run,&job,pieces,numThreads,0);
+  }
+
+  return ret;
+}
+
+static bool decompressBZIPParallel(const void *data,size_t slen,void *dest,size_t rawLength,unsigned int numThreads)
+{
+  std::vector< std::vector<unsigned char> > outputs;
+  std::vector<size_t> sizes;
+  bool ret = decodeBzipStreams(data,slen,rawLength,numThreads,outputs,sizes);
+  size_t total = 0;
+  for (size_t i=0; i<sizes.size() && ret; i++)
+  {
+    ret = sizes[i] <= rawLength-total;
+    if ( ret && sizes[i] )
+    {
+      memcpy((unsigned char *)dest+total,&outputs[i][0],sizes[i]);
+      total+=sizes[i];
+    }
+  }
+  return ret && total == rawLength;
+}
+
+void * compressBzip2Parallel(const void *source,size_t len,size_t &outlen,unsigned int numThreads,int level)
+{
+  void *ret = 0;
+
+  outlen = 0;
+
+  std::vector<unsigned char> slots;
+  std::vector<size_t> sizes;
+  size_t clen = compressBzipChunks(CompressionOptions(level < 0 ? 9 : level),source,len,numThreads,slots,sizes);
+  if ( clen )
+  {
+    ret = malloc(clen);
+    if ( ret )
+    {
+      memcpy(ret,&slots[0],clen);
+      outlen = clen;
+    }
+  }
+
+  return ret;
+}
+
+void * decompressBzip2(const void *source,size_t clen,size_t &outlen,unsigned int numThreads)
+{
+  void *ret = 0;
+
+  outlen = 0;
+
+  std::vector< std::vector<unsigned char> > outputs;
+  std::vector<size_t> sizes;
+  // Without a length to go on, guess a compression ratio of 4 for the first buffers; they grow as needed.
+  if ( numThreads == 1 || !decodeBzipStreams(source,clen,clen*4,numThreads,outputs,sizes) )
+  {
+    outputs.assign(1,std::vector<unsigned char>(clen*4));
+    sizes.assign(1,0);
+    if ( !decodeBZIP(0,source,clen,&outputs[0],outputs[0].empty() ? 0 : &outputs[0][0],outputs[0].size(),sizes[0]) )
+    {
+      sizes.clear();
+    }
+  }
+
+  if ( !sizes.empty() )
+  {
+    size_t total = 0;
+    for (size_t i=0; i<sizes.size(); i++) total+=sizes[i];
+    unsigned char *dest = (unsigned char *)malloc(total ? total : 1);
+    if ( dest )
+    {
+      for (size_t i=0; i<sizes.size(); i++)
+      {
+        if ( sizes[i] ) memcpy(dest+outlen,&outputs[i][0],sizes[i]);
+        outlen+=sizes[i];
+      }
+      ret = dest;
+    }
+  }
+
+  return ret;
+}
+
+//*** Streaming
+
+struct StreamHeader
+{
+  char            mId[4];           // 'CSTM'
+  char            mCodec[4];        // same id as the CompressionHeader of that codec
+  unsigned int    mVersion;
+  unsigned int    mBlockSize;
+};
+
+// Each piece of the stream body is preceded by one of these.  A zero mRawLength means the bytes are the next part
+// of a continuous codec stream, otherwise they are an independently compressed block of mRawLength bytes.
+// A chunk with both lengths zero ends the body and is followed by the trailer.
+struct StreamChunk
+{
+  unsigned int    mCompressedLength;
+  unsigned int    mRawLength;
+};
+
+struct StreamTrailer
+{
+  unsigned int    mRawLengthLow;
+  unsigned int    mRawLengthHigh;
+  unsigned int    mCRC;             // CRC-32C of the raw data (CRC-32 in version 1 streams), see accumulate()
+  char            mId[4];           // 'CEND'
+};
+
+const unsigned int STREAM_VERSION=2;
+const unsigned int STREAM_VERSION_CRC32=1;   // identical, except that the trailer holds a CRC-32
+const int          STREAM_OUT_SIZE=65536;
+
+size_t getStreamBlockSize(CompressionType type)
+{
+  size_t ret = 0;
+  switch ( type )
+  {
+    case CT_MINILZO:
+    case CT_LIBLZF:
+    case CT_FASTLZ:
+    case CT_STORED:
+      ret = 256*1024;
+      break;
+    case CT_LZMA:
+      ret = 1024*1024;
+      break;
+    default:
+      break;
+  }
+  return ret;
+}
+
+static bool isNativeStream(CompressionType type)
+{
+  return type == CT_ZLIB || type == CT_BZIP || type == CT_MINIZ;
+}
+
+class CompressionStream
+{
+public:
+  enum Flush
+  {
+    SF_RUN,
+    SF_FLUSH,
+    SF_FINISH
+  };
+
+  enum State
+  {
+    SS_HEADER,
+    SS_CHUNK,
+    SS_DATA,
+    SS_TRAILER,
+    SS_DONE,
+    SS_ERROR
+  };
+
+  CompressionStream(bool compress,CompressionType type,StreamOutputFunc output,void *userData,const CompressionOptions &options)
+    : mOptions(options)
+  {
+    mCompress    = compress;
+    mType        = type;
+    mOutput      = output;
+    mUserData    = userData;
+    mCodecInit   = false;
+    mCodecDone   = false;
+    mState       = compress ? SS_DATA : SS_HEADER;
+    mRawLength   = 0;
+    mCRC         = 0;
+    mVersion     = STREAM_VERSION;
+    mBlockSize   = 0;
+    mBlock       = 0;
+    mBlockFill   = 0;
+    mOut         = 0;
+    mOutSize     = 0;
+    mPendingFill = 0;
+    mTdefl       = 0;
+    mDict        = 0;
+    mDictOfs     = 0;
+    memset(&mChunk,0,sizeof(mChunk));
+#if USE_ZLIB
+    memset(&mZlib,0,sizeof(mZlib));
+#endif
+    memset(&mBzip,0,sizeof(mBzip));
+  }
+
+  ~CompressionStream(void)
+  {
+    if ( mCodecInit )
+    {
+      switch ( mType )
+      {
+#if USE_ZLIB
+        case CT_ZLIB:
+          if ( mCompress ) deflateEnd(&mZlib); else inflateEnd(&mZlib);
+          break;
+#endif
+        case CT_BZIP:
+          if ( mCompress ) BZ2_bzCompressEnd(&mBzip); else BZ2_bzDecompressEnd(&mBzip);
+          break;
+        default:
+          break;
+      }
+    }
+    free(mBlock);
+    free(mOut);
+    free(mTdefl);
+    free(mDict);
+  }
+
+  bool begin(void)
+  {
+    bool ret = false;
+
+    if ( mCompress )
+    {
+      StreamHeader h;
+      const char *id = getCompressionId(mType);
+      if ( id && initCodec((int)getStreamBlockSize(mType)) )
+      {
+        memcpy(h.mId,"CSTM",4);
+        memcpy(h.mCodec,id,4);
+        h.mVersion   = STREAM_VERSION;
+        h.mBlockSize = mBlockSize;
+        ret = emit(&h,sizeof(h));
+      }
+    }
+    else
+    {
+      ret = true;
+    }
+
+    if ( !ret )
+    {
+      mState = SS_ERROR;
+    }
+
+    return ret;
+  }
+
+  bool feed(const void *data,size_t len)
+  {
+    if ( len && !data ) mState = SS_ERROR;
+
+    const unsigned char *src = (const unsigned char *)data;
+    while ( len && mState != SS_ERROR )
+    {
+      int chunk = (int)chunkOf(len);
+      if ( mCompress )
+      {
+        mRawLength+=chunk;
+        accumulate(src,chunk);
+        if ( !compressInput(src,chunk,SF_RUN) ) mState = SS_ERROR;
+      }
+      else
+      {
+        if ( !decompressInput(src,chunk) ) mState = SS_ERROR;
+      }
+      src+=chunk;
+      len-=chunk;
+    }
+
+    return mState != SS_ERROR;
+  }
+
+  bool flush(void)
+  {
+    if ( mState == SS_ERROR ) return false;
+
+    if ( mCompress && !compressInput(0,0,SF_FLUSH) )
+    {
+      mState = SS_ERROR;
+    }
+
+    return mState != SS_ERROR;
+  }
+
+  bool end(void)
+  {
+    bool ret = false;
+
+    if ( mCompress )
+    {
+      if ( mState != SS_ERROR && compressInput(0,0,SF_FINISH) )
+      {
+        StreamChunk c;
+        c.mCompressedLength = 0;
+        c.mRawLength        = 0;
+        StreamTrailer t;
+        t.mRawLengthLow  = (unsigned int)(mRawLength&0xFFFFFFFF);
+        t.mRawLengthHigh = (unsigned int)(mRawLength>>32);
+        t.mCRC           = mCRC;
+        memcpy(t.mId,"CEND",4);
+        ret = emit(&c,sizeof(c)) && emit(&t,sizeof(t));
+      }
+    }
+    else
+    {
+      ret = mState == SS_DONE;
+    }
+
+    return ret;
+  }
+
+private:
+
+  bool emit(const void *data,size_t len)
   {
+    return len == 0 || mOutput(data,len,mUserData);
+  }
 
-    const char *data = (const char *) h;
-    data+=sizeof(CompressionHeader);
-    unsigned int slen = clen-sizeof(CompressionHeader);
-    unsigned int crc = ComputeCRC((const unsigned char *)data,slen,h->mRawLength);
-    if ( crc == h->mCRC )
+  bool emitChunk(const void *data,int clen,int rawLength)
+  {
+    bool ret = true;
+    if ( clen )
     {
+      StreamChunk c;
+      c.mCompressedLength = clen;
+      c.mRawLength        = rawLength;
+      ret = emit(&c,sizeof(c)) && emit(data,clen);
+    }
+    return ret;
+  }
+
+  bool initCodec(int blockSize)
+  {
+    bool ret = false;
 
-      outlen = h->mRawLength;
-      char *dest = (char *)malloc(h->mRawLength);
+    if ( isNativeStream(mType) )
+    {
+      mOutSize = STREAM_OUT_SIZE;
+      mOut = (unsigned char *)malloc(mOutSize);
+      if ( mOut )
+      {
+        switch ( mType )
+        {
+#if USE_ZLIB
+          case CT_ZLIB:
+            ret = (mCompress ? DeflateParams(mOptions).init(&mZlib) : inflateInit(&mZlib)) == Z_OK;
+            break;
+#endif
+          case CT_BZIP:
+            ret = (mCompress ? BZ2_bzCompressInit(&mBzip,bzipBlockSize(mOptions),0,30) : BZ2_bzDecompressInit(&mBzip,0,0)) == BZ_OK;
+            break;
+          case CT_MINIZ:
+            if ( mCompress )
+            {
+              mTdefl = (tdefl_compressor *)malloc(sizeof(tdefl_compressor));
+              ret = mTdefl && tdefl_init(mTdefl,NULL,NULL,tdeflFlags(mOptions)) == TDEFL_STATUS_OKAY;
+            }
+            else
+            {
+              mDict = (unsigned char *)malloc(TINFL_LZ_DICT_SIZE);
+              tinfl_init(&mTinfl);
+              ret = mDict != 0;
+            }
+            break;
+          default:
+            break;
+        }
+        mCodecInit = ret;
+      }
+    }
+    else if ( blockSize > 0 && blockSize <= 64*1024*1024 && getMaxCompressedSize(mType,blockSize) )
+    {
+      mBlockSize = blockSize;
+      mOutSize = (int)(getMaxCompressedSize(mType,blockSize)-MAX_HEADER_SIZE);
+      mBlock = (unsigned char *)malloc(mBlockSize);
+      mOut = (unsigned char *)malloc(mOutSize);
+      ret = mBlock && mOut;
+    }
 
-      int err;
+    return ret;
+  }
 
-      unsigned int destLen = outlen;
+  // Compression side
 
-      err = BZ2_bzBuffToBuffDecompress( (char *)dest, &destLen, (char *)data, slen, 0, 0);
+  bool compressBlock(void)
+  {
+    bool ret = true;
+    if ( mBlockFill )
+    {
+      size_t clen = 0;
+      ret = compressPayload(mType,&mContext,mOptions,0,mBlock,mBlockFill,mOut,mOutSize,clen) && emitChunk(mOut,(int)clen,mBlockFill);
+      mBlockFill = 0;
+    }
+    return ret;
+  }
 
-      assert( destLen == outlen );
-      if ( destLen != outlen )
-        err = -1;
+  bool compressInput(const void *data,int len,Flush flush)
+  {
+    bool ret = true;
 
-      if ( err == 0 )
+    if ( !isNativeStream(mType) )
+    {
+      const unsigned char *src = (const unsigned char *)data;
+      while ( len && ret )
       {
-        ret = dest;
+        int copy = mBlockSize-mBlockFill;
+        if ( copy > len ) copy = len;
+        memcpy(&mBlock[mBlockFill],src,copy);
+        mBlockFill+=copy;
+        src+=copy;
+        len-=copy;
+        if ( mBlockFill == mBlockSize ) ret = compressBlock();
       }
-      else
+      if ( ret && flush != SF_RUN ) ret = compressBlock();
+    }
+    else
+    {
+      switch ( mType )
       {
-        free(dest);
-        outlen = 0;
-        ret = 0;
+#if USE_ZLIB
+        case CT_ZLIB:
+          {
+            int mode = flush == SF_RUN ? Z_NO_FLUSH : flush == SF_FLUSH ? Z_SYNC_FLUSH : Z_FINISH;
+            mZlib.next_in  = (Bytef *)data;
+            mZlib.avail_in = len;
+            bool more = true;
+            while ( more && ret )
+            {
+              mZlib.next_out  = mOut;
+              mZlib.avail_out = mOutSize;
+              int err = deflate(&mZlib,mode);
+              int produced = mOutSize-(int)mZlib.avail_out;
+              ret = (err == Z_OK || err == Z_STREAM_END || err == Z_BUF_ERROR) && emitChunk(mOut,produced,0);
+              more = mZlib.avail_in != 0 || mZlib.avail_out == 0 || (mode == Z_FINISH && err != Z_STREAM_END);
+            }
+          }
+          break;
+#endif
+        case CT_BZIP:
+          {
+            int mode = flush == SF_RUN ? BZ_RUN : flush == SF_FLUSH ? BZ_FLUSH : BZ_FINISH;
+            int done = flush == SF_RUN ? BZ_RUN_OK : flush == SF_FLUSH ? BZ_RUN_OK : BZ_STREAM_END;
+            mBzip.next_in  = (char *)data;
+            mBzip.avail_in = len;
+            bool more = true;
+            while ( more && ret )
+            {
+              mBzip.next_out  = (char *)mOut;
+              mBzip.avail_out = mOutSize;
+              int err = BZ2_bzCompress(&mBzip,mode);
+              int produced = mOutSize-(int)mBzip.avail_out;
+              ret = err >= 0 && emitChunk(mOut,produced,0);
+              more = mBzip.avail_in != 0 || err != done;
+            }
+          }
+          break;
+        case CT_MINIZ:
+          {
+            tdefl_flush mode = flush == SF_RUN ? TDEFL_NO_FLUSH : flush == SF_FLUSH ? TDEFL_SYNC_FLUSH : TDEFL_FINISH;
+            const unsigned char *src = (const unsigned char *)data;
+            bool more = true;
+            while ( more && ret )
+            {
+              size_t inSize  = len;
+              size_t outSize = mOutSize;
+              tdefl_status status = tdefl_compress(mTdefl,src,&inSize,mOut,&outSize,mode);
+              src+=inSize;
+              len-=(int)inSize;
+              ret = status >= 0 && emitChunk(mOut,(int)outSize,0);
+              more = len != 0 || outSize == (size_t)mOutSize || (mode == TDEFL_FINISH && status != TDEFL_STATUS_DONE);
+            }
+          }
+          break;
+        default:
+          ret = false;
+          break;
       }
     }
-  }
 
-  return ret;
-}
+    return ret;
+  }
 
-void * decompressLIBLZF(const void *source,int clen,int &outlen)
-{
-  void * ret = 0;
+  // Decompression side
 
-  CompressionHeader *h = (CompressionHeader *) source;
+  // Collects 'size' bytes into mPending across calls; returns true once they are all there.
+  bool gather(const unsigned char *&data,int &len,int size)
+  {
+    int copy = size-mPendingFill;
+    if ( copy > len ) copy = len;
+    memcpy(&mPending[mPendingFill],data,copy);
+    mPendingFill+=copy;
+    data+=copy;
+    len-=copy;
+    bool ret = mPendingFill == size;
+    if ( ret ) mPendingFill = 0;
+    return ret;
+  }
 
-  if ( 1 )
+  void accumulate(const void *data,size_t len)
   {
+    mCRC = mVersion == STREAM_VERSION_CRC32 ? AccumulateCRC(data,len,mCRC) : AccumulateCRC32C(data,len,mCRC);
+  }
 
-    const char *data = (const char *) h;
-    data+=sizeof(CompressionHeader);
-    unsigned int slen = clen-sizeof(CompressionHeader);
-    unsigned int crc = ComputeCRC((const unsigned char *)data,slen,h->mRawLength);
-    if ( crc == h->mCRC )
-    {
+  bool output(const void *data,int len)
+  {
+    mRawLength+=len;
+    accumulate(data,len);
+    return emit(data,len);
+  }
 
-      outlen = h->mRawLength;
-      char *dest = (char *)malloc(h->mRawLength);
+  bool decompressNative(const unsigned char *data,int len)
+  {
+    bool ret = !mCodecDone || len == 0; // nothing may follow the end of the codec stream.
 
-      unsigned int destLen = outlen;
-      outlen = lzf_decompress(data, slen, dest, h->mRawLength);
+    switch ( mType )
+    {
+#if USE_ZLIB
+      case CT_ZLIB:
+        mZlib.next_in  = (Bytef *)data;
+        mZlib.avail_in = len;
+        for (bool more=len!=0; more && ret && !mCodecDone; more=mZlib.avail_in != 0 || mZlib.avail_out == 0)
+        {
+          mZlib.next_out  = mOut;
+          mZlib.avail_out = mOutSize;
+          int err = inflate(&mZlib,Z_NO_FLUSH);
+          ret = (err == Z_OK || err == Z_STREAM_END || err == Z_BUF_ERROR) && output(mOut,mOutSize-(int)mZlib.avail_out);
+          mCodecDone = err == Z_STREAM_END;
+        }
+        ret = ret && mZlib.avail_in == 0;
+        break;
+#endif
+      case CT_BZIP:
+        mBzip.next_in  = (char *)data;
+        mBzip.avail_in = len;
+        for (bool more=len!=0; more && ret && !mCodecDone; more=mBzip.avail_in != 0 || mBzip.avail_out == 0)
+        {
+          mBzip.next_out  = (char *)mOut;
+          mBzip.avail_out = mOutSize;
+          int err = BZ2_bzDecompress(&mBzip);
+          ret = (err == BZ_OK || err == BZ_STREAM_END) && output(mOut,mOutSize-(int)mBzip.avail_out);
+          mCodecDone = err == BZ_STREAM_END;
+        }
+        ret = ret && mBzip.avail_in == 0;
+        break;
+      case CT_MINIZ:
+        for (bool more=len!=0; more && ret && !mCodecDone; )
+        {
+          size_t inSize  = len;
+          size_t outSize = TINFL_LZ_DICT_SIZE-mDictOfs;
+          tinfl_status status = tinfl_decompress(&mTinfl,data,&inSize,mDict,mDict+mDictOfs,&outSize,TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_HAS_MORE_INPUT);
+          data+=inSize;
+          len-=(int)inSize;
+          ret = status >= 0 && output(mDict+mDictOfs,(int)outSize);
+          mDictOfs = (mDictOfs+outSize) & (TINFL_LZ_DICT_SIZE-1);
+          mCodecDone = status == TINFL_STATUS_DONE;
+          more = len != 0 || status == TINFL_STATUS_HAS_MORE_OUTPUT;
+        }
+        ret = ret && len == 0;
+        break;
+      default:
+        ret = false;
+        break;
+    }
 
-      assert( destLen == outlen );
+    return ret;
+  }
 
-	  int err = 0;
-	  if ( destLen != outlen )
-        err = -1;
+  bool decompressInput(const unsigned char *data,int len)
+  {
+    bool ret = true;
 
-      if ( err == 0 )
-      {
-        ret = dest;
-      }
-      else
+    while ( ret && len && mState != SS_DONE )
+    {
+      switch ( mState )
       {
-        free(dest);
-        outlen = 0;
-        ret = 0;
+        case SS_HEADER:
+          if ( gather(data,len,sizeof(StreamHeader)) )
+          {
+            const StreamHeader *h = (const StreamHeader *)mPending;
+            mType = getCompressionTypeFromId(h->mCodec);
+            mVersion = h->mVersion;
+            ret = memcmp(h->mId,"CSTM",4) == 0 && (mVersion == STREAM_VERSION || mVersion == STREAM_VERSION_CRC32) &&
+                  mType != CT_INVALID && initCodec((int)h->mBlockSize);
+            mState = SS_CHUNK;
+          }
+          break;
+        case SS_CHUNK:
+          if ( gather(data,len,sizeof(StreamChunk)) )
+          {
+            memcpy(&mChunk,mPending,sizeof(mChunk));
+            if ( mChunk.mCompressedLength == 0 )
+            {
+              ret = mChunk.mRawLength == 0 && (mCodecDone || !isNativeStream(mType));
+              mState = SS_TRAILER;
+            }
+            else if ( mChunk.mRawLength == 0 )
+            {
+              ret = isNativeStream(mType);
+              mState = SS_DATA;
+            }
+            else
+            {
+              ret = !isNativeStream(mType) && mChunk.mRawLength <= (unsigned int)mBlockSize && mChunk.mCompressedLength <= (unsigned int)mOutSize;
+              mBlockFill = 0;
+              mState = SS_DATA;
+            }
+          }
+          break;
+        case SS_DATA:
+          {
+            int copy = (int)mChunk.mCompressedLength;
+            if ( copy > len ) copy = len;
+            if ( mChunk.mRawLength == 0 )
+            {
+              ret = decompressNative(data,copy);
+            }
+            else
+            {
+              memcpy(&mOut[mBlockFill],data,copy);
+              mBlockFill+=copy;
+            }
+            data+=copy;
+            len-=copy;
+            mChunk.mCompressedLength-=copy;
+            if ( ret && mChunk.mCompressedLength == 0 )
+            {
+              if ( mChunk.mRawLength )
+              {
+                ret = decompressPayload(mType,&mContext,0,mOut,mBlockFill,mBlock,(int)mChunk.mRawLength) && output(mBlock,(int)mChunk.mRawLength);
+                mBlockFill = 0;
+              }
+              mState = SS_CHUNK;
+            }
+          }
+          break;
+        case SS_TRAILER:
+          if ( gather(data,len,sizeof(StreamTrailer)) )
+          {
+            const StreamTrailer *t = (const StreamTrailer *)mPending;
+            unsigned long long rawLength = ((unsigned long long)t->mRawLengthHigh<<32) | t->mRawLengthLow;
+            ret = memcmp(t->mId,"CEND",4) == 0 && rawLength == mRawLength && t->mCRC == mCRC;
+            mState = SS_DONE;
+          }
+          break;
+        default:
+          break;
       }
     }
+
+    // Anything after the trailer is an error.
+    return ret && len == 0;
   }
 
+  bool                 mCompress;
+  CompressionType      mType;
+  CompressionOptions   mOptions;
+  StreamOutputFunc     mOutput;
+  void                *mUserData;
+  State                mState;
+  bool                 mCodecInit;
+  bool                 mCodecDone;
+  unsigned long long   mRawLength;
+  unsigned int         mCRC;
+  unsigned int         mVersion;
+
+  CompressionContext   mContext;      // block codecs
+  int                  mBlockSize;
+  unsigned char       *mBlock;        // raw data of the current block
+  int                  mBlockFill;
+  unsigned char       *mOut;          // compressed block, or output buffer of the native codecs
+  int                  mOutSize;
+
+  StreamChunk          mChunk;
+  unsigned char        mPending[sizeof(StreamHeader)]; // header, chunk or trailer being collected
+  int                  mPendingFill;
+
+#if USE_ZLIB
+  z_stream             mZlib;
+#endif
+  bz_stream            mBzip;
+  tdefl_compressor    *mTdefl;
+  tinfl_decompressor   mTinfl;
+  unsigned char       *mDict;
+  size_t               mDictOfs;
+};
+
+CompressionStream * beginCompressStream(CompressionType type,StreamOutputFunc output,void *userData,const CompressionOptions *options)
+{
+  CompressionStream *ret = 0;
+  if ( output )
+  {
+    ret = new CompressionStream(true,type,output,userData,options ? *options : gDefaultOptions);
+    if ( !ret->begin() )
+    {
+      delete ret;
+      ret = 0;
+    }
+  }
   return ret;
 }
 
-void * decompressLZMA(const void *source,int clen,int &outlen)
+CompressionStream * beginDecompressStream(StreamOutputFunc output,void *userData)
 {
-  void * ret = 0;
+  CompressionStream *ret = 0;
+  if ( output )
+  {
+    ret = new CompressionStream(false,CT_INVALID,output,userData,gDefaultOptions);
+    ret->begin();
+  }
+  return ret;
+}
 
-  CompressionHeader *h = (CompressionHeader *) source;
+bool feedStream(CompressionStream *stream,const void *data,size_t len)
+{
+  return stream && stream->feed(data,len);
+}
+
+bool flushStream(CompressionStream *stream)
+{
+  return stream && stream->flush();
+}
 
-  if ( 1 )
+bool endStream(CompressionStream *stream)
+{
+  bool ret = false;
+  if ( stream )
   {
+    ret = stream->end();
+    delete stream;
+  }
+  return ret;
+}
 
-    const char *data = (const char *) h;
-    data+=sizeof(CompressionHeader);
-    unsigned int slen = clen-sizeof(CompressionHeader);
-    unsigned int crc = ComputeCRC((const unsigned char *)data,slen,h->mRawLength);
-    if ( crc == h->mCRC )
-    {
+//*** Streaming LZMA reads
+
+// Compressed bytes are pulled from the input callback in pieces of up to this size.
+const size_t LZMA_READ_INPUT_SIZE=64*1024;
+
+// Decodes an LZMA payload as it arrives, through a ring buffer of the dictionary size: each read hands out what the
+// last DecodeToDic call left in the ring, and only once all of that has gone does the decoder overwrite it.
+class LzmaReader
+{
+public:
+  LzmaReader(StreamInputFunc input,void *userData) : mInput(input), mUserData(userData), mRemaining(0), mLeft(0),
+    mCRC(0), mInPos(0), mInFill(0), mRing(0), mRingSize(0), mRingPos(0), mFinished(false), mFailed(false)
+  {
+    memset(&mInfo,0,sizeof(mInfo));
+    LzmaDec_Construct(&mDecoder);
+  }
 
-      outlen = h->mRawLength;
-      char *dest = (char *)malloc(h->mRawLength);
+  ~LzmaReader(void)
+  {
+    LzmaDec_FreeProbs(&mDecoder,&alloc);
+    free(mRing);
+  }
 
-      unsigned int destLen = outlen;
+  // Reads the header and sets the decoder up for the payload behind it.
+  bool open(void)
+  {
+    bool ret = false;
+    unsigned char header[MAX_HEADER_SIZE];
+    size_t hsize = sizeof(CompressionHeaderV1);
+    unsigned long long clen = 0;
 
-      ELzmaStatus status;
-      slen -= LZMA_PROPS_SIZE;
-      SRes err = LzmaDecode((Byte*)dest, (SizeT*)&destLen, (const Byte*)data + LZMA_PROPS_SIZE, (SizeT*)&slen, (const Byte*)data, LZMA_PROPS_SIZE, LZMA_FINISH_END, &status, &alloc);
+    if ( pull(header,hsize) )
+    {
+      const CompressionHeaderV1 *h1 = (const CompressionHeaderV1 *) header;
+      if ( h1->mRawLength != HEADER_MARKER )
+      {
+        clen = h1->mCompressedLength > 0 ? (unsigned long long)h1->mCompressedLength : 0;
+        ret = true;
+      }
+      else if ( pull(header+hsize,sizeof(CompressionHeader)-hsize) )
+      {
+        // only the header itself is read here; readHeader below checks the rest of it
+        const CompressionHeader *h = (const CompressionHeader *) header;
+        hsize = headerSize((h->mFlags & HF_CHECKSUM_MASK) >> HF_CHECKSUM_SHIFT,h->mFlags & HF_DICTIONARY);
+        clen = h->mCompressedLength;
+        ret = pull(header+sizeof(CompressionHeader),hsize-sizeof(CompressionHeader));
+      }
+    }
+    ret = ret && clen >= hsize && clen == (size_t)clen && readHeader(header,(size_t)clen,mInfo) && mInfo.mHeaderSize == hsize &&
+          !(mInfo.mFlags & HF_BLOCKS) && (mInfo.mType == CT_LZMA || mInfo.mType == CT_STORED);
 
-      assert( destLen == outlen );
+    if ( ret )
+    {
+      unsigned int seed = LengthSeed(mInfo.mRawLength);
+      mRemaining = (size_t)clen-hsize;
+      mLeft = mInfo.mRawLength;
+      mCRC = seed^(unsigned int)mRemaining;
+      if ( checksumKind(mInfo) == CK_CRC32C ) mCRC = ~mCRC;
 
-      if ( err == SZ_OK && destLen == outlen )
+      if ( mInfo.mType == CT_STORED )
       {
-        ret = dest;
+        ret = mRemaining == mLeft;
       }
       else
       {
-        free(dest);
-        outlen = 0;
-        ret = 0;
+        unsigned char props[LZMA_PROPS_SIZE];
+        ret = mRemaining >= LZMA_PROPS_SIZE && pull(props,LZMA_PROPS_SIZE);
+        if ( ret )
+        {
+          checksum(props,LZMA_PROPS_SIZE);
+          mRemaining-=LZMA_PROPS_SIZE;
+          ret = LzmaDec_AllocateProbs(&mDecoder,props,LZMA_PROPS_SIZE,&alloc) == SZ_OK;
+        }
+        if ( ret )
+        {
+          DictionaryRef dictionary;
+          if ( mInfo.mDictionary ) dictionary = findDictionary(mInfo.mDictionary);
+          size_t dictLen = dictionary ? dictionary->mLength : 0;
+          // The encoder's dictionary size covers the preset dictionary too, and a ring larger than the data is wasted.
+          mRingSize = (size_t)std::min((unsigned long long)mDecoder.prop.dicSize,dictLen+mLeft);
+          mRingSize = std::max(mRingSize,std::max(dictLen,(size_t)1));
+          mRing = (Byte *)malloc(mRingSize);
+          ret = mRing && (dictionary || !mInfo.mDictionary);
+          if ( ret )
+          {
+            mDecoder.dic = mRing;
+            mDecoder.dicBufSize = mRingSize;
+            if ( dictLen )
+            {
+              memcpy(mRing,dictionary->mData,dictLen);
+              LzmaDec_InitWithDic(&mDecoder,dictLen);
+            }
+            else
+            {
+              LzmaDec_Init(&mDecoder);
+            }
+            mRingPos = mDecoder.dicPos;
+          }
+        }
       }
     }
+
+    return ret;
   }
 
-  return ret;
-}
+  bool read(void *dest,size_t len,size_t &outlen)
+  {
+    unsigned char *out = (unsigned char *)dest;
 
-void * decompressFASTLZ(const void *source,int clen,int &outlen)
-{
-  void * ret = 0;
+    outlen = 0;
+    while ( !mFailed && mLeft && outlen < len )
+    {
+      const unsigned char *data = 0;
+      size_t n = 0;
+      if ( mInfo.mType == CT_STORED )
+      {
+        if ( mInPos < mInFill || refill() )
+        {
+          data = mIn+mInPos;
+          n = std::min(len-outlen,mInFill-mInPos);
+          mInPos+=n;
+        }
+      }
+      else if ( mRingPos < mDecoder.dicPos || decode() )
+      {
+        data = mRing+mRingPos;
+        n = std::min(len-outlen,(size_t)mDecoder.dicPos-mRingPos);
+        mRingPos+=n;
+      }
+      if ( n )
+      {
+        memcpy(out+outlen,data,n);
+        if ( checksumKind(mInfo) == CK_HASH64 ) mHash.add(data,n);
+        outlen+=n;
+        mLeft-=n;
+      }
+      else
+      {
+        mFailed = true;
+      }
+    }
+    if ( !mFailed && !mLeft && !mFinished )
+    {
+      mFinished = true;
+      mFailed = !finish();
+    }
+
+    return !mFailed;
+  }
 
-  CompressionHeader *h = (CompressionHeader *) source;
+  unsigned long long getLength(void) const
+  {
+    return mInfo.mRawLength;
+  }
+
+private:
+  // Reads exactly 'len' bytes of header.
+  bool pull(void *dest,size_t len)
+  {
+    unsigned char *p = (unsigned char *)dest;
+    size_t n = 1;
+    while ( len && n )
+    {
+      n = mInput(p,len,mUserData);
+      n = std::min(n,len);
+      p+=n;
+      len-=n;
+    }
+    return len == 0;
+  }
 
-  if ( 1 )
+  // Reads the next piece of the payload once the last is used up, never reading past its end.
+  bool refill(void)
   {
+    size_t want = std::min(sizeof(mIn),mRemaining);
+    size_t got = want ? std::min(mInput(mIn,want,mUserData),want) : 0;
+    checksum(mIn,got);
+    mRemaining-=got;
+    mInPos = 0;
+    mInFill = got;
+    return got != 0;
+  }
 
-    const char *data = (const char *) h;
-    data+=sizeof(CompressionHeader);
-    unsigned int slen = clen-sizeof(CompressionHeader);
-    unsigned int crc = ComputeCRC((const unsigned char *)data,slen,h->mRawLength);
-    if ( crc == h->mCRC )
+  void checksum(const void *data,size_t len)
+  {
+    switch ( checksumKind(mInfo) )
     {
+      case CK_CRC32:
+        mCRC = AccumulateCRC(data,len,mCRC);
+        break;
+      case CK_CRC32C:
+        mCRC = AccumulateCRC32C(data,len,mCRC);
+        break;
+    }
+  }
 
-      outlen = h->mRawLength;
-      char *dest = (char *)malloc(h->mRawLength);
+  // Decodes the next piece of the data into the ring, once everything decoded before has been read.
+  bool decode(void)
+  {
+    bool ret = true;
 
-      unsigned int destLen = outlen;
-      outlen = fastlz_decompress(data, slen, dest, h->mRawLength);
+    if ( mDecoder.dicPos == mRingSize )
+    {
+      mDecoder.dicPos = 0;
+      mRingPos = 0;
+    }
+    SizeT start = mDecoder.dicPos;
+    SizeT limit = start+(SizeT)std::min((unsigned long long)(mRingSize-start),mLeft);
+    while ( ret && mDecoder.dicPos == start ) // a few bytes of input may not complete a symbol
+    {
+      ret = mInPos < mInFill || refill();
+      if ( ret )
+      {
+        SizeT srcLen = mInFill-mInPos;
+        ELzmaStatus status;
+        SRes err = LzmaDec_DecodeToDic(&mDecoder,limit,mIn+mInPos,&srcLen,LZMA_FINISH_ANY,&status);
+        mInPos+=srcLen;
+        // an end mark before all the data is there means the payload is damaged
+        ret = err == SZ_OK && (srcLen || mDecoder.dicPos > start) && (status != LZMA_STATUS_FINISHED_WITH_MARK || mDecoder.dicPos == limit);
+      }
+    }
 
-      assert( destLen == outlen );
+    return ret;
+  }
 
-	  int err = 0;
-	  if ( destLen != outlen )
-        err = -1;
+  // Once all the data is read, the end mark must follow it, and the checksum must match.
+  bool finish(void)
+  {
+    bool ret = true;
 
-      if ( err == 0 )
+    if ( mInfo.mType == CT_LZMA )
+    {
+      ELzmaStatus status = LZMA_STATUS_NEEDS_MORE_INPUT;
+      while ( ret && status == LZMA_STATUS_NEEDS_MORE_INPUT )
       {
-        ret = dest;
+        ret = mInPos < mInFill || refill();
+        if ( ret )
+        {
+          SizeT srcLen = mInFill-mInPos;
+          ret = LzmaDec_DecodeToDic(&mDecoder,mDecoder.dicPos,mIn+mInPos,&srcLen,LZMA_FINISH_END,&status) == SZ_OK;
+          mInPos+=srcLen;
+        }
       }
-      else
+    }
+    // the checksum covers the whole payload, including anything after the end mark
+    while ( ret && mRemaining )
+    {
+      ret = refill();
+    }
+
+    if ( ret )
+    {
+      switch ( checksumKind(mInfo) )
       {
-        free(dest);
-        outlen = 0;
-        ret = 0;
+        case CK_CRC32:
+          ret = (mCRC&0x7FFFFFFF) == mInfo.mCRC;
+          break;
+        case CK_CRC32C:
+          ret = ~mCRC == mInfo.mCRC;
+          break;
+        case CK_HASH64:
+          ret = mHash.finish() == mInfo.mHash;
+          break;
       }
     }
+
+    return ret;
   }
 
+  StreamInputFunc     mInput;
+  void               *mUserData;
+  HeaderInfo          mInfo;
+  size_t              mRemaining;   // payload bytes not yet pulled from the input
+  unsigned long long  mLeft;        // raw bytes not yet read
+  unsigned int        mCRC;
+  Hash64Stream        mHash;
+  unsigned char       mIn[LZMA_READ_INPUT_SIZE];
+  size_t              mInPos;
+  size_t              mInFill;
+  CLzmaDec            mDecoder;
+  Byte               *mRing;
+  size_t              mRingSize;
+  size_t              mRingPos;     // the next byte of the ring to read; the decoder has filled it up to dicPos
+  bool                mFinished;
+  bool                mFailed;
+};
+
+LzmaReader * openLzmaReader(StreamInputFunc input,void *userData)
+{
+  LzmaReader *ret = 0;
+  if ( input )
+  {
+    ret = new LzmaReader(input,userData);
+    if ( !ret->open() )
+    {
+      delete ret;
+      ret = 0;
+    }
+  }
   return ret;
 }
 
-void * decompressMINIZ(const void *source,int clen,int &outlen)
+bool readLzma(LzmaReader *reader,void *dest,size_t len,size_t &outlen)
 {
-    void * ret = 0;
-
-    CompressionHeader *h = (CompressionHeader *) source;
+  outlen = 0;
+  return reader && reader->read(dest,len,outlen);
+}
 
-    if ( 1 )
-    {
+unsigned long long getLzmaReaderLength(const LzmaReader *reader)
+{
+  return reader ? reader->getLength() : 0;
+}
 
-        const char *data = (const char *) h;
-        data+=sizeof(CompressionHeader);
-        unsigned int slen = clen-sizeof(CompressionHeader);
-        unsigned int crc = ComputeCRC((const unsigned char *)data,slen,h->mRawLength);
-        if ( crc == h->mCRC )
-        {
+void closeLzmaReader(LzmaReader *reader)
+{
+  delete reader;
+}
 
-            outlen = h->mRawLength;
-            char *dest = (char *)malloc(h->mRawLength);
+//*** Files
 
-            uLongf destLen = outlen;
-            int result = uncompress((Bytef *)dest, &destLen, (const Bytef *)data, slen);
+// Files are fed to the streams in pieces of this size, and written through a buffer of the same size.
+const size_t FILE_PIECE_SIZE=1024*1024;
 
-            assert( destLen == outlen );
+static bool writeToFile(const void *data,size_t len,void *userData)
+{
+  return fwrite(data,1,len,(FILE *)userData) == len;
+}
 
-            int err = 0;
-            if ( destLen != outlen )
-                err = -1;
+// Empty files cannot be mapped, but are still valid input.
+static bool isEmptyFile(const char *fname)
+{
+  FILE *fph = fopen(fname,"rb");
+  bool ret = fph && fgetc(fph) == EOF && !ferror(fph);
+  if ( fph ) fclose(fph);
+  return ret;
+}
 
-            if ( err == 0 )
-            {
-                ret = dest;
-            }
-            else
-            {
-                free(dest);
-                outlen = 0;
-                ret = 0;
-            }
-        }
-    }
+// True if both names exist and are the same file, through links or differently spelled paths.
+static bool isSameFile(const char *name1,const char *name2)
+{
+  bool ret = false;
+#ifdef _WIN32
+  HANDLE f1 = CreateFileA(name1,0,FILE_SHARE_READ|FILE_SHARE_WRITE|FILE_SHARE_DELETE,0,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,0);
+  HANDLE f2 = CreateFileA(name2,0,FILE_SHARE_READ|FILE_SHARE_WRITE|FILE_SHARE_DELETE,0,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,0);
+  BY_HANDLE_FILE_INFORMATION i1;
+  BY_HANDLE_FILE_INFORMATION i2;
+  if ( f1 != INVALID_HANDLE_VALUE && f2 != INVALID_HANDLE_VALUE && GetFileInformationByHandle(f1,&i1) && GetFileInformationByHandle(f2,&i2) )
+  {
+    ret = i1.dwVolumeSerialNumber == i2.dwVolumeSerialNumber && i1.nFileIndexHigh == i2.nFileIndexHigh && i1.nFileIndexLow == i2.nFileIndexLow;
+  }
+  if ( f1 != INVALID_HANDLE_VALUE ) CloseHandle(f1);
+  if ( f2 != INVALID_HANDLE_VALUE ) CloseHandle(f2);
+#else
+  struct stat s1;
+  struct stat s2;
+  ret = stat(name1,&s1) == 0 && stat(name2,&s2) == 0 && s1.st_dev == s2.st_dev && s1.st_ino == s2.st_ino;
+#endif
+  return ret;
+}
 
-    return ret;
+// Hints that the output is written once, from front to back.
+static void adviseSequentialWrites(FILE *fph)
+{
+#if !defined(_WIN32) && defined(POSIX_FADV_SEQUENTIAL)
+  posix_fadvise(fileno(fph),0,0,POSIX_FADV_SEQUENTIAL);
+#else
+  (void)fph;
+#endif
 }
 
-void * decompressData(const void *source,int clen,int &outlen)
+// Moves the finished output over the destination, replacing any file already there.
+static bool replaceFile(const char *tempName,const char *destName)
 {
-  void * ret = 0;
+#ifdef _WIN32
+  return MoveFileExA(tempName,destName,MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+  return rename(tempName,destName) == 0;
+#endif
+}
 
-  outlen = 0;
+static bool streamFile(bool compress,const char *sourceName,const char *destName,CompressionType type,const CompressionOptions *options)
+{
+  bool ret = false;
 
-  switch ( getCompressionType(source,clen) )
+  // The output goes to a temporary file beside the destination, which replaces it only once it is complete, so a
+  // failure leaves the destination as it was.  Writing over the input itself would destroy it as it is read.
+  std::string tempName = std::string(destName)+".tmp";
+  MappedFile input;
+  if ( !isSameFile(sourceName,destName) && !isSameFile(sourceName,tempName.c_str()) && (input.open(sourceName) || isEmptyFile(sourceName)) )
   {
-#if USE_CRYPTO
-    case CT_CRYPTO_GZIP:
-      ret = decompressCRYPTO_GZIP(source,clen,outlen);
-      break;
-#endif
-    case CT_MINILZO:
-      ret = decompressMiniLZO(source,clen,outlen);
-      break;
-    case CT_ZLIB:
-#if USE_ZLIB
-      ret = decompressZLIB(source,clen,outlen);
-#endif
-      break;
-    case CT_BZIP:
-      ret = decompressBZIP(source,clen,outlen);
-      break;
-    case CT_LIBLZF:
-      ret = decompressLIBLZF(source,clen,outlen);
-      break;
-    case CT_LZMA:
-      ret = decompressLZMA(source,clen,outlen);
-      break;
-    case CT_FASTLZ:
-      ret = decompressFASTLZ(source,clen,outlen);
-      break;
-    case CT_MINIZ:
-      ret = decompressMINIZ(source,clen,outlen);
-      break;
+    FILE *fph = fopen(tempName.c_str(),"wb");
+    if ( fph )
+    {
+      setvbuf(fph,0,_IOFBF,FILE_PIECE_SIZE);
+      adviseSequentialWrites(fph);
+      CompressionOptions resolved;
+      if ( compress )
+      {
+        type = resolveAuto(type,input.data(),input.length(),0,options,resolved); // the streams need a concrete codec; this only samples the file
+      }
+      CompressionStream *stream = compress ? beginCompressStream(type,writeToFile,fph,options) : beginDecompressStream(writeToFile,fph);
+      ret = stream != 0;
+      input.adviseSequential();
+      for (size_t pos=0; pos<input.length() && ret; pos+=FILE_PIECE_SIZE)
+      {
+        size_t len = input.length()-pos < FILE_PIECE_SIZE ? input.length()-pos : FILE_PIECE_SIZE;
+        ret = feedStream(stream,input.data()+pos,len);
+        input.release(pos+len); // what has been fed is not needed again, so the resident size stays bounded
+      }
+      ret = endStream(stream) && ret;
+      ret = fclose(fph) == 0 && ret;
+      ret = ret && replaceFile(tempName.c_str(),destName);
+      if ( !ret ) remove(tempName.c_str());
+    }
   }
 
   return ret;
 }
 
-CompressionType getCompressionType(const void *mem,int len)
+bool compressFile(const char *sourceName,const char *destName,CompressionType type,const CompressionOptions *options)
+{
+  return streamFile(true,sourceName,destName,type,options);
+}
+
+bool decompressFile(const char *sourceName,const char *destName)
+{
+  return streamFile(false,sourceName,destName,CT_INVALID,0);
+}
+
+CompressionType getCompressionType(const void *mem,size_t len)
 {
   CompressionType ret = CT_INVALID;
 
-  if ( mem && len > sizeof(CompressionHeader) )
+  HeaderInfo info;
+  if ( readHeader(mem,len,info) )
   {
-    CompressionHeader *h = (CompressionHeader *) mem;
-    if ( h->mCompressedLength == len )
-    {
-      if ( h->mId[0] == 'M' && h->mId[1] == 'L' && h->mId[2] == 'Z' && h->mId[3] == 'O' )
-        ret = CT_MINILZO;
-      else if ( h->mId[0] == 'C' && h->mId[1] == 'R' && h->mId[2] == 'P' && h->mId[3] == 'T' )
-        ret = CT_CRYPTO_GZIP;
-      else if ( h->mId[0] == 'Z' && h->mId[1] == 'L' && h->mId[2] == 'I' && h->mId[3] == 'B' )
-        ret = CT_ZLIB;
-      else if ( h->mId[0] == 'B' && h->mId[1] == 'Z' && h->mId[2] == 'I' && h->mId[3] == 'P' )
-        ret = CT_BZIP;
-      else if ( h->mId[0] == 'L' && h->mId[1] == 'L' && h->mId[2] == 'Z' && h->mId[3] == 'F' )
-        ret = CT_LIBLZF;
-      else if ( h->mId[0] == 'L' && h->mId[1] == 'Z' && h->mId[2] == 'M' && h->mId[3] == 'A' )
-        ret = CT_LZMA;
-      else if ( h->mId[0] == 'F' && h->mId[1] == 'A' && h->mId[2] == 'S' && h->mId[3] == 'T' )
-        ret = CT_FASTLZ;
-      else if ( h->mId[0] == 'M' && h->mId[1] == 'I' && h->mId[2] == 'N' && h->mId[3] == 'I' )
-        ret = CT_MINIZ;
-    }
+    ret = info.mType;
   }
 
   return ret;
@@ -851,8 +4758,10 @@ const char      *getCompressionTypeString(CompressionType type)
     case CT_LZMA: ret = "CT_LZMA"; break;
     case CT_FASTLZ: ret = "CT_FASTLZ"; break;
     case CT_MINIZ: ret = "CT_MINIZ"; break;
+    case CT_STORED: ret = "CT_STORED"; break;
+    case CT_AUTO: ret = "CT_AUTO"; break;
   }
   return ret;
 }
 
-}; // end of namespace
\ No newline at end of file
+}; // end of namespace
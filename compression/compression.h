@@ -6,6 +6,8 @@
 #define USE_CRYPTO 0   // The source to the CyrptoPP library is not included in this download as it is too large.  If you have access to the source,add it to your include path and set this #define to 1
 #define USE_ZLIB 1
 
+#include <stddef.h>
+
 #define MINIZ_NO_STDIO
 #define MINIZ_NO_ARCHIVE_APIS
 #define MINIZ_NO_ZLIB_APIS
@@ -24,14 +26,243 @@ enum CompressionType
   CT_LIBLZF,            // The LIBLZF library  http://oldhome.schmorp.de/marc/liblzf.html
   CT_LZMA,              // The LZMA library http://www.7-zip.org/sdk.html
   CT_FASTLZ,            // The FastLZ library  http://www.fastlz.org/
-  CT_MINIZ              // The miniz library  https://code.google.com/p/miniz/
+  CT_MINIZ,             // The miniz library  https://code.google.com/p/miniz/
+  CT_STORED,            // No compression; the data is copied after the header.  Used in place of any codec for data which will not compress.
+  CT_AUTO               // Picks one of the above for each input, see chooseCompressionType.  Not available for streams.
+};
+
+// What CT_AUTO aims for.  The choice of codec and level is made by trial compressing a few small samples of the input
+// with the fast codecs (LZF, miniLZO, and FastLZ and miniz at level 1), and with zlib at levels 1 and 6 and LZMA at
+// level 1 as well when the fast ones cannot meet the target.
+enum AutoGoal
+{
+  AG_THROUGHPUT,        // the fastest codec which shrinks the data at all
+  AG_RATIO,             // the fastest codec reaching mMinRatio, or the best compressing one if none does
+  AG_LATENCY            // the best compressing codec expected to finish within mLatencyBudget, or the fastest if none can
+};
+
+struct AutoTarget
+{
+  AutoTarget(AutoGoal goal=AG_THROUGHPUT,double minRatio=2.0,double latencyBudget=0.001) : mGoal(goal), mMinRatio(minRatio), mLatencyBudget(latencyBudget) { }
+
+  AutoGoal  mGoal;
+  double    mMinRatio;          // uncompressed size / compressed size
+  double    mLatencyBudget;     // seconds to compress the whole input
+};
+
+// How compressed data is protected; the choice is recorded in the header and checked on decompression.
+enum ChecksumType
+{
+  CS_CRC,               // a CRC of the compressed bytes (the default)
+  CS_HASH64,            // a 64-bit hash of the uncompressed data, which also verifies the codec's output end to end
+  CS_NONE               // no checksum, for trusted in-memory data where the extra pass is not worth it
+};
+
+// The deflate strategies, used by zlib and miniz; the other codecs ignore them.
+enum CompressionStrategy
+{
+  SG_DEFAULT,
+  SG_FILTERED,          // for data of small, noisy values; favours Huffman coding over short matches
+  SG_HUFFMAN_ONLY,      // no string matching at all
+  SG_RLE,               // matches only against the previous byte
+  SG_FIXED              // the fixed Huffman tables only
+};
+
+// Tuned LZMA encoder settings, which choose the match finder, hash bytes, fast bytes (fb), match finder cycles (mc),
+// dictionary size and literal context (lc/lp/pb) together rather than through the level; see readme.txt for how
+// they compare.  The other codecs ignore them.
+enum LzmaPreset
+{
+  LP_DEFAULT,           // set by mLevel
+  LP_ULTRA_FAST,        // fast parsing on the Hc4 hash chains, searching 3 deep in a 128KB dictionary
+  LP_FAST,              // fast parsing on Hc4, 8 deep in a 256KB dictionary
+  LP_BALANCED,          // optimal parsing on Hc4, 8 deep in a 4MB dictionary
+  LP_MAX                // optimal parsing on the Bt4 binary trees, 64 deep in a 64MB dictionary, on two threads
+};
+
+// Per call codec tuning.  Anything left at its default keeps the codec's built-in setting, which is what calls
+// without options use.
+//   mLevel       zlib 0-9 (default 1), bzip 1-9 as the block size in 100k (default 1), LZMA 0-9 (default 1),
+//                FastLZ 1-2 (default picks by input size), miniz 0-10 (default 6).  LZF and miniLZO have no levels.
+//   mWindowBits  log2 of the window: zlib 9-15 (default 15), LZMA's dictionary 12-27 (default set by the level).
+//   mThreads     LZMA encoder threads, 1 or 2 (default 2 at levels 5-9, which run the match finder on its own thread).
+//                bzip above 1 compresses a block per thread, as concatenated bzip2 streams, at level 9 unless set.
+//   mDictionary  the id of a registered preset dictionary (see registerDictionary), or 0 for none.
+//   mLzmaPreset  replaces LZMA's level when set; mWindowBits and mThreads still apply on top of it.
+//   mAutoTarget  what CT_AUTO aims for (default AG_THROUGHPUT); the level it picks replaces mLevel.
+struct CompressionOptions
+{
+  CompressionOptions(int level=-1) : mLevel(level), mWindowBits(0), mStrategy(SG_DEFAULT), mThreads(0), mDictionary(0), mLzmaPreset(LP_DEFAULT) { }
+
+  int                   mLevel;
+  int                   mWindowBits;
+  CompressionStrategy   mStrategy;
+  unsigned int          mThreads;
+  unsigned int          mDictionary;
+  LzmaPreset            mLzmaPreset;
+  AutoTarget            mAutoTarget;
 };
 
-void *           compressData(const void *source,int len,int &outlen,CompressionType type=CT_ZLIB);
-void *           decompressData(const void *source,int clen,int &outlen);
+// The levels mLevel accepts for a codec; false if it has none.
+bool             getCompressionLevelRange(CompressionType type,int &minLevel,int &maxLevel);
+const char      *getLzmaPresetString(LzmaPreset preset);
+
+// Holds the initialized state of every codec (deflate/inflate streams, the LZMA encoder and match finder,
+// the LZF hash table, the miniz compressor, the LZO work memory and the bzip2 block buffers) so that it
+// is set up once rather than on every call.  A context may be passed to any of the calls below; it is
+// not thread safe, so keep one per thread.  Passing no context uses per call state as before.
+class CompressionContext;
+
+CompressionContext * createCompressionContext(void);
+void                 releaseCompressionContext(CompressionContext *context);
+
+// Preset dictionaries, for small records which share a lot of content (JSON keys, common values) but are too short
+// to build up a useful window of their own.  zlib and LZMA start each record with the dictionary already in their
+// window; the other codecs compress as usual.  The dictionary id is recorded in the header, and the same dictionary
+// must be registered under it to decompress.  Blocks and parallel containers use dictionaries too, but streams do not.
+//
+// trainDictionary picks the substrings found in the most samples, at most 'maxSize' bytes of them (zlib uses only
+// the last 32KB), and returns the length written to 'dict', or 0 if the samples are too small to learn anything from.
+size_t           trainDictionary(const void * const *samples,const size_t *sampleLengths,size_t sampleCount,void *dict,size_t maxSize);
+// The dictionary is copied.  The id must be non-zero and not already registered.  Thread safe.
+bool             registerDictionary(unsigned int id,const void *dict,size_t len);
+bool             unregisterDictionary(unsigned int id);
+// Dictionary files hold one dictionary and its id behind a small versioned header, so that dictionaries can be
+// retrained and shipped as data (see the train_dictionary tool).  registerDictionaryFile maps the file, checks it and
+// registers the dictionary under the id it holds, storing that in 'id' if given; the file stays mapped until the
+// dictionary is unregistered and no call is using it.
+bool             saveDictionary(const char *fname,unsigned int id,const void *dict,size_t len);
+bool             registerDictionaryFile(const char *fname,unsigned int *id=0);
+
+// Data is written with a 32 byte header holding 64-bit lengths (40 bytes with CS_HASH64); data written with the
+// original 16 byte header still decompresses.  Data which measures as incompressible, or which the codec fails on
+// or would expand, is written as CT_STORED instead, so the output is never more than the header larger than the
+// input.  LZF and FastLZ count in 32 bits, so inputs of 4GB and 2GB or more are stored.
+void *           compressData(const void *source,size_t len,size_t &outlen,CompressionType type=CT_ZLIB,CompressionContext *context=0,ChecksumType checksum=CS_CRC,const CompressionOptions *options=0);
+void *           decompressData(const void *source,size_t clen,size_t &outlen,CompressionContext *context=0);
 void             deleteData(void* mem);
 
-CompressionType  getCompressionType(const void *mem,int len);
+// Caller supplied buffer variants; these never allocate the output.  'dest' must be at least
+// getMaxCompressedSize(type,len) bytes for compressInto, and getDecompressedSize(source,clen) bytes
+// for decompressInto.  Both return false (and outlen=0) if the buffer is too small or the codec fails.
+size_t           getMaxCompressedSize(CompressionType type,size_t len);
+size_t           getDecompressedSize(const void *mem,size_t clen);
+bool             compressInto(const void *source,size_t len,void *dest,size_t destCapacity,size_t &outlen,CompressionType type=CT_ZLIB,CompressionContext *context=0,ChecksumType checksum=CS_CRC,const CompressionOptions *options=0);
+bool             decompressInto(const void *source,size_t clen,void *dest,size_t destCapacity,size_t &outlen,CompressionContext *context=0);
+
+// The codec CT_AUTO would use for this data with CompressionOptions::mAutoTarget set to 'target', and in 'level' (if
+// given) the level to compress at, -1 for the codec's default.
+CompressionType  chooseCompressionType(const void *source,size_t len,const AutoTarget &target=AutoTarget(),CompressionContext *context=0,int *level=0);
+
+// Block-parallel mode.  The input is split into blocks of 'blockSize' bytes (0 picks a default of 1MB) which are
+// compressed independently on 'numThreads' threads (0 uses one per hardware thread), with any codec, into a
+// container indexed by block.  decompressDataParallel restores the blocks on several threads as well; the
+// ordinary decompressData/decompressInto also accept a container but work through its blocks on the calling thread.
+void *           compressDataParallel(const void *source,size_t len,size_t &outlen,CompressionType type=CT_ZLIB,unsigned int numThreads=0,size_t blockSize=0,ChecksumType checksum=CS_CRC,const CompressionOptions *options=0);
+void *           decompressDataParallel(const void *source,size_t clen,size_t &outlen,unsigned int numThreads=0);
+
+// Random access to a block container, decompressing only the blocks a read touches, so a few KB from the middle of
+// an archive cost a block or two rather than the whole payload.  Any codec works, and an ordinary payload opens
+// too, as a single block.  openSeekable reads a container the caller keeps in memory until closeSeekable;
+// openSeekableFile maps one from disk.  readAt copies up to 'len' bytes from 'offset' of the raw data, fewer at the
+// end, and fails at an offset past the end or on damaged blocks.  Any number of threads may read one reader at
+// once, each with its own context (or none, which costs a context per call).
+class SeekableReader;
+
+SeekableReader * openSeekable(const void *container,size_t clen);
+SeekableReader * openSeekableFile(const char *fname);
+void             closeSeekable(SeekableReader *reader);
+size_t           getSeekableLength(const SeekableReader *reader);
+bool             readAt(const SeekableReader *reader,size_t offset,void *dest,size_t len,size_t &outlen,CompressionContext *context=0);
+
+// A cache of decompressed blocks for seekable readers, so that hot ranges are decompressed once rather than on
+// every read.  It holds at most 'budget' bytes of blocks, dropping the least recently used first, in 'shards'
+// independently locked shards (0 picks 16) which share the whole budget, and may be shared by any number of readers
+// and threads.  Blocks are keyed by the container id given to setSeekableCache along with the block number, so readers
+// of the same container (even from separate opens) can share one id, and a container that changes needs a new id
+// or evictSeekableCache.  Set the cache before reading, and release it only after its readers are closed.
+class SeekableCache;
+
+struct SeekableCacheStats
+{
+  unsigned long long  mHits;
+  unsigned long long  mMisses;
+  unsigned long long  mEvictions;   // blocks dropped to stay within the budget
+  size_t              mBlocks;      // blocks held now
+  size_t              mBytes;       // their size
+  size_t              mBudget;
+};
+
+SeekableCache *  createSeekableCache(size_t budget,unsigned int shards=0);
+void             releaseSeekableCache(SeekableCache *cache);
+void             setSeekableCache(SeekableReader *reader,SeekableCache *cache,unsigned long long container);
+void             evictSeekableCache(SeekableCache *cache,unsigned long long container);
+void             getSeekableCacheStats(SeekableCache *cache,SeekableCacheStats &stats);
+
+// Parallel deflate, for output that gzip, zlib and other tools can read.  As in pigz, the input is split into chunks
+// of 'chunkSize' bytes (0 picks 128KB) which are deflated on 'numThreads' threads, each primed with the 32KB before
+// it, and joined by sync flushes into a single deflate stream with a gzip (RFC 1952) or zlib (RFC 1950) wrapper.
+// The stream is a few bytes per chunk larger than serial zlib's.  Only mLevel and mStrategy of the options apply.
+// decompressDeflate reads either wrapper, and concatenated gzip members, on the calling thread.  The results of
+// both are released with deleteData; without zlib in the build they return 0.
+enum DeflateFormat
+{
+  DF_GZIP,
+  DF_ZLIB
+};
+
+void *           compressDeflateParallel(const void *source,size_t len,size_t &outlen,DeflateFormat format=DF_GZIP,unsigned int numThreads=0,size_t chunkSize=0,const CompressionOptions *options=0);
+void *           decompressDeflate(const void *source,size_t clen,size_t &outlen);
+
+// Parallel bzip2, for output that bzip2, pbzip2 and other tools can read.  As in pbzip2, the input is split into
+// chunks of one block each (900KB at the default level 9), compressed on 'numThreads' threads as separate streams
+// and concatenated.  decompressBzip2 decodes the streams of such a concatenation on several threads too, and any
+// other bzip2 data serially.  decompressDataParallel does the same for CT_BZIP payloads written with mThreads.
+// Both results are released with deleteData.
+void *           compressBzip2Parallel(const void *source,size_t len,size_t &outlen,unsigned int numThreads=0,int level=9);
+void *           decompressBzip2(const void *source,size_t clen,size_t &outlen,unsigned int numThreads=0);
+
+// Incremental compression for data too large to hold in memory.  A stream is begun with an output callback,
+// fed any number of chunks, optionally flushed (so that everything fed so far can be decoded by the reader),
+// and ended, which also releases it.  The zlib, bzip and miniz streams are a single continuous codec stream;
+// the other codecs compress independent blocks of getStreamBlockSize(type) bytes.  Either way memory use is
+// bounded by the codec window or block size, not by the length of the data.  Decompression streams detect the
+// codec from the stream header, and endStream returns false unless the whole stream arrived intact.
+typedef bool (*StreamOutputFunc)(const void *data,size_t len,void *userData); // return false to abort the stream.
+
+class CompressionStream;
+
+CompressionStream * beginCompressStream(CompressionType type,StreamOutputFunc output,void *userData,const CompressionOptions *options=0);
+CompressionStream * beginDecompressStream(StreamOutputFunc output,void *userData);
+bool                feedStream(CompressionStream *stream,const void *data,size_t len);
+bool                flushStream(CompressionStream *stream);
+bool                endStream(CompressionStream *stream);
+size_t              getStreamBlockSize(CompressionType type);
+
+// Streaming LZMA decompression with constant memory, for restoring data straight to a file or socket.  The payload
+// written by compressData or compressInto with CT_LZMA (or CT_STORED, which incompressible data falls back to) is
+// pulled through the input callback as it is needed, and decoded through a ring buffer of the encoder's dictionary
+// size, so memory is the dictionary plus 64KB however long the data.  Block containers are not accepted.  readLzma
+// copies up to 'len' bytes and returns outlen=0 at the end; the checksum can only be checked once the last bytes are
+// decoded, so the data is good only when a read returns them with true.
+typedef size_t (*StreamInputFunc)(void *data,size_t len,void *userData); // the bytes read into 'data', 0 at the end.
+
+class LzmaReader;
+
+LzmaReader *        openLzmaReader(StreamInputFunc input,void *userData);
+bool                readLzma(LzmaReader *reader,void *dest,size_t len,size_t &outlen);
+unsigned long long  getLzmaReaderLength(const LzmaReader *reader);
+void                closeLzmaReader(LzmaReader *reader);
+
+// File to file compression through the streams above, for files of any size.  The input is mapped and fed to the
+// stream a piece at a time, each piece dropped from memory once consumed, and the output goes out in large sequential
+// writes, so no copy of either file is held in memory.  compressFile writes a compression stream, which decompressFile
+// (or beginDecompressStream) restores.  The output is written to destName with ".tmp" appended and renamed over
+// destName once complete, so a failure leaves any existing file untouched.  Both fail if the names are the same file.
+bool                compressFile(const char *sourceName,const char *destName,CompressionType type=CT_ZLIB,const CompressionOptions *options=0);
+bool                decompressFile(const char *sourceName,const char *destName);
+
+CompressionType  getCompressionType(const void *mem,size_t len);
 const char      *getCompressionTypeString(CompressionType type);
 
 };
@@ -77,6 +77,20 @@ unsigned int
 lzf_compress (const void *const in_data,  unsigned int in_len,
               void             *out_data, unsigned int out_len);
 
+/*
+ * Same as lzf_compress, but uses the caller supplied hash table 'state'
+ * (which must be at least lzf_state_size() bytes) instead of one on the
+ * stack. The table does not need to be initialised and can be reused
+ * for any number of calls, but not concurrently.
+ */
+unsigned int
+lzf_compress_state (const void *const in_data,  unsigned int in_len,
+                    void             *out_data, unsigned int out_len,
+                    void             *state);
+
+unsigned int
+lzf_state_size (void);
+
 /*
  * Decompress data compressed with some version of the lzf_compress
  * function and stored at location in_data and length in_len. The result
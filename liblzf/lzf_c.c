@@ -95,17 +95,10 @@
  *
  */
 
-unsigned int
-lzf_compress (const void *const in_data, unsigned int in_len,
-	      void *out_data, unsigned int out_len
-#if LZF_STATE_ARG
-              , LZF_STATE htab
-#endif
-              )
+static unsigned int
+lzf_compress_htab (const void *const in_data, unsigned int in_len,
+	      void *out_data, unsigned int out_len, const u8 **htab)
 {
-#if !LZF_STATE_ARG
-  LZF_STATE htab;
-#endif
   const u8 **hslot;
   const u8 *ip = (const u8 *)in_data;
         u8 *op = (u8 *)out_data;
@@ -132,7 +125,7 @@ lzf_compress (const void *const in_data, unsigned int in_len,
     return 0;
 
 #if INIT_HTAB
-  memset (htab, 0, sizeof (htab));
+  memset (htab, 0, sizeof (LZF_STATE));
 # if 0
   for (hslot = htab; hslot < htab + HSIZE; hslot++)
     *hslot++ = ip;
@@ -294,3 +287,30 @@ lzf_compress (const void *const in_data, unsigned int in_len,
   return op - (u8 *)out_data;
 }
 
+unsigned int
+lzf_compress (const void *const in_data, unsigned int in_len,
+	      void *out_data, unsigned int out_len
+#if LZF_STATE_ARG
+              , LZF_STATE htab
+#endif
+              )
+{
+#if !LZF_STATE_ARG
+  LZF_STATE htab;
+#endif
+
+  return lzf_compress_htab (in_data, in_len, out_data, out_len, htab);
+}
+
+unsigned int
+lzf_compress_state (const void *const in_data, unsigned int in_len,
+	            void *out_data, unsigned int out_len, void *state)
+{
+  return lzf_compress_htab (in_data, in_len, out_data, out_len, (const u8 **)state);
+}
+
+unsigned int
+lzf_state_size (void)
+{
+  return sizeof (LZF_STATE);
+}
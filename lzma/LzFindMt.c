@@ -0,0 +1,270 @@
+/* LzFindMt.c -- multithreaded Match finder for LZ algorithms
+   A worker thread runs the binary tree match finder ahead of the encoder */
+
+#include "LzFindMt.h"
+
+/* the encoder can trail the thread by every position in the ring, so the window keeps that much more history */
+#define kMtMaxLag (kMtNumBlocks * (kMtBlockSize / 2))
+
+void MatchFinderMt_Construct(CMatchFinderMt *p)
+{
+  p->MatchFinder = 0;
+  p->GetMatches = 0;
+  p->buf = 0;
+  p->threadCreated = 0;
+  p->syncCreated = 0;
+  p->haveBlock = 0;
+  p->numFilled = p->numFreed = 0;
+  p->running = p->busy = p->exit = 0;
+}
+
+void MatchFinderMt_Destruct(CMatchFinderMt *p, ISzAlloc *alloc)
+{
+  if (p->threadCreated)
+  {
+    MatchFinderMt_ReleaseStream(p);
+    CriticalSection_Enter(&p->cs);
+    p->exit = 1;
+    CondVar_Signal(&p->canProduce);
+    CriticalSection_Leave(&p->cs);
+    Thread_Wait(&p->thread);
+    p->threadCreated = 0;
+  }
+  if (p->syncCreated)
+  {
+    CondVar_Delete(&p->canConsume);
+    CondVar_Delete(&p->canProduce);
+    CriticalSection_Delete(&p->windowCs);
+    CriticalSection_Delete(&p->cs);
+    p->syncCreated = 0;
+  }
+  alloc->Free(alloc, p->buf);
+  p->buf = 0;
+}
+
+/* True if the next GetMatches call may reach MatchFinder_MoveBlock, which slides the window under the encoder. */
+static int MtMayMoveWindow(const CMatchFinder *mf)
+{
+  return mf->pos + 1 == mf->posLimit && !mf->streamEndWasReached &&
+      (size_t)(mf->bufferBase + mf->blockSize - (mf->buffer + 1)) <= mf->keepSizeAfter;
+}
+
+/* Returns 1 once the end of the stream has been recorded, as a position with no available bytes. */
+static int MtFillBlock(CMatchFinderMt *p, UInt32 *block)
+{
+  CMatchFinder *mf = p->MatchFinder;
+  UInt32 limit = kMtBlockSize - (mf->matchMaxLen * 2 + 2);
+  UInt32 pos = 1;
+  int end = 0;
+  while (pos <= limit)
+  {
+    UInt32 numAvail = Inline_MatchFinder_GetNumAvailableBytes(mf);
+    block[pos] = numAvail;
+    if (numAvail == 0)
+    {
+      block[pos + 1] = 0;
+      pos += 2;
+      end = 1;
+      break;
+    }
+    if (MtMayMoveWindow(mf))
+    {
+      const Byte *before = mf->buffer;
+      CriticalSection_Enter(&p->windowCs);
+      block[pos + 1] = p->GetMatches(mf, block + pos + 2);
+      p->pointerToCurPos += mf->buffer - (before + 1);
+      CriticalSection_Leave(&p->windowCs);
+    }
+    else
+      block[pos + 1] = p->GetMatches(mf, block + pos + 2);
+    pos += 2 + block[pos + 1];
+  }
+  block[0] = pos;
+  return end;
+}
+
+static THREAD_FUNC_RET_TYPE THREAD_FUNC_CALL_TYPE MtThreadFunc(void *pp)
+{
+  CMatchFinderMt *p = (CMatchFinderMt *)pp;
+  CriticalSection_Enter(&p->cs);
+  for (;;)
+  {
+    int end;
+    while (!p->exit && !(p->running && p->numFilled - p->numFreed < kMtNumBlocks))
+      CondVar_Wait(&p->canProduce, &p->cs);
+    if (p->exit)
+      break;
+    p->busy = 1;
+    CriticalSection_Leave(&p->cs);
+
+    end = MtFillBlock(p, p->buf + (p->numFilled % kMtNumBlocks) * kMtBlockSize);
+
+    CriticalSection_Enter(&p->cs);
+    p->busy = 0;
+    p->numFilled++;
+    if (end)
+      p->running = 0;
+    CondVar_Signal(&p->canConsume);
+  }
+  CriticalSection_Leave(&p->cs);
+  return 0;
+}
+
+SRes MatchFinderMt_Create(CMatchFinderMt *p, UInt32 historySize, UInt32 keepAddBufferBefore,
+    UInt32 matchMaxLen, UInt32 keepAddBufferAfter, ISzAlloc *alloc)
+{
+  CMatchFinder *mf = p->MatchFinder;
+  IMatchFinder vTable;
+  if (!MatchFinder_Create(mf, historySize, keepAddBufferBefore + kMtMaxLag, matchMaxLen, keepAddBufferAfter, alloc))
+    return SZ_ERROR_MEM;
+  MatchFinder_CreateVTable(mf, &vTable);
+  p->GetMatches = vTable.GetMatches;
+  if (p->buf == 0)
+  {
+    p->buf = (UInt32 *)alloc->Alloc(alloc, kMtNumBlocks * kMtBlockSize * sizeof(UInt32));
+    if (p->buf == 0)
+      return SZ_ERROR_MEM;
+  }
+  if (!p->syncCreated)
+  {
+    if (CriticalSection_Init(&p->cs) != 0)
+      return SZ_ERROR_THREAD;
+    if (CriticalSection_Init(&p->windowCs) != 0)
+    {
+      CriticalSection_Delete(&p->cs);
+      return SZ_ERROR_THREAD;
+    }
+    if (CondVar_Init(&p->canProduce) != 0)
+    {
+      CriticalSection_Delete(&p->windowCs);
+      CriticalSection_Delete(&p->cs);
+      return SZ_ERROR_THREAD;
+    }
+    if (CondVar_Init(&p->canConsume) != 0)
+    {
+      CondVar_Delete(&p->canProduce);
+      CriticalSection_Delete(&p->windowCs);
+      CriticalSection_Delete(&p->cs);
+      return SZ_ERROR_THREAD;
+    }
+    p->syncCreated = 1;
+  }
+  if (!p->threadCreated)
+  {
+    p->exit = 0;
+    if (Thread_Create(&p->thread, MtThreadFunc, p) != 0)
+      return SZ_ERROR_THREAD;
+    p->threadCreated = 1;
+  }
+  return SZ_OK;
+}
+
+/* Gives the current block back to the thread and waits for the next one. */
+static void MatchFinderMt_GetNextBlock(CMatchFinderMt *p)
+{
+  const UInt32 *block;
+  CriticalSection_Enter(&p->cs);
+  if (p->haveBlock)
+  {
+    p->haveBlock = 0;
+    CriticalSection_Leave(&p->windowCs);
+    p->numFreed++;
+    CondVar_Signal(&p->canProduce);
+  }
+  while (p->numFilled == p->numFreed)
+    CondVar_Wait(&p->canConsume, &p->cs);
+  CriticalSection_Leave(&p->cs);
+
+  CriticalSection_Enter(&p->windowCs);
+  p->haveBlock = 1;
+  block = p->buf + (p->numFreed % kMtNumBlocks) * kMtBlockSize;
+  p->btBuf = block + 1;
+  p->btBufLimit = block + block[0];
+}
+
+void MatchFinderMt_ReleaseStream(CMatchFinderMt *p)
+{
+  if (!p->threadCreated)
+    return;
+  CriticalSection_Enter(&p->cs);
+  p->running = 0;
+  if (p->haveBlock)
+  {
+    p->haveBlock = 0;
+    CriticalSection_Leave(&p->windowCs);
+  }
+  while (p->busy)
+    CondVar_Wait(&p->canConsume, &p->cs);
+  CriticalSection_Leave(&p->cs);
+}
+
+static void MatchFinderMt_Init(CMatchFinderMt *p)
+{
+  CMatchFinder *mf = p->MatchFinder;
+  MatchFinderMt_ReleaseStream(p);
+  MatchFinder_Init(mf);
+  p->pointerToCurPos = MatchFinder_GetPointerToCurrentPos(mf);
+
+  CriticalSection_Enter(&p->cs);
+  p->numFilled = p->numFreed = 0;
+  p->running = 1;
+  CondVar_Signal(&p->canProduce);
+  CriticalSection_Leave(&p->cs);
+
+  MatchFinderMt_GetNextBlock(p);
+}
+
+static Byte MatchFinderMt_GetIndexByte(CMatchFinderMt *p, Int32 index)
+{
+  return p->pointerToCurPos[index];
+}
+
+static const Byte * MatchFinderMt_GetPointerToCurrentPos(CMatchFinderMt *p)
+{
+  return p->pointerToCurPos;
+}
+
+static UInt32 MatchFinderMt_GetNumAvailableBytes(CMatchFinderMt *p)
+{
+  if (p->btBuf == p->btBufLimit)
+    MatchFinderMt_GetNextBlock(p);
+  return p->btBuf[0];
+}
+
+static UInt32 MatchFinderMt_GetMatches(CMatchFinderMt *p, UInt32 *distances)
+{
+  const UInt32 *btBuf;
+  UInt32 i, num;
+  if (p->btBuf == p->btBufLimit)
+    MatchFinderMt_GetNextBlock(p);
+  btBuf = p->btBuf;
+  num = btBuf[1];
+  for (i = 0; i < num; i++)
+    distances[i] = btBuf[2 + i];
+  p->btBuf = btBuf + 2 + num;
+  p->pointerToCurPos++;
+  return num;
+}
+
+static void MatchFinderMt_Skip(CMatchFinderMt *p, UInt32 num)
+{
+  do
+  {
+    if (p->btBuf == p->btBufLimit)
+      MatchFinderMt_GetNextBlock(p);
+    p->btBuf += 2 + p->btBuf[1];
+    p->pointerToCurPos++;
+  }
+  while (--num != 0);
+}
+
+void MatchFinderMt_CreateVTable(CMatchFinderMt *p, IMatchFinder *vTable)
+{
+  vTable->Init = (Mf_Init_Func)MatchFinderMt_Init;
+  vTable->GetIndexByte = (Mf_GetIndexByte_Func)MatchFinderMt_GetIndexByte;
+  vTable->GetNumAvailableBytes = (Mf_GetNumAvailableBytes_Func)MatchFinderMt_GetNumAvailableBytes;
+  vTable->GetPointerToCurrentPos = (Mf_GetPointerToCurrentPos_Func)MatchFinderMt_GetPointerToCurrentPos;
+  vTable->GetMatches = (Mf_GetMatches_Func)MatchFinderMt_GetMatches;
+  vTable->Skip = (Mf_Skip_Func)MatchFinderMt_Skip;
+  p = p;
+}
@@ -0,0 +1,49 @@
+/* LzFindMt.h -- multithreaded Match finder for LZ algorithms
+   A worker thread runs the binary tree match finder ahead of the encoder */
+
+#ifndef __LZFINDMT_H
+#define __LZFINDMT_H
+
+#include "Threads.h"
+#include "LzFind.h"
+
+#define kMtBlockSize (1 << 14)  /* UInt32 items in one block of match records */
+#define kMtNumBlocks 8
+
+typedef struct _CMatchFinderMt
+{
+  /* LZ (encoder thread) */
+  const Byte *pointerToCurPos;
+  const UInt32 *btBuf;
+  const UInt32 *btBufLimit;
+  int haveBlock;          /* the encoder owns block (numFreed) and holds windowCs */
+
+  CMatchFinder *MatchFinder;
+  Mf_GetMatches_Func GetMatches;
+  UInt32 *buf;            /* kMtNumBlocks blocks: [used items] then [numAvail, num, distances[num]] per position */
+
+  CThread thread;
+  int threadCreated;
+  int syncCreated;
+
+  CCriticalSection cs;
+  CCondVar canProduce;
+  CCondVar canConsume;
+  UInt32 numFilled;
+  UInt32 numFreed;
+  int running;
+  int busy;
+  int exit;
+
+  /* held by the encoder while it reads the window; the thread takes it to move the window */
+  CCriticalSection windowCs;
+} CMatchFinderMt;
+
+void MatchFinderMt_Construct(CMatchFinderMt *p);
+void MatchFinderMt_Destruct(CMatchFinderMt *p, ISzAlloc *alloc);
+SRes MatchFinderMt_Create(CMatchFinderMt *p, UInt32 historySize, UInt32 keepAddBufferBefore,
+    UInt32 matchMaxLen, UInt32 keepAddBufferAfter, ISzAlloc *alloc);
+void MatchFinderMt_CreateVTable(CMatchFinderMt *p, IMatchFinder *vTable);
+void MatchFinderMt_ReleaseStream(CMatchFinderMt *p);
+
+#endif
@@ -712,6 +712,15 @@ void LzmaDec_Init(CLzmaDec *p)
   LzmaDec_InitDicAndState(p, True, True);
 }
 
+void LzmaDec_InitWithDic(CLzmaDec *p, SizeT dicLen)
+{
+  LzmaDec_Init(p);
+  p->dicPos = dicLen;
+  p->processedPos = (UInt32)dicLen;
+  if (dicLen >= p->prop.dicSize)
+    p->checkDicSize = p->prop.dicSize;
+}
+
 static void LzmaDec_InitStateReal(CLzmaDec *p)
 {
   UInt32 numProbs = Literal + ((UInt32)LZMA_LIT_SIZE << (p->prop.lc + p->prop.lp));
@@ -68,6 +68,10 @@ typedef struct
 
 void LzmaDec_Init(CLzmaDec *p);
 
+/* LzmaDec_InitWithDic starts a stream written by LzmaEnc_MemEncodeWithDic.
+   The dicLen bytes of its preset dictionary must already be at the start of p->dic. */
+void LzmaDec_InitWithDic(CLzmaDec *p, SizeT dicLen);
+
 /* There are two types of LZMA streams:
      0) Stream with end mark. That end mark adds about 6 bytes to compressed size.
      1) Stream without end mark. You must know exact uncompressed size to decompress such stream. */
@@ -237,12 +237,21 @@ typedef struct _CSeqInStreamBuf
   ISeqInStream funcTable;
   const Byte *data;
   SizeT rem;
+  const Byte *next; /* read once data is used up */
+  SizeT nextRem;
 } CSeqInStreamBuf;
 
 static SRes MyRead(void *pp, void *data, size_t *size)
 {
   size_t curSize = *size;
   CSeqInStreamBuf *p = (CSeqInStreamBuf *)pp;
+  if (p->rem == 0 && p->next != 0)
+  {
+    p->data = p->next;
+    p->rem = p->nextRem;
+    p->next = 0;
+    p->nextRem = 0;
+  }
   if (p->rem < curSize)
     curSize = p->rem;
   memcpy(data, p->data, curSize);
@@ -353,6 +362,7 @@ typedef struct _CLzmaEnc
 
   ISeqInStream *inStream;
   CSeqInStreamBuf seqBufInStream;
+  UInt32 preloadSize;
 
   CSaveState saveState;
 } CLzmaEnc;
@@ -1716,6 +1726,7 @@ void LzmaEnc_Construct(CLzmaEnc *p)
   LzmaEnc_InitPriceTables(p->ProbPrices);
   p->litProbs = 0;
   p->saveState.litProbs = 0;
+  p->preloadSize = 0;
 }
 
 CLzmaEncHandle LzmaEnc_Create(ISzAlloc *alloc)
@@ -1759,6 +1770,13 @@ static SRes LzmaEnc_CodeOneBlock(CLzmaEnc *p, Bool useLimits, UInt32 maxPackSize
     p->matchFinderBase.stream = p->inStream;
     p->matchFinder.Init(p->matchFinderObj);
     p->inStream = 0;
+    if (p->preloadSize != 0)
+    {
+      /* a preset dictionary: it goes through the match finder but is not coded */
+      p->matchFinder.Skip(p->matchFinderObj, p->preloadSize);
+      p->nowPos64 = p->preloadSize;
+      p->preloadSize = 0;
+    }
   }
 
   if (p->finished)
@@ -2079,6 +2097,8 @@ static void LzmaEnc_SetInputBuf(CLzmaEnc *p, const Byte *src, SizeT srcLen)
   p->seqBufInStream.funcTable.Read = MyRead;
   p->seqBufInStream.data = src;
   p->seqBufInStream.rem = srcLen;
+  p->seqBufInStream.next = 0;
+  p->seqBufInStream.nextRem = 0;
 }
 
 SRes LzmaEnc_MemPrepare(CLzmaEncHandle pp, const Byte *src, SizeT srcLen,
@@ -2235,13 +2255,28 @@ SRes LzmaEnc_WriteProperties(CLzmaEncHandle pp, Byte *props, SizeT *size)
 
 SRes LzmaEnc_MemEncode(CLzmaEncHandle pp, Byte *dest, SizeT *destLen, const Byte *src, SizeT srcLen,
     int writeEndMark, ICompressProgress *progress, ISzAlloc *alloc, ISzAlloc *allocBig)
+{
+  return LzmaEnc_MemEncodeWithDic(pp, dest, destLen, 0, 0, src, srcLen, writeEndMark, progress, alloc, allocBig);
+}
+
+SRes LzmaEnc_MemEncodeWithDic(CLzmaEncHandle pp, Byte *dest, SizeT *destLen, const Byte *dic, SizeT dicLen,
+    const Byte *src, SizeT srcLen, int writeEndMark, ICompressProgress *progress, ISzAlloc *alloc, ISzAlloc *allocBig)
 {
   SRes res;
   CLzmaEnc *p = (CLzmaEnc *)pp;
 
   CSeqOutStreamBuf outStream;
 
+  if ((UInt32)dicLen != dicLen)
+    return SZ_ERROR_PARAM;
   LzmaEnc_SetInputBuf(p, src, srcLen);
+  if (dicLen != 0)
+  {
+    LzmaEnc_SetInputBuf(p, dic, dicLen);
+    p->seqBufInStream.next = src;
+    p->seqBufInStream.nextRem = srcLen;
+  }
+  p->preloadSize = (UInt32)dicLen;
 
   outStream.funcTable.Write = MyWrite;
   outStream.data = dest;
@@ -2251,6 +2286,7 @@ SRes LzmaEnc_MemEncode(CLzmaEncHandle pp, Byte *dest, SizeT *destLen, const Byte
   p->writeEndMark = writeEndMark;
   res = LzmaEnc_Encode(pp, &outStream.funcTable, &p->seqBufInStream.funcTable,
       progress, alloc, allocBig);
+  p->preloadSize = 0;
 
   *destLen -= outStream.rem;
   if (outStream.overflow)
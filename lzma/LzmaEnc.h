@@ -54,6 +54,11 @@ SRes LzmaEnc_Encode(CLzmaEncHandle p, ISeqOutStream *outStream, ISeqInStream *in
 SRes LzmaEnc_MemEncode(CLzmaEncHandle p, Byte *dest, SizeT *destLen, const Byte *src, SizeT srcLen,
     int writeEndMark, ICompressProgress *progress, ISzAlloc *alloc, ISzAlloc *allocBig);
 
+/* LzmaEnc_MemEncodeWithDic encodes src as if the dicLen bytes of dic came just before it (a preset
+   dictionary): they prime the window but are not coded.  Decode with LzmaDec_InitWithDic. */
+SRes LzmaEnc_MemEncodeWithDic(CLzmaEncHandle p, Byte *dest, SizeT *destLen, const Byte *dic, SizeT dicLen,
+    const Byte *src, SizeT srcLen, int writeEndMark, ICompressProgress *progress, ISzAlloc *alloc, ISzAlloc *allocBig);
+
 /* ---------- One Call Interface ---------- */
 
 /* LzmaEncode
@@ -0,0 +1,66 @@
+/* Threads.c -- multithreading library
+   Win32 threads or POSIX threads, chosen by _WIN32 */
+
+#include "Threads.h"
+
+#ifdef _WIN32
+
+WRes Thread_Create(CThread *p, THREAD_FUNC_TYPE func, void *param)
+{
+  *p = CreateThread(0, 0, func, param, 0, 0);
+  return (*p != 0) ? 0 : GetLastError();
+}
+
+WRes Thread_Wait(CThread *p)
+{
+  WRes res = 0;
+  if (WaitForSingleObject(*p, INFINITE) != WAIT_OBJECT_0)
+    res = GetLastError();
+  CloseHandle(*p);
+  *p = 0;
+  return res;
+}
+
+WRes CriticalSection_Init(CCriticalSection *p)
+{
+  InitializeCriticalSection(p);
+  return 0;
+}
+
+void CriticalSection_Delete(CCriticalSection *p) { DeleteCriticalSection(p); }
+void CriticalSection_Enter(CCriticalSection *p) { EnterCriticalSection(p); }
+void CriticalSection_Leave(CCriticalSection *p) { LeaveCriticalSection(p); }
+
+WRes CondVar_Init(CCondVar *p)
+{
+  InitializeConditionVariable(p);
+  return 0;
+}
+
+void CondVar_Delete(CCondVar *p) { p = p; }
+void CondVar_Wait(CCondVar *p, CCriticalSection *cs) { SleepConditionVariableCS(p, cs, INFINITE); }
+void CondVar_Signal(CCondVar *p) { WakeConditionVariable(p); }
+
+#else
+
+WRes Thread_Create(CThread *p, THREAD_FUNC_TYPE func, void *param)
+{
+  return pthread_create(p, 0, func, param);
+}
+
+WRes Thread_Wait(CThread *p)
+{
+  return pthread_join(*p, 0);
+}
+
+WRes CriticalSection_Init(CCriticalSection *p) { return pthread_mutex_init(p, 0); }
+void CriticalSection_Delete(CCriticalSection *p) { pthread_mutex_destroy(p); }
+void CriticalSection_Enter(CCriticalSection *p) { pthread_mutex_lock(p); }
+void CriticalSection_Leave(CCriticalSection *p) { pthread_mutex_unlock(p); }
+
+WRes CondVar_Init(CCondVar *p) { return pthread_cond_init(p, 0); }
+void CondVar_Delete(CCondVar *p) { pthread_cond_destroy(p); }
+void CondVar_Wait(CCondVar *p, CCriticalSection *cs) { pthread_cond_wait(p, cs); }
+void CondVar_Signal(CCondVar *p) { pthread_cond_signal(p); }
+
+#endif
@@ -0,0 +1,45 @@
+/* Threads.h -- multithreading library
+   Win32 threads or POSIX threads, chosen by _WIN32 */
+
+#ifndef __7Z_THREADS_H
+#define __7Z_THREADS_H
+
+#include "Types.h"
+
+#ifdef _WIN32
+
+typedef HANDLE CThread;
+typedef CRITICAL_SECTION CCriticalSection;
+typedef CONDITION_VARIABLE CCondVar;
+#define THREAD_FUNC_RET_TYPE DWORD
+#define THREAD_FUNC_CALL_TYPE WINAPI
+
+#else
+
+#include <pthread.h>
+
+typedef pthread_t CThread;
+typedef pthread_mutex_t CCriticalSection;
+typedef pthread_cond_t CCondVar;
+#define THREAD_FUNC_RET_TYPE void *
+#define THREAD_FUNC_CALL_TYPE
+
+#endif
+
+typedef THREAD_FUNC_RET_TYPE (THREAD_FUNC_CALL_TYPE * THREAD_FUNC_TYPE)(void *);
+
+WRes Thread_Create(CThread *p, THREAD_FUNC_TYPE func, void *param);
+WRes Thread_Wait(CThread *p);
+
+WRes CriticalSection_Init(CCriticalSection *p);
+void CriticalSection_Delete(CCriticalSection *p);
+void CriticalSection_Enter(CCriticalSection *p);
+void CriticalSection_Leave(CCriticalSection *p);
+
+WRes CondVar_Init(CCondVar *p);
+void CondVar_Delete(CCondVar *p);
+/* atomically leaves cs, waits for a signal and enters cs again; wakeups may be spurious */
+void CondVar_Wait(CCondVar *p, CCriticalSection *cs);
+void CondVar_Signal(CCondVar *p);
+
+#endif
@@ -2,6 +2,6 @@
 #define __MINIZ_H
 
 #define MINIZ_HEADER_FILE_ONLY
-#include "miniz.h"
+#include "miniz.c"
 
 #endif /* __MINIZ_H */
@@ -1,188 +1,445 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <direct.h>
-#include <assert.h>
-#include <conio.h>
 
-#include <windows.h>
-
-#pragma warning(disable:4996)
-#pragma comment(lib, "winmm.lib" )
-#pragma comment(lib, "wsock32.lib" )
-#pragma comment(lib, "Ws2_32.lib" )
+#include <chrono>
+#include <vector>
+#include <string>
+#include <algorithm>
 
 #include "../compression/compression.h"
 
-#define MAXNUMERIC 32  // JWR  support up to 16 32 character long numeric formated strings
-#define MAXFNUM    16
+// Benchmarks every compressor on one or more input files.
+//
+// Each codec is timed over a number of warmup runs, which are discarded, followed by the measured runs, reusing
+// a CompressionContext and caller supplied buffers so that only the codec itself is timed.  Every run is checked
+// to round trip.  Speeds are reported in MB/s (1MB = 1,000,000 bytes of uncompressed data) from the median run,
+// together with the 99th percentile time, as a table, CSV or JSON.  Each codec runs at its default level, or with
+// -levels at every level it supports; -presets adds a run of LZMA at each of its presets.  Each file also checks
+// that the seekable block cache hits on a repeated read.
+//
+// usage: test_compression [-runs N] [-warmup N] [-type NAME]... [-levels] [-presets] [-csv | -json] [file...]
 
-static	char  gFormat[MAXNUMERIC*MAXFNUM];
-static int    gIndex=0;
+enum OutputFormat
+{
+  OF_TEXT,
+  OF_CSV,
+  OF_JSON
+};
 
-const char * formatNumber(int number) // JWR  format this integer into a fancy comma delimited string
+struct Options
 {
-	char * dest = &gFormat[gIndex*MAXNUMERIC];
-	gIndex++;
-	if ( gIndex == MAXFNUM ) gIndex = 0;
+  int                                       mRuns;
+  int                                       mWarmup;
+  OutputFormat                              mFormat;
+  bool                                      mLevels;
+  bool                                      mPresets;
+  std::vector<COMPRESSION::CompressionType> mTypes;
+  std::vector<const char *>                 mFiles;
+};
 
-	char scratch[512];
+struct Timing
+{
+  Timing(void) : mMedian(0), mP99(0), mMin(0) { }
 
-#if defined (LINUX_GENERIC)
-	snprintf(scratch, 10, "%d", number);
-#else
-	itoa(number,scratch,10);
-#endif
+  double    mMedian;      // nanoseconds
+  double    mP99;
+  double    mMin;
+};
 
-	char *str = dest;
-	unsigned int len = (unsigned int)strlen(scratch);
-	for (unsigned int i=0; i<len; i++)
-	{
-		int place = (len-1)-i;
-		*str++ = scratch[i];
-		if ( place && (place%3) == 0 ) *str++ = ',';
-	}
-	*str = 0;
-
-	return dest;
+struct Result
+{
+  const char                   *mFile;
+  COMPRESSION::CompressionType  mType;
+  int                           mLevel;         // -1 for the default
+  COMPRESSION::LzmaPreset       mPreset;
+  size_t                        mRawLength;
+  size_t                        mCompressedLength;
+  Timing                        mCompress;
+  Timing                        mDecompress;
+};
+
+static unsigned long long nanoseconds(void)
+{
+  return (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
-void * testCompress(const void *mem,int len,COMPRESSION::CompressionType type,int &outlen)
+static Timing summarize(std::vector<double> &times)
 {
-  const char *tag = COMPRESSION::getCompressionTypeString(type);
-  printf("Compress:%-10s :", tag );
-  unsigned int stime = timeGetTime();
-  void *cdata = COMPRESSION::compressData(mem,len,outlen,type);
-  unsigned int etime = timeGetTime();
-  printf("FROM:%11s TO:%11s %4d%% %8s MS\r\n", formatNumber(len), formatNumber(outlen), 100-((outlen*100) / len), formatNumber(etime-stime) );
-  return cdata;
+  Timing ret;
+  std::sort(times.begin(),times.end());
+  size_t count = times.size();
+  ret.mMin    = times[0];
+  ret.mMedian = (count & 1) ? times[count/2] : (times[count/2-1]+times[count/2])*0.5;
+  ret.mP99    = times[(count*99+99)/100-1]; // nearest rank
+  return ret;
 }
 
-void testDecompress(void *cdata,int clen)
+static double megabytesPerSecond(size_t len,double ns)
 {
-  if ( cdata && clen )
+  return ns > 0 ? (double)len*1000.0/ns : 0;
+}
+
+static bool readFile(const char *fname,std::vector<unsigned char> &data)
+{
+  bool ret = false;
+
+  FILE *fph = fopen(fname,"rb");
+  if ( fph )
   {
-    COMPRESSION::CompressionType type = COMPRESSION::getCompressionType(cdata,clen);
-    if ( type == COMPRESSION::CT_INVALID )
-    {
-      printf("Decompress:%-10s\r\n", "CT_INVALID");
-    }
-    else
+    fseek(fph,0L,SEEK_END);
+    long len = ftell(fph);
+    fseek(fph,0L,SEEK_SET);
+    if ( len > 0 )
     {
-      const char *tag = COMPRESSION::getCompressionTypeString(type);
-      printf("Decompress:%-10s :", tag );
-      unsigned int stime = timeGetTime();
-      int outlen;
-      void *udata = COMPRESSION::decompressData(cdata,clen,outlen);
-      unsigned etime = timeGetTime();
-      printf("FROM:%11s TO:%11s %8s MS\r\n", formatNumber(clen), formatNumber(outlen), formatNumber(etime-stime) );
-      COMPRESSION::deleteData(udata);
+      data.resize((size_t)len);
+      ret = fread(&data[0],(size_t)len,1,fph) == 1;
     }
-    COMPRESSION::deleteData(cdata);
+    fclose(fph);
   }
+
+  return ret;
 }
 
-void main(int argc,const char **argv)
+// Returns false if the codec is not compiled in, or fails to round trip.
+static bool benchmark(const Options &options,const char *fname,const std::vector<unsigned char> &data,COMPRESSION::CompressionType type,int level,COMPRESSION::LzmaPreset preset,COMPRESSION::CompressionContext *context,Result &result)
 {
+  bool ret = false;
+  COMPRESSION::CompressionOptions coptions(level);
+  coptions.mLzmaPreset = preset;
 
-  char dirname[512];
-  strncpy(dirname,argv[0],512);
-  int len = (int)strlen(dirname);
-  char *scan = &dirname[len-1];
-  while ( len )
+  size_t maxlen = COMPRESSION::getMaxCompressedSize(type,data.size());
+  if ( maxlen )
   {
-    if ( *scan == '\\' )
+    std::vector<unsigned char> cdata(maxlen);
+    std::vector<unsigned char> udata(data.size());
+    std::vector<double> ctimes;
+    std::vector<double> dtimes;
+
+    result.mFile             = fname;
+    result.mType             = type;
+    result.mLevel            = level;
+    result.mPreset           = preset;
+    result.mRawLength        = data.size();
+    result.mCompressedLength = 0;
+
+    ret = true;
+    for (int i=0; i<options.mWarmup+options.mRuns && ret; i++)
     {
-      *scan = 0;
-      break;
+      size_t clen = 0;
+      size_t ulen = 0;
+
+      unsigned long long stime = nanoseconds();
+      ret = COMPRESSION::compressInto(&data[0],data.size(),&cdata[0],maxlen,clen,type,context,COMPRESSION::CS_CRC,&coptions);
+      unsigned long long mtime = nanoseconds();
+      ret = ret && COMPRESSION::decompressInto(&cdata[0],clen,&udata[0],udata.size(),ulen,context);
+      unsigned long long etime = nanoseconds();
+
+      ret = ret && ulen == data.size() && memcmp(&udata[0],&data[0],ulen) == 0;
+      if ( ret && i >= options.mWarmup )
+      {
+        ctimes.push_back((double)(mtime-stime));
+        dtimes.push_back((double)(etime-mtime));
+      }
+      result.mCompressedLength = clen;
+    }
+
+    if ( ret )
+    {
+      result.mCompress   = summarize(ctimes);
+      result.mDecompress = summarize(dtimes);
     }
-    scan--;
-    len--;
   }
 
-  chdir( dirname );
+  return ret;
+}
 
-  // make the current working directory be the directory the executable launched from.
-  const char *fname = "test_file.xml";
+// Reads the first half of a container of (up to) four blocks twice through a cache budgeted for two blocks, which is
+// far less than a block per shard, and checks the second read hits.
+static bool checkSeekableCache(const std::vector<unsigned char> &data)
+{
+  bool ret = false;
+  size_t blockSize = (data.size()+3)/4;
+  if ( blockSize < 64*1024 ) blockSize = 64*1024; // the smallest block compressDataParallel writes
+  size_t clen = 0;
+  void *container = COMPRESSION::compressDataParallel(&data[0],data.size(),clen,COMPRESSION::CT_LIBLZF,1,blockSize);
+  COMPRESSION::SeekableReader *reader = container ? COMPRESSION::openSeekable(container,clen) : 0;
+  if ( reader )
+  {
+    COMPRESSION::SeekableCache *cache = COMPRESSION::createSeekableCache(blockSize*2);
+    COMPRESSION::setSeekableCache(reader,cache,1);
 
-  if ( argc == 2 )
+    size_t len = blockSize*2 < data.size() ? blockSize*2 : data.size();
+    std::vector<unsigned char> udata(len);
+    ret = true;
+    for (int i=0; i<2 && ret; i++)
+    {
+      size_t outlen = 0;
+      ret = COMPRESSION::readAt(reader,0,&udata[0],len,outlen) && outlen == len && memcmp(&udata[0],&data[0],len) == 0;
+    }
+
+    COMPRESSION::SeekableCacheStats stats;
+    COMPRESSION::getSeekableCacheStats(cache,stats);
+    ret = ret && stats.mHits > 0 && stats.mBytes <= stats.mBudget;
+
+    COMPRESSION::closeSeekable(reader);
+    COMPRESSION::releaseSeekableCache(cache);
+  }
+  COMPRESSION::deleteData(container);
+  return ret;
+}
+
+static void printHeader(const Options &options)
+{
+  switch ( options.mFormat )
   {
-    fname = argv[1];
+    case OF_TEXT:
+      printf("%-12s %-10s %10s %13s %13s %7s %11s %11s %11s %11s\n", "file", "type", "level", "raw", "compressed", "ratio", "comp MB/s", "comp p99ms", "decomp MB/s", "dec p99ms");
+      break;
+    case OF_CSV:
+      printf("file,type,level,raw_bytes,compressed_bytes,ratio,runs,compress_mbps,compress_median_ns,compress_p99_ns,compress_min_ns,decompress_mbps,decompress_median_ns,decompress_p99_ns,decompress_min_ns\n");
+      break;
+    case OF_JSON:
+      printf("[\n");
+      break;
   }
+}
 
-  FILE *fph = fopen(fname,"rb");
-  if ( fph )
+// A file name as the contents of a JSON string: quotes, backslashes (as in Windows paths) and control characters
+// escaped.
+static std::string jsonEscape(const char *s)
+{
+  std::string ret;
+  for (; *s; s++)
   {
-    fseek(fph,0L,SEEK_END);
-    int len = ftell(fph);
-    fseek(fph,0L,SEEK_SET);
-    if ( len > 0 )
+    unsigned char c = (unsigned char)*s;
+    if ( c == '"' || c == '\\' )
     {
-      printf("Reading test file '%s' which is %s bytes long.\r\n", fname, formatNumber((int)len) );
-      printf("\r\n");
-      printf("---------------------------------------------------------------\r\n");
-      printf("Testing Compression rate and speed with various compressors.\r\n");
-      printf("---------------------------------------------------------------\r\n");
-      char *temp = new char[len];
-      fread(temp, len, 1, fph );
-
-#if USE_CRYPTO
-      int outlen2;
-      void *cdata2 = testCompress(temp,len,COMPRESSION::CT_CRYPTO_GZIP,outlen2);
-#endif
-#if USE_MINI_LZO
-      int outlen3;
-      void * cdata3 = testCompress(temp,len,COMPRESSION::CT_MINILZO,outlen3);
-#endif
-      int outlen4;
-      void * cdata4 = testCompress(temp,len,COMPRESSION::CT_ZLIB,outlen4);
+      ret+='\\';
+      ret+=(char)c;
+    }
+    else if ( c < 0x20 )
+    {
+      char esc[8];
+      sprintf(esc,"\\u%04x",c);
+      ret+=esc;
+    }
+    else
+    {
+      ret+=(char)c;
+    }
+  }
+  return ret;
+}
 
-      int outlen5;
-      void * cdata5 = testCompress(temp,len,COMPRESSION::CT_BZIP,outlen5);
+// A file name as the contents of a quoted CSV field, with its quotes doubled.
+static std::string csvEscape(const char *s)
+{
+  std::string ret;
+  for (; *s; s++)
+  {
+    if ( *s == '"' ) ret+='"';
+    ret+=*s;
+  }
+  return ret;
+}
 
-      int outlen6;
-      void * cdata6 = testCompress(temp,len,COMPRESSION::CT_LIBLZF,outlen6);
+static void printResult(const Options &options,const Result &r,bool first)
+{
+  const char *type = COMPRESSION::getCompressionTypeString(r.mType);
+  char level[16];
+  if ( r.mPreset != COMPRESSION::LP_DEFAULT )
+    strcpy(level,COMPRESSION::getLzmaPresetString(r.mPreset)+3); // without the LP_
+  else if ( r.mLevel < 0 )
+    strcpy(level,"default");
+  else
+    sprintf(level,"%d",r.mLevel);
+  double ratio = r.mCompressedLength ? (double)r.mRawLength/(double)r.mCompressedLength : 0;
+  double cmbs = megabytesPerSecond(r.mRawLength,r.mCompress.mMedian);
+  double dmbs = megabytesPerSecond(r.mRawLength,r.mDecompress.mMedian);
 
-      int outlen7;
-      void * cdata7 = testCompress(temp,len,COMPRESSION::CT_LZMA,outlen7);
+  switch ( options.mFormat )
+  {
+    case OF_TEXT:
+      printf("%-12.12s %-10s %10.10s %13llu %13llu %7.3f %11.1f %11.3f %11.1f %11.3f\n", r.mFile, type, r.mLevel < 0 && r.mPreset == COMPRESSION::LP_DEFAULT ? "-" : level, (unsigned long long)r.mRawLength, (unsigned long long)r.mCompressedLength,
+        ratio, cmbs, r.mCompress.mP99/1e6, dmbs, r.mDecompress.mP99/1e6 );
+      break;
+    case OF_CSV:
+      printf("\"%s\",%s,%s,%llu,%llu,%.4f,%d,%.2f,%.0f,%.0f,%.0f,%.2f,%.0f,%.0f,%.0f\n", csvEscape(r.mFile).c_str(), type, level, (unsigned long long)r.mRawLength, (unsigned long long)r.mCompressedLength,
+        ratio, options.mRuns, cmbs, r.mCompress.mMedian, r.mCompress.mP99, r.mCompress.mMin, dmbs, r.mDecompress.mMedian, r.mDecompress.mP99, r.mDecompress.mMin );
+      break;
+    case OF_JSON:
+      printf("%s  {\"file\": \"%s\", \"type\": \"%s\", \"level\": \"%s\", \"raw_bytes\": %llu, \"compressed_bytes\": %llu, \"ratio\": %.4f, \"runs\": %d,\n", first ? "" : ",\n",
+        jsonEscape(r.mFile).c_str(), type, level, (unsigned long long)r.mRawLength, (unsigned long long)r.mCompressedLength, ratio, options.mRuns );
+      printf("   \"compress\": {\"mbps\": %.2f, \"median_ns\": %.0f, \"p99_ns\": %.0f, \"min_ns\": %.0f},\n", cmbs, r.mCompress.mMedian, r.mCompress.mP99, r.mCompress.mMin );
+      printf("   \"decompress\": {\"mbps\": %.2f, \"median_ns\": %.0f, \"p99_ns\": %.0f, \"min_ns\": %.0f}}", dmbs, r.mDecompress.mMedian, r.mDecompress.mP99, r.mDecompress.mMin );
+      break;
+  }
+}
 
-      int outlen8;
-      void * cdata8 = testCompress(temp,len,COMPRESSION::CT_FASTLZ,outlen8);
+static void printFooter(const Options &options)
+{
+  if ( options.mFormat == OF_JSON )
+  {
+    printf("\n]\n");
+  }
+}
 
-      int outlen9;
-      void * cdata9 = testCompress(temp,len,COMPRESSION::CT_MINIZ,outlen9);
+static COMPRESSION::CompressionType getTypeFromName(const char *name)
+{
+  COMPRESSION::CompressionType ret = COMPRESSION::CT_INVALID;
+  for (int i=COMPRESSION::CT_INVALID+1; i<=COMPRESSION::CT_AUTO && ret == COMPRESSION::CT_INVALID; i++)
+  {
+    const char *tname = COMPRESSION::getCompressionTypeString((COMPRESSION::CompressionType)i);
+    if ( strcmp(tname,name) == 0 || strcmp(tname+3,name) == 0 ) // with or without the CT_
+    {
+      ret = (COMPRESSION::CompressionType)i;
+    }
+  }
+  return ret;
+}
 
-      delete []temp;
+static bool parseOptions(int argc,const char **argv,Options &options)
+{
+  bool ret = true;
 
-      printf("\r\n");
-      printf("---------------------------------------------------------------\r\n");
-      printf("Testing Decompression speed with various decompressors.\r\n");
-      printf("---------------------------------------------------------------\r\n");
-#if USE_CRYPTO
-      testDecompress(cdata2,outlen2);
-#endif
-#if USE_MINI_LZO
-      testDecompress(cdata3,outlen3);
-#endif
-      testDecompress(cdata4,outlen4);
-      testDecompress(cdata5,outlen5);
-      testDecompress(cdata6,outlen6);
-      testDecompress(cdata7,outlen7);
-      testDecompress(cdata8,outlen8);
-      testDecompress(cdata9,outlen9);
+  options.mRuns   = 10;
+  options.mWarmup = 1;
+  options.mFormat = OF_TEXT;
+  options.mLevels = false;
+  options.mPresets = false;
 
+  for (int i=1; i<argc && ret; i++)
+  {
+    const char *arg = argv[i];
+    if ( strcmp(arg,"-runs") == 0 && i+1 < argc )
+    {
+      options.mRuns = atoi(argv[++i]);
+      ret = options.mRuns > 0;
+    }
+    else if ( strcmp(arg,"-warmup") == 0 && i+1 < argc )
+    {
+      options.mWarmup = atoi(argv[++i]);
+      ret = options.mWarmup >= 0;
+    }
+    else if ( strcmp(arg,"-type") == 0 && i+1 < argc )
+    {
+      COMPRESSION::CompressionType type = getTypeFromName(argv[++i]);
+      options.mTypes.push_back(type);
+      ret = type != COMPRESSION::CT_INVALID;
+    }
+    else if ( strcmp(arg,"-levels") == 0 )
+    {
+      options.mLevels = true;
+    }
+    else if ( strcmp(arg,"-presets") == 0 )
+    {
+      options.mPresets = true;
+    }
+    else if ( strcmp(arg,"-csv") == 0 )
+    {
+      options.mFormat = OF_CSV;
+    }
+    else if ( strcmp(arg,"-json") == 0 )
+    {
+      options.mFormat = OF_JSON;
+    }
+    else if ( arg[0] == '-' )
+    {
+      ret = false;
     }
     else
     {
-      printf("Can't compress file '%s', it is an emtpy file.\r\n");
+      options.mFiles.push_back(arg);
     }
-    fclose(fph);
   }
-  else
+
+  if ( options.mTypes.empty() )
+  {
+    for (int i=COMPRESSION::CT_INVALID+1; i<=COMPRESSION::CT_STORED; i++)
+    {
+#if !USE_CRYPTO
+      if ( i == COMPRESSION::CT_CRYPTO_GZIP ) continue;
+#endif
+#if !USE_MINI_LZO
+      if ( i == COMPRESSION::CT_MINILZO ) continue;
+#endif
+      options.mTypes.push_back((COMPRESSION::CompressionType)i);
+    }
+  }
+  if ( options.mFiles.empty() )
+  {
+    options.mFiles.push_back("test_file.xml");
+  }
+
+  return ret;
+}
+
+int main(int argc,const char **argv)
+{
+  Options options;
+  if ( !parseOptions(argc,argv,options) )
+  {
+    fprintf(stderr,"usage: test_compression [-runs N] [-warmup N] [-type NAME]... [-levels] [-presets] [-csv | -json] [file...]\n");
+    return 2;
+  }
+
+  int ret = 0;
+  bool first = true;
+  COMPRESSION::CompressionContext *context = COMPRESSION::createCompressionContext();
+
+  printHeader(options);
+  for (size_t f=0; f<options.mFiles.size(); f++)
   {
-    printf("Failed to open test file '%s' for input.\r\n", fname );
+    const char *fname = options.mFiles[f];
+    std::vector<unsigned char> data;
+    if ( !readFile(fname,data) )
+    {
+      fprintf(stderr,"Failed to read test file '%s', or it is empty.\n", fname );
+      ret = 1;
+      continue;
+    }
+
+    for (size_t t=0; t<options.mTypes.size(); t++)
+    {
+      COMPRESSION::CompressionType type = options.mTypes[t];
+      int minLevel = -1;
+      int maxLevel = -1;
+      if ( options.mLevels && !COMPRESSION::getCompressionLevelRange(type,minLevel,maxLevel) )
+      {
+        minLevel = maxLevel = -1;
+      }
+      int minPreset = COMPRESSION::LP_DEFAULT;
+      int maxPreset = options.mPresets && type == COMPRESSION::CT_LZMA ? COMPRESSION::LP_MAX : COMPRESSION::LP_DEFAULT;
+      for (int preset=minPreset; preset<=maxPreset; preset++)
+      {
+        // the presets replace the level, so each runs once
+        for (int level=minLevel; level<=(preset == COMPRESSION::LP_DEFAULT ? maxLevel : minLevel); level++)
+        {
+          Result result;
+          if ( benchmark(options,fname,data,type,level,(COMPRESSION::LzmaPreset)preset,context,result) )
+          {
+            printResult(options,result,first);
+            first = false;
+          }
+          else
+          {
+            fprintf(stderr,"%s: %s is not available or failed to round trip.\n", fname, COMPRESSION::getCompressionTypeString(type) );
+            ret = 1;
+          }
+        }
+      }
+    }
+
+    if ( !checkSeekableCache(data) )
+    {
+      fprintf(stderr,"%s: the seekable cache failed to round trip or to hit on a repeated read.\n", fname );
+      ret = 1;
+    }
   }
+  printFooter(options);
 
-  printf("Press a key to exit.\r\n");
-  getch();
-}
\ No newline at end of file
+  COMPRESSION::releaseCompressionContext(context);
+
+  return ret;
+}
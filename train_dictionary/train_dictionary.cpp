@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+#include "../compression/compression.h"
+
+// Trains a preset dictionary from a directory of sample records and writes it as a dictionary file, which an
+// application registers with COMPRESSION::registerDictionaryFile.  Retraining as the records change needs no code
+// changes, only a new file, ideally under a new id so that data written with the old dictionary still decompresses.
+//
+// Every regular file directly in the directory is one sample.  The tool reports how zlib and LZMA compress the
+// samples with and without the dictionary, after reloading the written file to check that it round trips.
+//
+// usage: train_dictionary [-id N] [-size BYTES] sample_dir dictionary_file
+
+struct Options
+{
+  unsigned int  mId;
+  size_t        mSize;
+  const char   *mSampleDir;
+  const char   *mOutput;
+};
+
+static bool readFile(const char *fname,std::vector<unsigned char> &data)
+{
+  bool ret = false;
+
+  FILE *fph = fopen(fname,"rb");
+  if ( fph )
+  {
+    fseek(fph,0L,SEEK_END);
+    long len = ftell(fph);
+    fseek(fph,0L,SEEK_SET);
+    if ( len > 0 )
+    {
+      data.resize((size_t)len);
+      ret = fread(&data[0],(size_t)len,1,fph) == 1;
+    }
+    fclose(fph);
+  }
+
+  return ret;
+}
+
+// The paths of the regular files in 'dir', sorted so that training is repeatable.
+static bool listFiles(const char *dir,std::vector<std::string> &files)
+{
+  bool ret = false;
+
+#ifdef _WIN32
+  WIN32_FIND_DATAA fd;
+  HANDLE find = FindFirstFileA((std::string(dir)+"\\*").c_str(),&fd);
+  if ( find != INVALID_HANDLE_VALUE )
+  {
+    do
+    {
+      if ( !(fd.dwFileAttributes & (FILE_ATTRIBUTE_DIRECTORY|FILE_ATTRIBUTE_DEVICE)) )
+      {
+        files.push_back(std::string(dir)+"\\"+fd.cFileName);
+      }
+    } while ( FindNextFileA(find,&fd) );
+    FindClose(find);
+    ret = true;
+  }
+#else
+  DIR *d = opendir(dir);
+  if ( d )
+  {
+    while ( struct dirent *e = readdir(d) )
+    {
+      std::string path = std::string(dir)+"/"+e->d_name;
+      struct stat st;
+      if ( stat(path.c_str(),&st) == 0 && S_ISREG(st.st_mode) )
+      {
+        files.push_back(path);
+      }
+    }
+    closedir(d);
+    ret = true;
+  }
+#endif
+  std::sort(files.begin(),files.end());
+
+  return ret;
+}
+
+static bool parseOptions(int argc,const char **argv,Options &options)
+{
+  bool ret = true;
+
+  options.mId        = 1;
+  options.mSize      = 32768;
+  options.mSampleDir = 0;
+  options.mOutput    = 0;
+
+  for (int i=1; i<argc && ret; i++)
+  {
+    const char *arg = argv[i];
+    if ( strcmp(arg,"-id") == 0 && i+1 < argc )
+    {
+      options.mId = (unsigned int)strtoul(argv[++i],0,0);
+      ret = options.mId != 0;
+    }
+    else if ( strcmp(arg,"-size") == 0 && i+1 < argc )
+    {
+      options.mSize = (size_t)strtoul(argv[++i],0,0);
+      ret = options.mSize > 0;
+    }
+    else if ( arg[0] == '-' )
+    {
+      ret = false;
+    }
+    else if ( !options.mSampleDir )
+    {
+      options.mSampleDir = arg;
+    }
+    else if ( !options.mOutput )
+    {
+      options.mOutput = arg;
+    }
+    else
+    {
+      ret = false;
+    }
+  }
+
+  return ret && options.mOutput;
+}
+
+// The total compressed size of the samples, one record at a time, or 0 if any fails to round trip.
+static size_t compressSamples(const std::vector< std::vector<unsigned char> > &samples,COMPRESSION::CompressionType type,unsigned int dictionary,COMPRESSION::CompressionContext *context)
+{
+  size_t ret = 0;
+  COMPRESSION::CompressionOptions coptions;
+  coptions.mDictionary = dictionary;
+
+  for (size_t i=0; i<samples.size(); i++)
+  {
+    const std::vector<unsigned char> &data = samples[i];
+    std::vector<unsigned char> cdata(COMPRESSION::getMaxCompressedSize(type,data.size()));
+    std::vector<unsigned char> udata(data.size());
+    size_t clen = 0;
+    size_t ulen = 0;
+    bool ok = !cdata.empty() &&
+              COMPRESSION::compressInto(&data[0],data.size(),&cdata[0],cdata.size(),clen,type,context,COMPRESSION::CS_CRC,&coptions) &&
+              COMPRESSION::decompressInto(&cdata[0],clen,&udata[0],udata.size(),ulen,context) &&
+              ulen == data.size() && memcmp(&udata[0],&data[0],ulen) == 0;
+    if ( !ok )
+    {
+      ret = 0;
+      break;
+    }
+    ret+=clen;
+  }
+
+  return ret;
+}
+
+int main(int argc,const char **argv)
+{
+  Options options;
+  if ( !parseOptions(argc,argv,options) )
+  {
+    fprintf(stderr,"usage: train_dictionary [-id N] [-size BYTES] sample_dir dictionary_file\n");
+    return 2;
+  }
+
+  std::vector<std::string> files;
+  if ( !listFiles(options.mSampleDir,files) )
+  {
+    fprintf(stderr,"Failed to read the sample directory '%s'.\n", options.mSampleDir );
+    return 1;
+  }
+
+  std::vector< std::vector<unsigned char> > samples;
+  std::vector<const void *> pointers;
+  std::vector<size_t> lengths;
+  size_t total = 0;
+  for (size_t i=0; i<files.size(); i++)
+  {
+    std::vector<unsigned char> data;
+    if ( readFile(files[i].c_str(),data) ) // empty files teach nothing
+    {
+      total+=data.size();
+      samples.push_back(data);
+    }
+  }
+  for (size_t i=0; i<samples.size(); i++)
+  {
+    pointers.push_back(&samples[i][0]);
+    lengths.push_back(samples[i].size());
+  }
+
+  std::vector<unsigned char> dict(options.mSize);
+  size_t dlen = samples.empty() ? 0 : COMPRESSION::trainDictionary(&pointers[0],&lengths[0],samples.size(),&dict[0],dict.size());
+  if ( dlen == 0 )
+  {
+    fprintf(stderr,"%llu bytes in %llu samples are too little to train a dictionary from.\n", (unsigned long long)total, (unsigned long long)samples.size() );
+    return 1;
+  }
+
+  unsigned int id = 0;
+  if ( !COMPRESSION::saveDictionary(options.mOutput,options.mId,&dict[0],dlen) || !COMPRESSION::registerDictionaryFile(options.mOutput,&id) || id != options.mId )
+  {
+    fprintf(stderr,"Failed to write the dictionary file '%s'.\n", options.mOutput );
+    return 1;
+  }
+
+  printf("%s: dictionary %u, %llu bytes, trained on %llu bytes in %llu samples\n", options.mOutput, id, (unsigned long long)dlen,
+    (unsigned long long)total, (unsigned long long)samples.size() );
+
+  int ret = 0;
+  COMPRESSION::CompressionContext *context = COMPRESSION::createCompressionContext();
+  const COMPRESSION::CompressionType types[] = { COMPRESSION::CT_ZLIB, COMPRESSION::CT_LZMA };
+  for (size_t t=0; t<sizeof(types)/sizeof(types[0]); t++)
+  {
+    size_t plain = compressSamples(samples,types[t],0,context);
+    size_t withDict = compressSamples(samples,types[t],id,context);
+    if ( plain && withDict )
+    {
+      printf("%-10s %13llu bytes without the dictionary (%.3f), %13llu with it (%.3f)\n", COMPRESSION::getCompressionTypeString(types[t]),
+        (unsigned long long)plain, (double)total/(double)plain, (unsigned long long)withDict, (double)total/(double)withDict );
+    }
+    else
+    {
+      fprintf(stderr,"%s failed to round trip the samples.\n", COMPRESSION::getCompressionTypeString(types[t]) );
+      ret = 1;
+    }
+  }
+  COMPRESSION::releaseCompressionContext(context);
+  COMPRESSION::unregisterDictionary(id);
+
+  return ret;
+}
@@ -161,6 +161,115 @@ local const config configuration_table[10] = {
 struct static_tree_desc_s {int dummy;}; /* for buggy compilers */
 #endif
 
+/* ===========================================================================
+ * SIMD string comparison and CRC32 instruction hashing for x86-64, chosen at
+ * run time by deflateInit2. compare256 finds the first differing byte of two
+ * strings 16 or 32 bytes at a time. The CRC hash mixes all the bits of the
+ * first MIN_MATCH bytes of a string, where UPDATE_HASH drops the top bits of
+ * the first byte, so hash chains hold fewer false candidates. Either may
+ * change which matches are found, but not the format of the output.
+ */
+#if defined(_M_X64) || defined(__x86_64__)
+#  define DEFLATE_SIMD
+#  ifdef _MSC_VER
+#    include <intrin.h>
+#    include <immintrin.h>
+#    define SIMD_TARGET(t)
+#  else
+#    include <cpuid.h>
+#    include <immintrin.h>
+#    define SIMD_TARGET(t) __attribute__((target(t)))
+#  endif
+
+local void cpu_features OF((int *sse42, int *avx2));
+local uInt compare256_sse2 OF((const Bytef *scan, const Bytef *match));
+local uInt compare256_avx2 OF((const Bytef *scan, const Bytef *match));
+local uInt crc_hash OF((deflate_state *s, uInt str));
+
+local void cpu_features(sse42, avx2)
+    int *sse42;
+    int *avx2;
+{
+    unsigned int regs[4] = {0, 0, 0, 0};  /* eax, ebx, ecx, edx */
+    unsigned int max = 0;
+    *sse42 = *avx2 = 0;
+#ifdef _MSC_VER
+    __cpuid((int *)regs, 0);
+    max = regs[0];
+    __cpuid((int *)regs, 1);
+#else
+    max = __get_cpuid_max(0, 0);
+    __cpuid(1, regs[0], regs[1], regs[2], regs[3]);
+#endif
+    *sse42 = (regs[2] >> 20) & 1;
+    /* AVX2 also needs the OS to save the ymm registers (OSXSAVE, AVX, XCR0) */
+    if (max >= 7 && (regs[2] & (1u << 27)) && (regs[2] & (1u << 28))) {
+        unsigned int xcr0;
+#ifdef _MSC_VER
+        xcr0 = (unsigned int)_xgetbv(0);
+        __cpuidex((int *)regs, 7, 0);
+#else
+        unsigned int edx;
+        __asm__ ("xgetbv" : "=a"(xcr0), "=d"(edx) : "c"(0));
+        __cpuid_count(7, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+        *avx2 = (xcr0 & 6) == 6 && ((regs[1] >> 5) & 1);
+    }
+}
+
+#ifdef _MSC_VER
+#  define ctz32(x) (_BitScanForward(&ctz_index, (x)), (uInt)ctz_index)
+#  define CTZ_DECL unsigned long ctz_index;
+#else
+#  define ctz32(x) ((uInt)__builtin_ctz(x))
+#  define CTZ_DECL
+#endif
+
+local uInt compare256_sse2(scan, match)
+    const Bytef *scan;
+    const Bytef *match;
+{
+    uInt len = 0;
+    CTZ_DECL
+    do {
+        __m128i a = _mm_loadu_si128((const __m128i *)(scan + len));
+        __m128i b = _mm_loadu_si128((const __m128i *)(match + len));
+        unsigned diff = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) ^ 0xffff;
+        if (diff != 0) return len + ctz32(diff);
+        len += 16;
+    } while (len < 256);
+    return 256;
+}
+
+SIMD_TARGET("avx2")
+local uInt compare256_avx2(scan, match)
+    const Bytef *scan;
+    const Bytef *match;
+{
+    uInt len = 0;
+    CTZ_DECL
+    do {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(scan + len));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(match + len));
+        unsigned diff = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+        if (diff != 0) return len + ctz32(diff);
+        len += 32;
+    } while (len < 256);
+    return 256;
+}
+
+/* Reads a fourth byte, which the window always has room for, and masks it. */
+SIMD_TARGET("sse4.2")
+local uInt crc_hash(s, str)
+    deflate_state *s;
+    uInt str;
+{
+    unsigned int val;
+    zmemcpy((Bytef *)&val, s->window + str, sizeof(val));
+    return (uInt)_mm_crc32_u32(0, val & 0xffffff) & s->hash_mask;
+}
+#endif /* DEFLATE_SIMD */
+
 /* ===========================================================================
  * Update a hash value with the given input byte
  * IN  assertion: all calls to to UPDATE_HASH are made with consecutive
@@ -185,6 +294,12 @@ struct static_tree_desc_s {int dummy;}; /* for buggy compilers */
    (UPDATE_HASH(s, s->ins_h, s->window[(str) + (MIN_MATCH-1)]), \
     match_head = s->head[s->ins_h], \
     s->head[s->ins_h] = (Pos)(str))
+#elif defined(DEFLATE_SIMD)
+#define INSERT_STRING(s, str, match_head) \
+   ((s->crc_hash ? (void)(s->ins_h = crc_hash(s, (str))) : \
+                   (void)UPDATE_HASH(s, s->ins_h, s->window[(str) + (MIN_MATCH-1)])), \
+    match_head = s->prev[(str) & s->w_mask] = s->head[s->ins_h], \
+    s->head[s->ins_h] = (Pos)(str))
 #else
 #define INSERT_STRING(s, str, match_head) \
    (UPDATE_HASH(s, s->ins_h, s->window[(str) + (MIN_MATCH-1)]), \
@@ -284,6 +399,17 @@ int ZEXPORT deflateInit2_(strm, level, method, windowBits, memLevel, strategy,
     s->hash_mask = s->hash_size - 1;
     s->hash_shift =  ((s->hash_bits+MIN_MATCH-1)/MIN_MATCH);
 
+    s->crc_hash = 0;
+    s->compare = Z_NULL;
+#ifdef DEFLATE_SIMD
+    {
+        int sse42, avx2;
+        cpu_features(&sse42, &avx2);
+        s->crc_hash = sse42;
+        s->compare = avx2 ? compare256_avx2 : compare256_sse2;
+    }
+#endif
+
     s->window = (Bytef *) ZALLOC(strm, s->w_size, 2*sizeof(Byte));
     s->prev   = (Posf *)  ZALLOC(strm, s->w_size, sizeof(Pos));
     s->head   = (Posf *)  ZALLOC(strm, s->hash_size, sizeof(Pos));
@@ -1123,6 +1249,14 @@ local uInt longest_match(s, cur_match)
             *match            != *scan     ||
             *++match          != scan[1])      continue;
 
+        /* With the CRC hash equal keys do not imply equal third bytes, so
+         * compare256 starts at scan[2]. scan+2+256 is strstart+MAX_MATCH,
+         * which stays inside the window.
+         */
+        if (s->compare != Z_NULL) {
+            len = 2 + (int)s->compare(scan + 2, match + 1);
+        } else {
+
         /* The check at best_len-1 can be removed because it will be made
          * again later. (This heuristic is not always a win.)
          * It is not necessary to compare scan[2] and match[2] since they
@@ -1146,6 +1280,7 @@ local uInt longest_match(s, cur_match)
 
         len = MAX_MATCH - (int)(strend - scan);
         scan = strend - MAX_MATCH;
+        }
 
 #endif /* UNALIGNED_OK */
 
@@ -1196,6 +1331,13 @@ local uInt longest_match_fast(s, cur_match)
      */
     if (match[0] != scan[0] || match[1] != scan[1]) return MIN_MATCH-1;
 
+    if (s->compare != Z_NULL) {
+        len = 2 + (int)s->compare(scan + 2, match + 2);
+        if (len < MIN_MATCH) return MIN_MATCH - 1;
+        s->match_start = cur_match;
+        return (uInt)len <= s->lookahead ? (uInt)len : s->lookahead;
+    }
+
     /* The check at best_len-1 can be removed because it will be made
      * again later. (This heuristic is not always a win.)
      * It is not necessary to compare scan[2] and match[2] since they
@@ -145,6 +145,16 @@ typedef struct internal_state {
      *   hash_shift * MIN_MATCH >= hash_bits
      */
 
+    int crc_hash;
+    /* Nonzero to hash each string from its first MIN_MATCH bytes with the
+     * CRC32 instruction instead of updating ins_h with UPDATE_HASH.
+     */
+
+    uInt (*compare) OF((const Bytef *scan, const Bytef *match));
+    /* Returns how many of the first 256 bytes of scan and match are equal,
+     * using SIMD, or Z_NULL to compare a byte at a time.
+     */
+
     long block_start;
     /* Window position at the beginning of the current output block. Gets
      * negative when the window is moved backwards.
@@ -29,6 +29,28 @@
 #  define PUP(a) *++(a)
 #endif
 
+/* On 64-bit targets with cheap unaligned loads and stores the bit buffer is
+   refilled eight bytes at a time, which leaves enough bits for a whole
+   length/distance pair, and matches are copied eight or sixteen bytes at a
+   time.  Elsewhere the byte at a time code below is used as before.
+ */
+#if defined(_M_X64) || defined(__x86_64__) || defined(_M_ARM64) || defined(__aarch64__)
+#  define INFLATE_FAST64
+typedef unsigned long long hold_t;
+
+/* little endian targets only, so the first byte is the lowest */
+local hold_t load64 OF((const unsigned char FAR *p));
+local hold_t load64(p)
+const unsigned char FAR *p;
+{
+    hold_t v;
+    zmemcpy((Bytef *)&v, (const Bytef *)p, sizeof(v));
+    return v;
+}
+#else
+typedef unsigned long hold_t;
+#endif
+
 /*
    Decode literal, length, and distance codes and write out the resulting
    literal and match bytes until either not enough input or output is
@@ -40,8 +62,8 @@
    Entry assumptions:
 
         state->mode == LEN
-        strm->avail_in >= 6
-        strm->avail_out >= 258
+        strm->avail_in >= INFLATE_FAST_MIN_IN
+        strm->avail_out >= INFLATE_FAST_MIN_OUT
         start >= strm->avail_out
         state->bits < 8
 
@@ -57,12 +79,15 @@
       length code, 5 bits for the length extra, 15 bits for the distance code,
       and 13 bits for the distance extra.  This totals 48 bits, or six bytes.
       Therefore if strm->avail_in >= 6, then there is enough input to avoid
-      checking for available input while decoding.
+      checking for available input while decoding.  The 64-bit refill reads
+      eight bytes at once, and keeps at least 56 bits in the buffer, so it
+      needs eight bytes and refills only once per length/distance pair.
 
     - The maximum bytes that a single length/distance pair can output is 258
       bytes, which is the maximum length that can be coded.  inflate_fast()
       requires strm->avail_out >= 258 for each loop to avoid checking for
-      output space.
+      output space, and 15 bytes more for the wide copies, which may write
+      past the end of the match.
  */
 void inflate_fast(strm, start)
 z_streamp strm;
@@ -81,7 +106,7 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
     unsigned whave;             /* valid bytes in the window */
     unsigned write;             /* window write index */
     unsigned char FAR *window;  /* allocated sliding window, if wsize != 0 */
-    unsigned long hold;         /* local strm->hold */
+    hold_t hold;                /* local strm->hold */
     unsigned bits;              /* local strm->bits */
     code const FAR *lcode;      /* local strm->lencode */
     code const FAR *dcode;      /* local strm->distcode */
@@ -97,10 +122,10 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
     /* copy state to local variables */
     state = (struct inflate_state FAR *)strm->state;
     in = strm->next_in - OFF;
-    last = in + (strm->avail_in - 5);
+    last = in + (strm->avail_in - (INFLATE_FAST_MIN_IN - 1));
     out = strm->next_out - OFF;
     beg = out - (start - strm->avail_out);
-    end = out + (strm->avail_out - 257);
+    end = out + (strm->avail_out - (INFLATE_FAST_MIN_OUT - 1));
 #ifdef INFLATE_STRICT
     dmax = state->dmax;
 #endif
@@ -118,12 +143,20 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
     /* decode literals and length/distances until end-of-block or not enough
        input data or output space */
     do {
+#ifdef INFLATE_FAST64
+        /* bits above the count are those of the next byte, which the next
+           refill loads again in the same place, so or-ing them is safe */
+        hold |= load64(in + OFF) << bits;
+        in += (63 - bits) >> 3;
+        bits |= 56;
+#else
         if (bits < 15) {
             hold += (unsigned long)(PUP(in)) << bits;
             bits += 8;
             hold += (unsigned long)(PUP(in)) << bits;
             bits += 8;
         }
+#endif
         this = lcode[hold & lmask];
       dolen:
         op = (unsigned)(this.bits);
@@ -140,21 +173,25 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
             len = (unsigned)(this.val);
             op &= 15;                           /* number of extra bits */
             if (op) {
+#ifndef INFLATE_FAST64
                 if (bits < op) {
                     hold += (unsigned long)(PUP(in)) << bits;
                     bits += 8;
                 }
+#endif
                 len += (unsigned)hold & ((1U << op) - 1);
                 hold >>= op;
                 bits -= op;
             }
             Tracevv((stderr, "inflate:         length %u\n", len));
+#ifndef INFLATE_FAST64
             if (bits < 15) {
                 hold += (unsigned long)(PUP(in)) << bits;
                 bits += 8;
                 hold += (unsigned long)(PUP(in)) << bits;
                 bits += 8;
             }
+#endif
             this = dcode[hold & dmask];
           dodist:
             op = (unsigned)(this.bits);
@@ -164,6 +201,7 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
             if (op & 16) {                      /* distance base */
                 dist = (unsigned)(this.val);
                 op &= 15;                       /* number of extra bits */
+#ifndef INFLATE_FAST64
                 if (bits < op) {
                     hold += (unsigned long)(PUP(in)) << bits;
                     bits += 8;
@@ -172,6 +210,7 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
                         bits += 8;
                     }
                 }
+#endif
                 dist += (unsigned)hold & ((1U << op) - 1);
 #ifdef INFLATE_STRICT
                 if (dist > dmax) {
@@ -245,6 +284,38 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
                 }
                 else {
                     from = out - dist;          /* copy direct from output */
+#ifdef INFLATE_FAST64
+                    /* a chunk no longer than the distance only reads bytes
+                       already written, so overlapping matches come out
+                       right; the last chunk may write past the match */
+                    if (dist >= 8) {
+                        unsigned char FAR *stop = out + len;
+                        if (dist >= 16) {
+                            do {
+                                zmemcpy(out + OFF, from + OFF, 16);
+                                out += 16;
+                                from += 16;
+                            } while (out < stop);
+                        }
+                        else {
+                            do {
+                                zmemcpy(out + OFF, from + OFF, 8);
+                                out += 8;
+                                from += 8;
+                            } while (out < stop);
+                        }
+                        out = stop;
+                        continue;
+                    }
+                    if (dist == 1) {            /* run of one byte */
+                        unsigned char FAR *stop = out + len;
+                        unsigned char c = from[OFF];
+                        do {
+                            PUP(out) = c;
+                        } while (out < stop);
+                        continue;
+                    }
+#endif
                     do {                        /* minimum length is three */
                         PUP(out) = PUP(from);
                         PUP(out) = PUP(from);
@@ -288,15 +359,18 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
     len = bits >> 3;
     in -= len;
     bits -= len << 3;
-    hold &= (1U << bits) - 1;
+    hold &= ((hold_t)1 << bits) - 1;
 
     /* update state and return */
     strm->next_in = in + OFF;
     strm->next_out = out + OFF;
-    strm->avail_in = (unsigned)(in < last ? 5 + (last - in) : 5 - (in - last));
+    strm->avail_in = (unsigned)(in < last ?
+        (INFLATE_FAST_MIN_IN - 1) + (last - in) :
+        (INFLATE_FAST_MIN_IN - 1) - (in - last));
     strm->avail_out = (unsigned)(out < end ?
-                                 257 + (end - out) : 257 - (out - end));
-    state->hold = hold;
+        (INFLATE_FAST_MIN_OUT - 1) + (end - out) :
+        (INFLATE_FAST_MIN_OUT - 1) - (out - end));
+    state->hold = (unsigned long)hold;
     state->bits = bits;
     return;
 }
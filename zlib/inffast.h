@@ -8,4 +8,11 @@
    subject to change. Applications should only use zlib.h.
  */
 
+/* inflate() and inflateBack() call inflate_fast() only when at least this
+   much input and output is available: a 64-bit refill reads eight bytes,
+   and a wide match copy may write up to 15 bytes past the 258 byte longest
+   match. */
+#define INFLATE_FAST_MIN_IN 8
+#define INFLATE_FAST_MIN_OUT 273
+
 void inflate_fast OF((z_streamp strm, unsigned start));
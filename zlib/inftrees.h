@@ -39,7 +39,9 @@ typedef struct {
    exhaustive search was 1444 code structures (852 for length/literals
    and 592 for distances, the latter actually the result of an
    exhaustive search).  The true maximum is not known, but the value
-   below is more than safe. */
+   below is more than safe.  With the 10 bit root table inflate now uses
+   for length/literals, an exhaustive search gives at most 1332 for them,
+   which with 592 for distances still fits. */
 #define ENOUGH 2048
 #define MAXD 592
 
@@ -329,8 +329,6 @@ typedef uLong FAR uLongf;
 #   pragma map(inflate_copyright,"INCOPY")
 #endif
 
-#define FASTEST 1
-#define ASMV 1
 #define NO_GZCOMPRESS 1
 #define NO_GZIP 1
 